@@ -0,0 +1,30 @@
+#pragma once
+
+#include <chrono>
+#include <stdint.h>
+
+// Runs `work` until at least `minimumNs` has passed and returns the average
+// nanoseconds per call
+template <typename F> static double measure(F &&work, uint64_t minimumNs) {
+  using clock = std::chrono::steady_clock;
+
+  // Warm up caches and branch predictors before timing
+  work();
+
+  uint64_t iterations = 0;
+  uint64_t elapsed = 0;
+  auto start = clock::now();
+
+  while (elapsed < minimumNs) {
+    work();
+    iterations++;
+    elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  clock::now() - start)
+                  .count();
+  }
+
+  return static_cast<double>(elapsed) / iterations;
+}
+
+int audioBench(int argc, char *argv[]);
+int videoBench(int argc, char *argv[]);
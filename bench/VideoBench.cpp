@@ -0,0 +1,315 @@
+#include "Bench.h"
+#include "BoundedQueue.h"
+#include "CLI11.h"
+#include "Decoder.h"
+#include "Encoder.h"
+#include "FrameCorpus.h"
+#include "Payload.h"
+#include "Socket.h"
+#include "SyntheticFrame.h"
+#include "Utility.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <sys/socket.h>
+#include <thread>
+#include <vector>
+
+namespace {
+
+enum Stage { PIXEL_FORMAT, RGB_TO_YUV, ENCODE, TRANSPORT, DECODE, STAGE_COUNT };
+
+constexpr const char *STAGE_NAMES[STAGE_COUNT] = {
+    "pixel format", "rgb->yuv", "encode", "payload+socket", "decode"};
+
+const std::map<std::string, spa_video_format> FORMATS = {
+    {"rgb", SPA_VIDEO_FORMAT_RGB},   {"bgr", SPA_VIDEO_FORMAT_BGR},
+    {"rgbx", SPA_VIDEO_FORMAT_RGBx}, {"bgrx", SPA_VIDEO_FORMAT_BGRx},
+    {"rgba", SPA_VIDEO_FORMAT_RGBA}, {"bgra", SPA_VIDEO_FORMAT_BGRA},
+    {"xrgb", SPA_VIDEO_FORMAT_xRGB}, {"xbgr", SPA_VIDEO_FORMAT_xBGR},
+};
+
+// Frames in the layout PipeWire hands the server
+class FrameSource {
+public:
+  virtual ~FrameSource() = default;
+
+  virtual int Width() const = 0;
+  virtual int Height() const = 0;
+  virtual spa_video_format Format() const = 0;
+  virtual uint32_t Frames() const = 0;
+  virtual const uint8_t *Frame(uint32_t index) = 0;
+};
+
+class CorpusSource : public FrameSource {
+private:
+  FrameCorpus m_Corpus;
+
+public:
+  explicit CorpusSource(const std::string &path) : m_Corpus(path) {}
+
+  int Width() const override { return m_Corpus.Width(); }
+  int Height() const override { return m_Corpus.Height(); }
+  spa_video_format Format() const override {
+    return static_cast<spa_video_format>(m_Corpus.Format());
+  }
+  uint32_t Frames() const override { return m_Corpus.Frames(); }
+  const uint8_t *Frame(uint32_t index) override {
+    return m_Corpus.Frame(index);
+  }
+};
+
+class SyntheticSource : public FrameSource {
+private:
+  SyntheticFrame m_Frame;
+  uint32_t m_Frames;
+
+public:
+  SyntheticSource(int width, int height, spa_video_format format,
+                  uint32_t frames)
+      : m_Frame(width, height, format), m_Frames(frames) {}
+
+  int Width() const override { return m_Frame.Width(); }
+  int Height() const override { return m_Frame.Height(); }
+  spa_video_format Format() const override { return m_Frame.Format(); }
+  uint32_t Frames() const override { return m_Frames; }
+  const uint8_t *Frame(uint32_t index) override {
+    return m_Frame.Render(index);
+  }
+};
+
+double psnr(const uint8_t *a, const uint8_t *b, size_t size) {
+  uint64_t error = 0;
+  for (size_t i = 0; i < size; i++) {
+    int diff = static_cast<int>(a[i]) - static_cast<int>(b[i]);
+    error += diff * diff;
+  }
+
+  if (!error)
+    return 99.0;
+
+  double mse = static_cast<double>(error) / size;
+  return 10.0 * std::log10(255.0 * 255.0 / mse);
+}
+
+void run(FrameSource &source, const std::string &preset, uint32_t frames,
+         bool encrypt) {
+  int width = source.Width();
+  int height = source.Height();
+  int chromaWidth = (width + 1) / 2;
+  int chromaHeight = (height + 1) / 2;
+
+  Encoder encoder;
+  encoder.initialize(width, height, preset.c_str());
+
+  Decoder decoder;
+  decoder.initialize(width, height, Decoder::Options{});
+
+  // Same conversion the encoder does, so PSNR only measures the codec
+  SwsContext *reference =
+      sws_getContext(width, height, AV_PIX_FMT_RGB24, width, height,
+                     AV_PIX_FMT_YUV420P, SWS_FAST_BILINEAR, nullptr, nullptr,
+                     nullptr);
+  std::vector<uint8_t> referencePlanes(static_cast<size_t>(width) * height +
+                                       chromaWidth * chromaHeight * 2);
+  uint8_t *referenceData[3] = {
+      referencePlanes.data(),
+      referencePlanes.data() + static_cast<size_t>(width) * height,
+      referencePlanes.data() + static_cast<size_t>(width) * height +
+          chromaWidth * chromaHeight};
+  int referenceLinesize[3] = {width, chromaWidth, chromaWidth};
+
+  // The real framing over a socketpair, read back on another thread like the
+  // client's stream thread
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+    throw std::runtime_error("Failed to create socketpair");
+
+  Socket sender(fds[0]);
+  Socket receiver(fds[1]);
+
+  // Records as an authenticated session sends them, keys don't matter here
+  if (encrypt) {
+    std::vector<uint8_t> keys = randomBytes(Socket::KEY_MATERIAL_SIZE);
+    sender.encrypt(keys, true);
+    receiver.encrypt(keys, false);
+  }
+  BoundedQueue<std::vector<uint8_t>> received{4};
+
+  std::thread reader([&]() {
+    std::vector<uint8_t> message;
+    while (receiver.read(message) > 0)
+      received.TryPush(std::move(message));
+    received.Close();
+  });
+
+  std::vector<uint8_t> rgb(static_cast<size_t>(width) * height * 3);
+  std::vector<uint64_t> times[STAGE_COUNT];
+  uint64_t bytes = 0;
+  double lumaPsnr = 0.0;
+  double minimumPsnr = 99.0;
+  uint32_t compared = 0;
+
+  for (uint32_t i = 0; i < frames; i++) {
+    const uint8_t *frame = source.Frame(i % source.Frames());
+
+    uint64_t start = monotonicNs();
+    writeTobuffer(&rgb, frame, width, height, source.Format());
+    uint64_t converted = monotonicNs();
+
+    std::vector<uint8_t> encoded = encoder.encode(rgb);
+    const Encoder::Timings &timings = encoder.timings();
+
+    times[PIXEL_FORMAT].push_back(converted - start);
+    times[RGB_TO_YUV].push_back(timings.converted - converted);
+    times[ENCODE].push_back(timings.encoded - timings.converted);
+
+    if (encoded.empty())
+      continue;
+
+    bytes += encoded.size();
+
+    uint64_t sent = monotonicNs();
+    Payload payload;
+    payload.set("stream-video");
+    payload.set(start);
+    payload.set(encoded.data(), encoded.size());
+    sender.send(payload.buffer.data(), payload.buffer.size());
+
+    std::vector<uint8_t> message;
+    if (!received.Pop(message))
+      break;
+    std::vector<uint8_t> data = Payload::get(2, message);
+    uint64_t arrived = monotonicNs();
+
+    std::vector<uint8_t> planes = decoder.decode(data);
+    uint64_t decoded = monotonicNs();
+
+    times[TRANSPORT].push_back(arrived - sent);
+    times[DECODE].push_back(decoded - arrived);
+
+    if (planes.size() < static_cast<size_t>(width) * height)
+      continue;
+
+    const uint8_t *rgbData[1] = {rgb.data()};
+    int rgbLinesize[1] = {width * 3};
+    sws_scale(reference, rgbData, rgbLinesize, 0, height, referenceData,
+              referenceLinesize);
+
+    double value = psnr(referencePlanes.data(), planes.data(),
+                        static_cast<size_t>(width) * height);
+    lumaPsnr += value;
+    minimumPsnr = std::min(minimumPsnr, value);
+    compared++;
+  }
+
+  shutdown(fds[0], SHUT_WR);
+  reader.join();
+  sws_freeContext(reference);
+
+  double totalNs = 0.0;
+
+  printf("%dx%d, preset %s, %u frames%s\n", width, height, preset.c_str(),
+         frames, encrypt ? ", encrypted" : "");
+
+  for (int stage = 0; stage < STAGE_COUNT; stage++) {
+    std::vector<uint64_t> &samples = times[stage];
+    if (samples.empty())
+      continue;
+
+    std::sort(samples.begin(), samples.end());
+
+    double average = 0.0;
+    for (uint64_t sample : samples)
+      average += sample;
+    average /= samples.size();
+    totalNs += average;
+
+    printf("  %-16s %10.0f ns/frame avg %10llu p95\n", STAGE_NAMES[stage],
+           average,
+           static_cast<unsigned long long>(
+               samples[samples.size() * 95 / 100]));
+  }
+
+  printf("  %-16s %10.1f fps, %.0f bytes/frame (%.2f Mbit/s at 60 fps)\n",
+         "pipeline", 1e9 / totalNs, static_cast<double>(bytes) / frames,
+         bytes * 8.0 * 60.0 / frames / 1e6);
+
+  if (compared)
+    printf("  %-16s %10.2f dB luma PSNR avg, %.2f dB min\n", "quality",
+           lumaPsnr / compared, minimumPsnr);
+}
+
+} // namespace
+
+int videoBench(int argc, char *argv[]) {
+  CLI::App app{"Replays captured or synthetic frames through the video "
+               "pipeline"};
+
+  std::string corpus;
+  std::vector<std::string> sizes = {"1920x1080"};
+  std::vector<std::string> formats = {"bgrx"};
+  std::vector<std::string> presets = {"ultrafast"};
+  uint32_t frames = 0;
+  bool encrypt = false;
+
+  app.add_option("--corpus", corpus,
+                 "Frames recorded with ssrd-server --record-raw, replaces "
+                 "the synthetic ones");
+  app.add_option("--size", sizes, "Synthetic frame sizes, e.g. 1280x720")
+      ->delimiter(',');
+  app.add_option("--format", formats,
+                 "Synthetic capture formats: rgb, bgr, rgbx, bgrx, rgba, "
+                 "bgra, xrgb, xbgr")
+      ->delimiter(',')
+      ->check(CLI::IsMember(FORMATS));
+  app.add_option("--preset", presets, "x264 presets to compare")
+      ->delimiter(',');
+  app.add_option("--frames", frames,
+                 "Frames per run. Defaults to the whole corpus or 300");
+  app.add_flag("--encrypt", encrypt,
+               "Send AES-256-GCM records like an authenticated session");
+
+  CLI11_PARSE(app, argc, argv);
+
+  try {
+    if (!corpus.empty()) {
+      CorpusSource source(corpus);
+
+      // A recording cut short before its first frame was complete
+      if (!source.Frames()) {
+        fprintf(stderr, "%s holds no complete frame\n", corpus.c_str());
+        return 1;
+      }
+
+      for (const std::string &preset : presets)
+        run(source, preset, frames ? frames : source.Frames(), encrypt);
+      return 0;
+    }
+
+    for (const std::string &size : sizes) {
+      int width = 0;
+      int height = 0;
+      if (sscanf(size.c_str(), "%dx%d", &width, &height) != 2 || width <= 0 ||
+          height <= 0) {
+        fprintf(stderr, "Invalid size %s\n", size.c_str());
+        return 1;
+      }
+
+      for (const std::string &format : formats) {
+        printf("synthetic %s\n", format.c_str());
+        SyntheticSource source(width, height, FORMATS.at(format),
+                               frames ? frames : 300);
+        for (const std::string &preset : presets)
+          run(source, preset, source.Frames(), encrypt);
+      }
+    }
+  } catch (const std::exception &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+
+  return 0;
+}
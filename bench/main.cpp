@@ -0,0 +1,16 @@
+#include "Bench.h"
+
+#include <cstring>
+#include <iostream>
+
+int main(int argc, char *argv[]) {
+  if (argc < 2 || !strcmp(argv[1], "audio"))
+    return audioBench(argc - 1, argv + 1);
+
+  if (!strcmp(argv[1], "video"))
+    return videoBench(argc - 1, argv + 1);
+
+  std::cerr << "Usage: " << argv[0] << " [audio | video [options]]"
+            << std::endl;
+  return 1;
+}
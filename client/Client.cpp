@@ -2,10 +2,39 @@
 
 #include "CLI11.h"
 #include "Constant.h"
+#include "H264.h"
+#include "KnownHosts.h"
 #include "Payload.h"
+#include "ProbeMarker.h"
+#include "Trace.h"
 
 static const std::string HOME_DIR = getHomeDirectory();
 
+// Upper bound on how long the render loop sleeps without a frame or input
+static constexpr double IDLE_TIMEOUT_S = 0.1;
+
+// Same threshold StreamPlayer drops frames at, decoding them is wasted work
+static constexpr uint64_t LATE_FRAME_NS = 30'000'000;     // 30 ms
+static constexpr uint64_t HOPELESS_FRAME_NS = 500'000'000; // 500 ms
+
+static constexpr uint64_t PING_INTERVAL_NS = 1'000'000'000; // 1 s
+
+// Longer gaps are left to the jitter buffer, concealment turns to mush
+static constexpr int32_t MAX_CONCEALED_AUDIO = 5;
+
+// Overlay columns, and how many pixels a millisecond of latency is
+static constexpr size_t OVERLAY_BARS = 240;
+static constexpr double OVERLAY_PIXELS_PER_MS = 4.0;
+
+static Metrics::Histogram &audioDecodeTime = Metrics::Get().GetHistogram(
+    "ssrd_audio_decode_seconds", "Opus decode and concealment per packet");
+static Metrics::Histogram &presentLatency = Metrics::Get().GetHistogram(
+    "ssrd_present_latency_seconds", "Decoded frame to swap");
+static Metrics::Histogram &endToEndLatency = Metrics::Get().GetHistogram(
+    "ssrd_end_to_end_latency_seconds", "Server capture to swap");
+static Metrics::Counter &presentedFrames = Metrics::Get().GetCounter(
+    "ssrd_video_presented_frames_total", "Frames swapped to the screen");
+
 Client::~Client() { m_Running.store(false); }
 
 int Client::initialize(int argc, char *argv[]) {
@@ -17,6 +46,7 @@ int Client::initialize(int argc, char *argv[]) {
     app.set_help_flag("--help", "Display help information.");
 
     m_Identity = HOME_DIR + "/.ssrd/id_rsa";
+    m_KnownHosts = HOME_DIR + "/.ssrd/known_hosts";
 
     app.add_option("-h,--host", m_IP,
                    "The IP address of the destination server eg. 127.0.0.1")
@@ -27,7 +57,73 @@ int Client::initialize(int argc, char *argv[]) {
 
     app.add_option("-i", m_Identity, "Identity file");
 
+    app.add_option("--known-hosts", m_KnownHosts,
+                   "Server host keys pinned on first connect. Defaults to "
+                   "~/.ssrd/known_hosts");
+
+    app.add_option("--present-mode", m_PresentMode,
+                   "vsync (default), low-latency or adaptive")
+        ->transform(CLI::CheckedTransformer(
+            std::map<std::string, PresentMode>{
+                {"vsync", PresentMode::VSYNC},
+                {"low-latency", PresentMode::LOW_LATENCY},
+                {"adaptive", PresentMode::ADAPTIVE},
+            },
+            CLI::ignore_case));
+
+    app.add_option("--decode-threads", m_DecoderOptions.threads,
+                   "Video decoder threads. Defaults to one per core");
+
+    app.add_option("--frame-threading-budget",
+                   m_DecoderOptions.frameThreadingBudgetMs,
+                   "Milliseconds of extra latency frame threaded decoding may "
+                   "add. Defaults to 0 (slice threading only)")
+        ->check(CLI::NonNegativeNumber);
+
+    app.add_flag("--fast-decode", m_DecoderOptions.fast,
+                 "Allow non spec compliant decoder speedups");
+
+    app.add_option("--pointer-rate", m_PointerRate,
+                   "Pointer updates sent per second. Defaults to the display "
+                   "refresh rate")
+        ->check(CLI::NonNegativeNumber);
+
+    app.add_flag("--pointer-lock", m_PointerLock,
+                 "Start with the pointer locked to the window and send "
+                 "relative motion, toggle with Ctrl+Shift+L");
+
+    app.add_flag("--microphone", m_MicrophoneEnabled,
+                 "Stream the default input device to the server's virtual "
+                 "microphone");
+
+    std::string metricsPath;
+    app.add_option("--metrics", metricsPath,
+                   "Serve pipeline metrics in the Prometheus text format on "
+                   "this Unix socket");
+
+    std::string tracePath;
+    app.add_option("--trace", tracePath,
+                   "Record a Chrome trace of the pipeline to this file from "
+                   "the start. SIGUSR1 toggles recording either way");
+
+    app.add_flag("--overlay", m_Overlay,
+                 "Graph capture to photon latency over the bottom left corner");
+
+    app.add_option("--probe", m_ProbePath,
+                   "Measure input to photon latency per stage and write the "
+                   "histograms to this file, JSON if it ends in .json, CSV "
+                   "otherwise");
+
+    app.add_flag("--probe-detect", m_ProbeDetect,
+                 "Make each probe a pointer move and mark the first frame "
+                 "that shows it, so capture includes the compositor");
+
     CLI11_PARSE(app, argc, argv);
+
+    if (!metricsPath.empty())
+      m_MetricsExporter = std::make_unique<MetricsExporter>(metricsPath);
+
+    Trace::Initialize("client", tracePath, !tracePath.empty());
   }
 
   // Connect to the server
@@ -48,11 +144,55 @@ int Client::initialize(int argc, char *argv[]) {
     window();
     stream();
 
+    if (m_MicrophoneEnabled)
+      startMicrophone();
+
     if (m_WindowThread.joinable())
       m_WindowThread.join();
 
     if (m_StreamThread.joinable())
       m_StreamThread.join();
+
+    if (m_VideoThread.joinable())
+      m_VideoThread.join();
+
+    if (m_AudioThread.joinable())
+      m_AudioThread.join();
+
+    m_Microphone.reset();
+
+    Trace::Shutdown();
+
+    std::cout << "Late video frames: "
+              << m_SkippedFrames.load(std::memory_order_relaxed)
+              << " skipped, " << m_HiddenFrames.load(std::memory_order_relaxed)
+              << " decoded without conversion, "
+              << m_KeyframeSkippedFrames.load(std::memory_order_relaxed)
+              << " dropped waiting for a keyframe" << std::endl;
+
+    std::cout << "Lost audio packets: "
+              << m_RecoveredAudio.load(std::memory_order_relaxed)
+              << " recovered from FEC, "
+              << m_ConcealedAudio.load(std::memory_order_relaxed)
+              << " concealed, " << m_LostAudio.load(std::memory_order_relaxed)
+              << " skipped" << std::endl;
+
+    std::cout << "Audio jitter buffer: target "
+              << m_StreamPlayer.TargetDelay() / 1e6 << " ms, buffered "
+              << m_StreamPlayer.BufferedDelay() / 1e6 << " ms, jitter "
+              << m_StreamPlayer.Jitter() / 1e6 << " ms, "
+              << m_StreamPlayer.Underruns() << " underruns, "
+              << m_StreamPlayer.Overruns() << " overruns" << std::endl;
+
+    if (!m_ProbePath.empty()) {
+      m_Probe.Print();
+
+      try {
+        m_Probe.Write(m_ProbePath);
+      } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+      }
+    }
   }
 
   return EXIT_SUCCESS;
@@ -76,19 +216,35 @@ bool Client::authentication() {
 
     m_Openssl.loadPrivateKey(m_Identity.c_str());
 
-    std::vector<uint8_t> signature =
-        m_Openssl.sign(buffer.data(), buffer.size());
+    OpenSSL::Handshake handshake;
+    try {
+      handshake =
+          m_Openssl.clientHandshake(buffer, Socket::KEY_MATERIAL_SIZE);
+    } catch (const std::exception &e) {
+      LOG("Key exchange failed:", e.what());
+      return false;
+    }
 
     LOG("Signed random bytes");
 
-    socket.send(signature.data(), signature.size());
+    // Before anything goes out, the server has to be the one we pinned
+    if (!KnownHosts::Verify(m_KnownHosts,
+                            m_IP + ":" + std::to_string(m_Port),
+                            handshake.hostKey))
+      return false;
+
+    socket.send(handshake.response.data(), handshake.response.size());
 
     LOG("Sent signature");
 
+    // The reply is the first encrypted message, reading it confirms the
+    // server derived the same keys
+    socket.encrypt(handshake.keyMaterial, false);
+
     while (true) {
       std::vector<uint8_t> buffer = {};
 
-      if (socket.read(buffer) == -1)
+      if (socket.read(buffer) <= 0)
         break;
 
       if (!buffer.size())
@@ -104,45 +260,310 @@ bool Client::authentication() {
 }
 
 void Client::stream() {
+  // Only drains the socket, decoding happens on the stages below
   m_StreamThread = std::thread([this]() {
+    bool waitForKeyframe = false;
+
     while (m_Running.load()) {
       std::vector<uint8_t> buffer = {};
 
       if (socket.read(buffer) <= 0)
         break;
 
+      uint64_t received = monotonicNs();
+
       std::vector<uint8_t> bytes = Payload::get(0, buffer);
       auto type = std::string(reinterpret_cast<const char *>(bytes.data()),
                               bytes.size());
 
+      if (type == "pong") {
+        m_ClockSync.Add(Payload::toUInt64(Payload::get(1, buffer)),
+                        Payload::toUInt64(Payload::get(2, buffer)),
+                        Payload::toUInt64(Payload::get(3, buffer)), received);
+        continue;
+      }
+
+      if (type == "probe-report") {
+        LatencyProbe::Report report;
+        report.received = Payload::toUInt64(Payload::get(2, buffer));
+        report.injected = Payload::toUInt64(Payload::get(3, buffer));
+        report.captured = Payload::toUInt64(Payload::get(4, buffer));
+        report.converted = Payload::toUInt64(Payload::get(5, buffer));
+        report.encoded = Payload::toUInt64(Payload::get(6, buffer));
+        report.sent = Payload::toUInt64(Payload::get(7, buffer));
+        m_Probe.Reported(Payload::toUInt32(Payload::get(1, buffer)), report);
+        continue;
+      }
+
       if (type == "end-session") {
         m_Running.store(false);
         break;
       }
 
       if (type == "resize") {
-        int width = Payload::toUInt32(Payload::get(1, buffer));
-        int height = Payload::toUInt32(Payload::get(2, buffer));
+        VideoPacket packet;
+        packet.width = Payload::toUInt32(Payload::get(1, buffer));
+        packet.height = Payload::toUInt32(Payload::get(2, buffer));
 
-        imageWidth.store(width, std::memory_order_relaxed);
-        imageHeight.store(height, std::memory_order_relaxed);
+        // Never dropped, frames after it are decoded at the new size
+        m_VideoQueue.Push(std::move(packet));
 
-        m_Decoder.initialize(width, height);
+        waitForKeyframe = false;
       }
 
       if (type == "stream-video") {
-        uint64_t time = Payload::toUInt64(Payload::get(1, buffer));
-        m_StreamPlayer.VideoBuffer(m_Decoder.decode(Payload::get(2, buffer)),
-                                   time);
+        VideoPacket packet;
+        packet.pts = Payload::toUInt64(Payload::get(1, buffer));
+        packet.received = received;
+        packet.data = Payload::get(2, buffer);
+
+        TRACE_INSTANT(RECEIVE, packet.pts);
+
+        // After a drop the following P frames can't be decoded, skip to the
+        // next keyframe
+        if (waitForKeyframe &&
+            !H264::IsKeyframe(packet.data.data(), packet.data.size())) {
+          m_KeyframeSkippedFrames.fetch_add(1, std::memory_order_relaxed);
+          continue;
+        }
+
+        if (m_VideoQueue.TryPush(std::move(packet))) {
+          waitForKeyframe = false;
+          continue;
+        }
+
+        if (!waitForKeyframe) {
+          LOG("Video decoder behind, dropping until the next keyframe");
+          requestKeyframe();
+        }
+
+        waitForKeyframe = true;
+        m_KeyframeSkippedFrames.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      if (type == "audio-format") {
+        AudioPacket packet;
+        packet.sampleRate = Payload::toUInt32(Payload::get(1, buffer));
+        packet.channels = Payload::toUInt32(Payload::get(2, buffer));
+
+        // Never dropped, packets after it are decoded in the new format.
+        // It waits for room here and audio packets only ever evict other
+        // audio packets.
+        m_AudioQueue.Push(std::move(packet));
       }
 
       if (type == "stream-audio") {
-        uint64_t time = Payload::toUInt64(Payload::get(1, buffer));
-        m_StreamPlayer.AudioBuffer(
-            m_AudioDecoder.Decode(Payload::get(2, buffer), 960), time);
+        AudioPacket packet;
+        packet.pts = Payload::toUInt64(Payload::get(1, buffer));
+        packet.sequence = Payload::toUInt32(Payload::get(2, buffer));
+        packet.data = Payload::get(3, buffer);
+
+        if (m_AudioQueue.PushDropOldest(
+                std::move(packet),
+                [](const AudioPacket &queued) { return !queued.sampleRate; }))
+          LOG("Audio decoder behind, dropped a packet");
       }
     }
+
+    m_Running.store(false);
+    m_VideoQueue.Close();
+    m_AudioQueue.Close();
   });
+
+  m_VideoThread = std::thread([this]() {
+    VideoPacket packet;
+    bool waitForKeyframe = false;
+
+    while (m_VideoQueue.Pop(packet)) {
+      if (packet.width && packet.height) {
+        m_Decoder.initialize(packet.width, packet.height, m_DecoderOptions);
+
+        imageWidth.store(packet.width, std::memory_order_relaxed);
+        imageHeight.store(packet.height, std::memory_order_relaxed);
+        waitForKeyframe = false;
+        continue;
+      }
+
+      const uint8_t *data = packet.data.data();
+      size_t size = packet.data.size();
+
+      uint64_t clock =
+          m_StreamPlayer.IsPlaying() ? m_StreamPlayer.AudioClock() : 0;
+
+      bool late = packet.pts + LATE_FRAME_NS < clock;
+      bool hopeless = packet.pts + HOPELESS_FRAME_NS < clock;
+
+      // Too far behind to catch up frame by frame, everything up to the next
+      // keyframe is thrown away undecoded
+      if ((waitForKeyframe || hopeless) && !H264::IsKeyframe(data, size)) {
+        if (!waitForKeyframe)
+          requestKeyframe();
+
+        waitForKeyframe = true;
+        m_KeyframeSkippedFrames.fetch_add(1, std::memory_order_relaxed);
+        continue;
+      }
+
+      waitForKeyframe = false;
+
+      if (late) {
+        // Nothing references it, skip the decode entirely
+        if (!H264::IsReference(data, size)) {
+          m_SkippedFrames.fetch_add(1, std::memory_order_relaxed);
+          continue;
+        }
+
+        // Later frames need it, decode but don't convert or queue it
+        m_Decoder.decode(packet.data, false);
+        m_HiddenFrames.fetch_add(1, std::memory_order_relaxed);
+        continue;
+      }
+
+      // Straight into a mapped pixel buffer when one is free, so the render
+      // thread has nothing left to copy
+      auto slot = m_PixelBuffers.Acquire(m_Decoder.frameSize());
+      std::vector<uint8_t> frame;
+      bool decoded = false;
+      {
+        TRACE_SCOPE(DECODE, packet.pts);
+        if (slot)
+          decoded = m_Decoder.decode(packet.data, slot->data());
+        else {
+          frame = m_Decoder.decode(packet.data);
+          decoded = !frame.empty();
+        }
+      }
+
+      if (!decoded)
+        continue;
+
+      // Read back from the decoder's picture, the slot is write only
+      if (!m_ProbePath.empty()) {
+        uint32_t id = 0;
+        int width = imageWidth.load(std::memory_order_relaxed);
+        int height = imageHeight.load(std::memory_order_relaxed);
+        int stride = 0;
+        const uint8_t *luma = m_Decoder.luma(stride);
+
+        if (luma && ProbeMarker::Read(luma, width, height, id, stride))
+          m_Probe.Decoded(id, packet.pts, packet.received, monotonicNs());
+      }
+
+      if (slot) {
+        slot->Written();
+        m_StreamPlayer.VideoBuffer(std::move(slot), packet.pts);
+      } else
+        m_StreamPlayer.VideoBuffer(std::move(frame), packet.pts);
+    }
+  });
+
+  m_AudioThread = std::thread([this]() {
+    AudioPacket packet;
+    std::vector<float> samples;
+    int sampleRate = 0;
+    uint32_t expected = 0;
+    bool sequenced = false;
+
+    while (m_AudioQueue.Pop(packet)) {
+      if (packet.sampleRate) {
+        m_AudioDecoder =
+            std::make_unique<AudioDecoder>(packet.sampleRate, packet.channels);
+        m_StreamPlayer.ConfigureAudio(packet.sampleRate, packet.channels);
+
+        sampleRate = packet.sampleRate;
+        sequenced = false;
+        LOG("Audio format:", packet.sampleRate, "Hz,", packet.channels,
+            "channels");
+        continue;
+      }
+
+      if (!m_AudioDecoder)
+        continue;
+
+      int32_t gap = sequenced ? static_cast<int32_t>(packet.sequence - expected)
+                              : 0;
+
+      // Arrived after its gap was already filled in
+      if (gap < 0)
+        continue;
+
+      samples.clear();
+      uint64_t pts = packet.pts;
+      uint64_t start = monotonicNs();
+      TRACE_SCOPE(AUDIO_DECODE, packet.pts);
+
+      if (gap > MAX_CONCEALED_AUDIO) {
+        m_LostAudio.fetch_add(gap, std::memory_order_relaxed);
+      } else if (gap > 0) {
+        // The last missing packet is rebuilt from this packet's FEC when it
+        // has any, everything else can only be extrapolated
+        int frameSize = m_AudioDecoder->Samples(packet.data);
+        bool fec = m_AudioDecoder->HasFec(packet.data);
+        int32_t concealed = fec ? gap - 1 : gap;
+
+        for (int32_t i = 0; i < concealed; i++)
+          m_AudioDecoder->Conceal(frameSize, samples);
+        if (fec)
+          m_AudioDecoder->DecodeFec(packet.data, samples);
+
+        pts -= static_cast<uint64_t>(gap) * frameSize * 1'000'000'000ULL /
+               sampleRate;
+
+        m_ConcealedAudio.fetch_add(concealed, std::memory_order_relaxed);
+        if (fec)
+          m_RecoveredAudio.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      expected = packet.sequence + 1;
+      sequenced = true;
+
+      m_AudioDecoder->Decode(packet.data, samples);
+      audioDecodeTime.Record(monotonicNs() - start);
+
+      m_StreamPlayer.AudioBuffer(samples, pts);
+    }
+  });
+}
+
+void Client::startMicrophone() {
+  try {
+    m_Microphone = std::make_unique<Microphone>();
+  } catch (const std::exception &e) {
+    std::cerr << "Microphone disabled: " << e.what() << std::endl;
+    return;
+  }
+
+  Payload payload;
+  payload.set("mic-format");
+  payload.set(m_Microphone->SampleRate());
+  payload.set(m_Microphone->Channels());
+  socket.send(payload.buffer.data(), payload.buffer.size());
+
+  m_Microphone->Start([this](const unsigned char *data, int size) {
+    if (!m_Running.load(std::memory_order::relaxed))
+      return;
+
+    Payload payload;
+    payload.set("mic-audio");
+    payload.set(data, size);
+    socket.send(payload.buffer.data(), payload.buffer.size());
+  });
+}
+
+static void printLatency(const char *name,
+                         const LatencyStats::Summary &summary) {
+  if (!summary.samples)
+    return;
+
+  std::cout << name << " over " << summary.samples << " frames: avg "
+            << summary.averageMs << " ms, p95 " << summary.p95Ms
+            << " ms, max " << summary.maxMs << " ms" << std::endl;
+}
+
+void Client::requestKeyframe() {
+  Payload payload;
+  payload.set("keyframe");
+  socket.send(payload.buffer.data(), payload.buffer.size());
 }
 
 static void onResize(GLFWwindow *window, int width, int height) {
@@ -189,18 +610,39 @@ static void onKeyPress(GLFWwindow *window, int key, int scancode, int action,
 
   Client *client = static_cast<Client *>(glfwGetWindowUserPointer(window));
 
+  // Pointer lock for games and 3D apps, absolute positioning for the desktop
+  if (key == GLFW_KEY_L && (mods & GLFW_MOD_CONTROL) &&
+      (mods & GLFW_MOD_SHIFT)) {
+    if (action == GLFW_PRESS) {
+      Window::setPointerLock(window, !Window::isPointerLocked(window));
+      glfwGetCursorPos(window, &client->cursorX, &client->cursorY);
+    }
+    return;
+  }
+
   Payload payload;
   payload.set("key");
   payload.set(key);
   payload.set(action);
   payload.set(mods);
 
-  client->socket.send(payload.buffer.data(), payload.buffer.size());
+  client->input.Add(payload, monotonicNs());
 }
 
 static void onMouseMove(GLFWwindow *window, double xpos, double ypos) {
   Client *client = static_cast<Client *>(glfwGetWindowUserPointer(window));
 
+  double dx = xpos - client->cursorX;
+  double dy = ypos - client->cursorY;
+  client->cursorX = xpos;
+  client->cursorY = ypos;
+
+  // The cursor is hidden and unbounded, only the movement means anything
+  if (Window::isPointerLocked(window)) {
+    client->input.MouseDelta(dx, dy);
+    return;
+  }
+
   double x = 0.0;
   double y = 0.0;
 
@@ -214,12 +656,7 @@ static void onMouseMove(GLFWwindow *window, double xpos, double ypos) {
     y = std::clamp(y, 0.0, 1.0);
   }
 
-  Payload payload;
-  payload.set("mouse-move");
-  payload.set(x);
-  payload.set(y);
-
-  client->socket.send(payload.buffer.data(), payload.buffer.size());
+  client->input.MouseMove(x, y);
 }
 
 static void onMouseButton(GLFWwindow *window, int button, int action,
@@ -232,7 +669,7 @@ static void onMouseButton(GLFWwindow *window, int button, int action,
   payload.set(action);
   payload.set(mods);
 
-  client->socket.send(payload.buffer.data(), payload.buffer.size());
+  client->input.Add(payload, monotonicNs());
 }
 
 static void onScroll(GLFWwindow *window, double xoffset, double yoffset) {
@@ -253,7 +690,7 @@ static void onScroll(GLFWwindow *window, double xoffset, double yoffset) {
     payload.set(static_cast<int>(yoffset));
   }
 
-  client->socket.send(payload.buffer.data(), payload.buffer.size());
+  client->input.Add(payload, monotonicNs());
 }
 
 void Client::window() {
@@ -267,17 +704,117 @@ void Client::window() {
         .onMouseMove = onMouseMove,
         .onMouseButton = onMouseButton,
         .onScroll = onScroll,
+        .presentMode = m_PresentMode,
+        .pixelBufferPool = &m_PixelBuffers,
     });
 
+    input.SetMotionRate(m_PointerRate ? m_PointerRate : w.refreshRate());
+
+    if (m_PointerLock)
+      w.setPointerLock(true);
+
+    // Wake the render loop as soon as a decoded frame is queued
+    m_StreamPlayer.OnVideoFrame(Window::wake);
+
+    uint64_t lastPing = 0;
+
     while (m_Running.load() && !w.shouldClose()) {
-      auto frame = m_StreamPlayer.Update();
-      if (frame.size())
-        w.setBuffer(frame);
       uint32_t width = imageWidth.load(std::memory_order::relaxed);
       uint32_t height = imageHeight.load(std::memory_order::relaxed);
-      w.present(width, height);
+      auto frame = m_StreamPlayer.Update();
+      bool hasFrame = !frame.empty();
+
+      bool presented = false;
+      {
+        TRACE_SCOPE(PRESENT, frame.ns);
+        presented =
+            w.present(width, height, frame.data, std::move(frame.slot));
+      }
+      uint64_t now = monotonicNs();
+
+      if (presented && hasFrame) {
+        m_PresentLatency.Record(now - frame.queuedNs);
+        presentLatency.Record(now - frame.queuedNs);
+        presentedFrames.Add();
+
+        // Capture on the server to swap here
+        uint64_t endToEnd = 0;
+        if (m_ClockSync.IsSynchronized()) {
+          uint64_t captured = m_ClockSync.ToLocal(frame.ns, now);
+          if (captured < now) {
+            endToEnd = now - captured;
+            m_EndToEndLatency.Record(endToEnd);
+            endToEndLatency.Record(endToEnd);
+          }
+        }
+
+        // Green within two refreshes of capture, yellow within four
+        if (m_Overlay) {
+          double ms = endToEnd / 1e6;
+          double refreshMs = 1000.0 / w.refreshRate();
+
+          Window::OverlayBar bar;
+          bar.height = static_cast<int>(ms * OVERLAY_PIXELS_PER_MS);
+          bar.r = ms > refreshMs * 2 ? 1.0f : 0.0f;
+          bar.g = ms > refreshMs * 4 ? 0.0f : 1.0f;
+          w.pushOverlay(bar, OVERLAY_BARS);
+        }
+
+        if (!m_ProbePath.empty())
+          m_Probe.Presented(frame.ns, now);
+      }
+
+      if (now - lastPing >= PING_INTERVAL_NS) {
+        Payload payload;
+        payload.set("ping");
+        payload.set(now);
+        socket.send(payload.buffer.data(), payload.buffer.size());
+        lastPing = now;
+      }
+
+      int64_t delay = m_StreamPlayer.NextFrameDelay();
+      int64_t motionDelay = input.NextMotionDelay(now);
+      if (motionDelay >= 0 && (delay < 0 || motionDelay < delay))
+        delay = motionDelay;
+
+      w.waitEvents(delay < 0 ? IDLE_TIMEOUT_S
+                             : std::min(delay / 1e9, IDLE_TIMEOUT_S));
+
+      // Rides along with the input so it is injected in order with it
+      if (!m_ProbePath.empty()) {
+        uint64_t now = monotonicNs();
+        if (uint32_t id = m_Probe.Next(now)) {
+          Payload probe;
+          probe.set("probe");
+          probe.set(id);
+
+          // The server moves the pointer between two spots and waits for
+          // the capture to show it
+          if (m_ProbeDetect) {
+            probe.set(id & 1 ? 0.45 : 0.55);
+            probe.set(0.5);
+          }
+
+          input.Add(probe, now);
+        }
+      }
+
+      // Everything the callbacks queued during the wait goes out as one
+      // message
+      Payload message;
+      if (input.Take(monotonicNs(), message))
+        socket.send(message.buffer.data(), message.buffer.size());
     }
 
+    m_StreamPlayer.OnVideoFrame(nullptr);
+
+    printLatency("Decoded frame to swap", m_PresentLatency.Summarize());
+    printLatency("Capture to photon", m_EndToEndLatency.Summarize());
+
+    std::cout << "Clock offset " << m_ClockSync.Offset() / 1e6
+              << " ms, round trip " << m_ClockSync.RoundTrip() / 1e6
+              << " ms, drift " << m_ClockSync.Drift() << " ppm" << std::endl;
+
     m_Running.store(false);
   });
 }
@@ -1,13 +1,22 @@
 #pragma once
 
 #include <atomic>
+#include <memory>
 #include <mutex>
 #include <stdlib.h>
 #include <string>
 #include <thread>
 
 #include "AudioDecoder.h"
+#include "BoundedQueue.h"
+#include "ClockSync.h"
 #include "Decoder.h"
+#include "InputBatch.h"
+#include "LatencyProbe.h"
+#include "LatencyStats.h"
+#include "Metrics.h"
+#include "MetricsExporter.h"
+#include "Microphone.h"
 #include "OpenSSL.h"
 #include "Socket.h"
 #include "StreamPlayer.h"
@@ -23,22 +32,89 @@ private:
     int h = 0;
   };
 
+  // A resize when width and height are set, otherwise an encoded frame
+  struct VideoPacket {
+    std::vector<uint8_t> data;
+    uint64_t pts = 0;
+    // Local monotonic time the socket handed it over
+    uint64_t received = 0;
+    int width = 0;
+    int height = 0;
+  };
+
+  // A format change when the sample rate is set, otherwise an Opus packet
+  struct AudioPacket {
+    std::vector<uint8_t> data;
+    uint64_t pts = 0;
+    uint32_t sequence = 0;
+    int sampleRate = 0;
+    int channels = 0;
+  };
+
 private:
   OpenSSL m_Openssl;
   Decoder m_Decoder;
-  AudioDecoder m_AudioDecoder{24000};
+  Decoder::Options m_DecoderOptions;
+  // Created once the server tells us what it encodes at
+  std::unique_ptr<AudioDecoder> m_AudioDecoder;
 
   std::string m_IP;
 
   uint16_t m_Port = 1998;
   std::string m_Identity;
+  // Pinned server host keys
+  std::string m_KnownHosts;
+
+  PresentMode m_PresentMode = PresentMode::VSYNC;
+
+  // Pointer updates per second, 0 follows the display refresh rate
+  int m_PointerRate = 0;
+
+  bool m_PointerLock = false;
+
+  // Capture to photon latency graph over the stream
+  bool m_Overlay = false;
+
+  std::unique_ptr<MetricsExporter> m_MetricsExporter;
+
+  bool m_MicrophoneEnabled = false;
+  std::unique_ptr<Microphone> m_Microphone;
 
   std::atomic<bool> m_Running = true;
 
   std::thread m_WindowThread;
   std::thread m_StreamThread;
+  std::thread m_VideoThread;
+  std::thread m_AudioThread;
+
+  BoundedQueue<VideoPacket> m_VideoQueue{8};
+  BoundedQueue<AudioPacket> m_AudioQueue{16};
+
+  // Late frames, not decoded / decoded only as a reference / dropped while
+  // resyncing on a keyframe
+  std::atomic<uint64_t> m_SkippedFrames = 0;
+  std::atomic<uint64_t> m_HiddenFrames = 0;
+  std::atomic<uint64_t> m_KeyframeSkippedFrames = 0;
+
+  // Lost audio packets, rebuilt from the next packet's FEC / concealed / too
+  // many in a row to bother
+  std::atomic<uint64_t> m_RecoveredAudio = 0;
+  std::atomic<uint64_t> m_ConcealedAudio = 0;
+  std::atomic<uint64_t> m_LostAudio = 0;
 
-  StreamPlayer m_StreamPlayer{24000, 2, 40'000'000};
+  // The video thread decodes into these when the window could create them,
+  // outlives the frames queued in m_StreamPlayer
+  PixelBufferPool m_PixelBuffers;
+  StreamPlayer m_StreamPlayer{40'000'000};
+
+  ClockSync m_ClockSync;
+  LatencyStats m_PresentLatency;
+  LatencyStats m_EndToEndLatency;
+
+  // Input to photon probes are only sent when a results file was given
+  std::string m_ProbePath;
+  bool m_ProbeDetect = false;
+  LatencyProbe m_Probe{m_ClockSync};
 
 public:
   Socket socket;
@@ -48,6 +124,14 @@ public:
   Viewport viewport;
   std::mutex viewportMut;
 
+  // Filled by the GLFW callbacks, sent once per pass of the render loop
+  InputBatch input;
+
+  // Last cursor position GLFW reported, relative motion is measured from it
+  // while the pointer is locked
+  double cursorX = 0.0;
+  double cursorY = 0.0;
+
 public:
   Client() = default;
   ~Client();
@@ -56,6 +140,8 @@ public:
 
 private:
   bool authentication();
+  void requestKeyframe();
+  void startMicrophone();
   void stream();
   void window();
 };
\ No newline at end of file
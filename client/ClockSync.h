@@ -0,0 +1,108 @@
+#pragma once
+
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <stdint.h>
+
+// NTP style offset estimation between the server media clock and ours. Only
+// the samples with the shortest round trips are trusted, asymmetric queueing
+// delay shows up as offset error.
+class ClockSync {
+private:
+  struct Sample {
+    int64_t offset;
+    uint64_t roundTrip;
+    uint64_t localNs;
+  };
+
+  static constexpr size_t WINDOW = 16;
+
+  std::mutex m_Mutex;
+  std::deque<Sample> m_Samples;
+
+  int64_t m_Offset = 0;
+  uint64_t m_OffsetAt = 0;
+  uint64_t m_RoundTrip = 0;
+  // Server clock drift relative to ours in ns per ns
+  double m_Drift = 0.0;
+
+public:
+  // t0 ping sent, t1 ping received by the server, t2 pong sent by the server,
+  // t3 pong received. t0/t3 are local times, t1/t2 server times.
+  void Add(uint64_t t0, uint64_t t1, uint64_t t2, uint64_t t3) {
+    int64_t offset =
+        ((static_cast<int64_t>(t1) - static_cast<int64_t>(t0)) +
+         (static_cast<int64_t>(t2) - static_cast<int64_t>(t3))) /
+        2;
+    uint64_t roundTrip = (t3 - t0) - (t2 - t1);
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    m_Samples.push_back({offset, roundTrip, t3});
+    if (m_Samples.size() > WINDOW)
+      m_Samples.pop_front();
+
+    const Sample &best =
+        *std::min_element(m_Samples.begin(), m_Samples.end(),
+                          [](const Sample &a, const Sample &b) {
+                            return a.roundTrip < b.roundTrip;
+                          });
+
+    // Least squares over the samples whose round trip is close to the best,
+    // the slope is the drift
+    uint64_t limit = best.roundTrip + best.roundTrip / 2 + 1'000'000;
+    double n = 0, sumX = 0, sumY = 0, sumXX = 0, sumXY = 0;
+
+    for (const Sample &sample : m_Samples) {
+      if (sample.roundTrip > limit)
+        continue;
+
+      double x = static_cast<double>(sample.localNs - best.localNs);
+      double y = static_cast<double>(sample.offset - best.offset);
+      n++;
+      sumX += x;
+      sumY += y;
+      sumXX += x * x;
+      sumXY += x * y;
+    }
+
+    double denominator = n * sumXX - sumX * sumX;
+    m_Drift = n > 1 && denominator != 0.0
+                  ? (n * sumXY - sumX * sumY) / denominator
+                  : 0.0;
+
+    m_Offset = best.offset;
+    m_OffsetAt = best.localNs;
+    m_RoundTrip = best.roundTrip;
+  }
+
+  bool IsSynchronized() {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return !m_Samples.empty();
+  }
+
+  // Server time to local time, corrected for drift since the best sample
+  uint64_t ToLocal(uint64_t serverNs, uint64_t localNow) {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    double elapsed = static_cast<double>(localNow) - m_OffsetAt;
+    int64_t offset = m_Offset + static_cast<int64_t>(m_Drift * elapsed);
+    return static_cast<uint64_t>(static_cast<int64_t>(serverNs) - offset);
+  }
+
+  int64_t Offset() {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Offset;
+  }
+
+  uint64_t RoundTrip() {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_RoundTrip;
+  }
+
+  // Parts per million
+  double Drift() {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Drift * 1e6;
+  }
+};
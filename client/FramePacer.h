@@ -0,0 +1,49 @@
+#pragma once
+
+#include <chrono>
+#include <stdint.h>
+#include <thread>
+
+#include "Utility.h"
+
+enum class PresentMode { VSYNC = 0, LOW_LATENCY = 1, ADAPTIVE = 2 };
+
+// Schedules swaps with vsync off so a frame is presented just before the next
+// vblank. Times are monotonicNs(), the clock the rest of the client uses.
+class FramePacer {
+private:
+  static constexpr uint64_t ANCHOR_INTERVAL_NS = 5'000'000'000; // 5 s
+
+  uint64_t m_RefreshNs = 16'666'667;
+  uint64_t m_MarginNs = 2'000'000;
+  uint64_t m_VblankNs = 0;
+
+public:
+  void SetRefreshRate(int hz) {
+    if (hz > 0)
+      m_RefreshNs = 1'000'000'000ULL / hz;
+  }
+
+  // Records the time of a swap that was synchronized to vblank
+  void Anchor(uint64_t vblankNs) { m_VblankNs = vblankNs; }
+
+  // The anchor drifts since the refresh rate is only known to the nearest Hz
+  bool ShouldAnchor(uint64_t now) const {
+    return !m_VblankNs || now - m_VblankNs > ANCHOR_INTERVAL_NS;
+  }
+
+  // Sleeps until the margin before the next vblank, returns immediately if we
+  // are already inside it
+  void WaitForVblank() const {
+    if (!m_VblankNs)
+      return;
+
+    uint64_t now = monotonicNs();
+    uint64_t phase = (now - m_VblankNs) % m_RefreshNs;
+    uint64_t untilVblank = m_RefreshNs - phase;
+
+    if (untilVblank > m_MarginNs)
+      std::this_thread::sleep_for(
+          std::chrono::nanoseconds(untilVblank - m_MarginNs));
+  }
+};
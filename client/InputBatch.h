@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cmath>
+#include <stdint.h>
+
+#include "Payload.h"
+
+// Collects the input events of one pass through the event loop into a single
+// "input" message: the event count followed by each event as a nested payload.
+// Pointer motion is coalesced to the latest position, or summed while the
+// pointer is locked, and sent at most once per motion interval. Any other
+// event flushes it first so the server replays everything in the order it
+// happened.
+class InputBatch {
+private:
+  Payload m_Events;
+  uint32_t m_Count = 0;
+
+  bool m_MotionPending = false;
+  double m_X = 0.0;
+  double m_Y = 0.0;
+
+  // Relative motion while the pointer is locked, the fraction below a whole
+  // unit is carried into the next update
+  double m_DeltaX = 0.0;
+  double m_DeltaY = 0.0;
+
+  uint64_t m_MotionIntervalNs = 16'666'667;
+  uint64_t m_LastMotionNs = 0;
+
+  void Append(const Payload &event) {
+    m_Events.set(event.buffer.data(),
+                 static_cast<uint32_t>(event.buffer.size()));
+    m_Count++;
+  }
+
+  bool HasDelta() const {
+    return std::abs(m_DeltaX) >= 1.0 || std::abs(m_DeltaY) >= 1.0;
+  }
+
+  void FlushMotion(uint64_t now) {
+    if (!m_MotionPending && !HasDelta())
+      return;
+
+    if (m_MotionPending) {
+      Payload event;
+      event.set("mouse-move");
+      event.set(m_X);
+      event.set(m_Y);
+      Append(event);
+      m_MotionPending = false;
+    }
+
+    if (HasDelta()) {
+      int dx = static_cast<int>(m_DeltaX);
+      int dy = static_cast<int>(m_DeltaY);
+
+      Payload event;
+      event.set("mouse-motion");
+      event.set(dx);
+      event.set(dy);
+      Append(event);
+
+      m_DeltaX -= dx;
+      m_DeltaY -= dy;
+    }
+
+    m_LastMotionNs = now;
+  }
+
+public:
+  void SetMotionRate(int hz) {
+    if (hz > 0)
+      m_MotionIntervalNs = 1'000'000'000ULL / hz;
+  }
+
+  // Normalized absolute position, replaces any motion not sent yet
+  void MouseMove(double x, double y) {
+    m_X = x;
+    m_Y = y;
+    m_MotionPending = true;
+  }
+
+  // Pointer lock motion in screen pixels, adds up until it is sent
+  void MouseDelta(double dx, double dy) {
+    m_DeltaX += dx;
+    m_DeltaY += dy;
+  }
+
+  // Buttons, keys and scrolls are never coalesced or delayed
+  void Add(const Payload &event, uint64_t now) {
+    FlushMotion(now);
+    Append(event);
+  }
+
+  // Nanoseconds until held back motion is due, -1 if there is none
+  int64_t NextMotionDelay(uint64_t now) const {
+    if (!m_MotionPending && !HasDelta())
+      return -1;
+
+    uint64_t due = m_LastMotionNs + m_MotionIntervalNs;
+    return due > now ? static_cast<int64_t>(due - now) : 0;
+  }
+
+  // Builds the message for everything due by `now`, false if there is nothing
+  // to send
+  bool Take(uint64_t now, Payload &message) {
+    if (NextMotionDelay(now) == 0)
+      FlushMotion(now);
+
+    if (!m_Count)
+      return false;
+
+    message.buffer.clear();
+    message.set("input");
+    message.set(m_Count);
+    message.buffer.insert(message.buffer.end(), m_Events.buffer.begin(),
+                          m_Events.buffer.end());
+
+    m_Events.buffer.clear();
+    m_Count = 0;
+    return true;
+  }
+};
@@ -0,0 +1,226 @@
+#include "LatencyProbe.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#include "ProbeMarker.h"
+
+namespace {
+
+struct Summary {
+  size_t samples = 0;
+  double averageMs = 0.0;
+  double p50Ms = 0.0;
+  double p95Ms = 0.0;
+  double p99Ms = 0.0;
+  double maxMs = 0.0;
+};
+
+Summary summarize(std::vector<uint64_t> samples) {
+  Summary summary;
+  summary.samples = samples.size();
+  if (samples.empty())
+    return summary;
+
+  std::sort(samples.begin(), samples.end());
+
+  uint64_t total = 0;
+  for (uint64_t sample : samples)
+    total += sample;
+
+  size_t count = samples.size();
+  summary.averageMs = total / 1e6 / count;
+  summary.p50Ms = samples[count / 2] / 1e6;
+  summary.p95Ms = samples[(count * 95) / 100] / 1e6;
+  summary.p99Ms = samples[(count * 99) / 100] / 1e6;
+  summary.maxMs = samples[count - 1] / 1e6;
+
+  return summary;
+}
+
+uint64_t span(uint64_t from, uint64_t to) { return to > from ? to - from : 0; }
+
+} // namespace
+
+const char *LatencyProbe::StageName(int stage) {
+  static constexpr const char *names[STAGE_COUNT] = {
+      "input",  "inject",  "capture", "convert", "encode",
+      "send",   "receive", "decode",  "present", "total",
+  };
+  return names[stage];
+}
+
+uint32_t LatencyProbe::Next(uint64_t now) {
+  std::lock_guard<std::mutex> lock(m_Mutex);
+
+  if (m_Id) {
+    // The marked frame was dropped or never captured, the screen may not
+    // have changed at all
+    if (now - m_Sent < TIMEOUT_NS)
+      return 0;
+
+    m_TimedOut++;
+    m_Id = 0;
+  }
+
+  // Server times are useless until we know its clock
+  if (!m_Clock.IsSynchronized())
+    return 0;
+
+  if (m_Sent && now - m_Sent < INTERVAL_NS)
+    return 0;
+
+  m_Id = m_LastId = ProbeMarker::NextId(m_LastId);
+  m_Sent = now;
+  m_Reported = false;
+  m_Decoded = false;
+  m_Presented = 0;
+
+  return m_Id;
+}
+
+void LatencyProbe::Reported(uint32_t id, const Report &report) {
+  std::lock_guard<std::mutex> lock(m_Mutex);
+
+  if (id != m_Id || m_Reported)
+    return;
+
+  m_Report = report;
+  m_Reported = true;
+
+  if (m_Presented)
+    Complete();
+}
+
+void LatencyProbe::Decoded(uint32_t id, uint64_t pts, uint64_t received,
+                           uint64_t decoded) {
+  std::lock_guard<std::mutex> lock(m_Mutex);
+
+  if (id != m_Id || m_Decoded)
+    return;
+
+  m_Pts = pts;
+  m_Received = received;
+  m_DecodedAt = decoded;
+  m_Decoded = true;
+}
+
+void LatencyProbe::Presented(uint64_t pts, uint64_t presented) {
+  std::lock_guard<std::mutex> lock(m_Mutex);
+
+  if (!m_Id || !m_Decoded || m_Presented || pts != m_Pts)
+    return;
+
+  m_Presented = presented;
+
+  if (m_Reported)
+    Complete();
+}
+
+void LatencyProbe::Complete() {
+  auto local = [&](uint64_t serverNs) {
+    return m_Clock.ToLocal(serverNs, m_Presented);
+  };
+
+  const Report &r = m_Report;
+  std::array<uint64_t, STAGE_COUNT> stages = {
+      span(m_Sent, local(r.received)),
+      span(r.received, r.injected),
+      span(r.injected, r.captured),
+      span(r.captured, r.converted),
+      span(r.converted, r.encoded),
+      span(r.encoded, r.sent),
+      span(local(r.sent), m_Received),
+      span(m_Received, m_DecodedAt),
+      span(m_DecodedAt, m_Presented),
+      span(m_Sent, m_Presented),
+  };
+
+  for (int stage = 0; stage < STAGE_COUNT; stage++)
+    m_Samples[stage].push_back(stages[stage]);
+
+  m_Id = 0;
+}
+
+void LatencyProbe::Print() {
+  std::lock_guard<std::mutex> lock(m_Mutex);
+
+  std::cout << "Input to photon over " << m_Samples[TOTAL].size()
+            << " probes, " << m_TimedOut << " timed out" << std::endl;
+
+  for (int stage = 0; stage < STAGE_COUNT; stage++) {
+    Summary summary = summarize(m_Samples[stage]);
+    if (!summary.samples)
+      continue;
+
+    std::cout << "  " << StageName(stage) << ": avg " << summary.averageMs
+              << " ms, p50 " << summary.p50Ms << " ms, p95 " << summary.p95Ms
+              << " ms, max " << summary.maxMs << " ms" << std::endl;
+  }
+}
+
+void LatencyProbe::Write(const std::string &path) {
+  std::lock_guard<std::mutex> lock(m_Mutex);
+
+  std::ofstream file(path);
+  if (!file)
+    throw std::runtime_error("Failed to open " + path);
+
+  // One bucket per millisecond up to the slowest sample, the last one also
+  // holds everything beyond MAX_BUCKETS
+  uint64_t slowest = 0;
+  for (const auto &samples : m_Samples)
+    for (uint64_t sample : samples)
+      slowest = std::max(slowest, sample);
+
+  size_t buckets = std::min<size_t>(slowest / BUCKET_NS + 1, MAX_BUCKETS);
+
+  std::array<std::vector<uint64_t>, STAGE_COUNT> histograms;
+  for (int stage = 0; stage < STAGE_COUNT; stage++) {
+    histograms[stage].assign(buckets, 0);
+    for (uint64_t sample : m_Samples[stage])
+      histograms[stage][std::min<size_t>(sample / BUCKET_NS, buckets - 1)]++;
+  }
+
+  bool json = path.ends_with(".json");
+
+  if (!json) {
+    file << "bucket_ms";
+    for (int stage = 0; stage < STAGE_COUNT; stage++)
+      file << ',' << StageName(stage);
+    file << '\n';
+
+    for (size_t bucket = 0; bucket < buckets; bucket++) {
+      file << bucket * BUCKET_NS / 1'000'000;
+      for (int stage = 0; stage < STAGE_COUNT; stage++)
+        file << ',' << histograms[stage][bucket];
+      file << '\n';
+    }
+    return;
+  }
+
+  file << "{\n  \"probes\": " << m_Samples[TOTAL].size()
+       << ",\n  \"timedOut\": " << m_TimedOut
+       << ",\n  \"bucketMs\": " << BUCKET_NS / 1e6 << ",\n  \"stages\": {";
+
+  for (int stage = 0; stage < STAGE_COUNT; stage++) {
+    Summary summary = summarize(m_Samples[stage]);
+
+    file << (stage ? "," : "") << "\n    \"" << StageName(stage) << "\": {"
+         << "\"samples\": " << summary.samples
+         << ", \"averageMs\": " << summary.averageMs
+         << ", \"p50Ms\": " << summary.p50Ms
+         << ", \"p95Ms\": " << summary.p95Ms
+         << ", \"p99Ms\": " << summary.p99Ms
+         << ", \"maxMs\": " << summary.maxMs << ", \"histogram\": [";
+
+    for (size_t bucket = 0; bucket < buckets; bucket++)
+      file << (bucket ? ", " : "") << histograms[stage][bucket];
+
+    file << "]}";
+  }
+
+  file << "\n  }\n}\n";
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <array>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "ClockSync.h"
+
+// Input to photon measurement. One probe at a time rides along with the input
+// events, the server stamps it through injection, capture and encode and
+// paints its id into the next captured frame (see ProbeMarker.h). The round
+// trip completes when that frame is presented here.
+class LatencyProbe {
+public:
+  enum Stage {
+    INPUT,   // Client send to server receive
+    INJECT,  // Server receive to injected on the portal thread
+    CAPTURE, // Injected to the next captured frame
+    CONVERT, // RGB to YUV on the server
+    ENCODE,
+    SEND,    // Payload and socket write
+    RECEIVE, // Server send to client receive
+    DECODE,  // Client receive to decoded, queueing included
+    PRESENT, // Decoded to swapped
+    TOTAL,
+    STAGE_COUNT
+  };
+
+  // Server clock times for one probe
+  struct Report {
+    uint64_t received = 0;
+    uint64_t injected = 0;
+    uint64_t captured = 0;
+    uint64_t converted = 0;
+    uint64_t encoded = 0;
+    uint64_t sent = 0;
+  };
+
+private:
+  static constexpr uint64_t INTERVAL_NS = 250'000'000;  // 250 ms
+  static constexpr uint64_t TIMEOUT_NS = 2'000'000'000; // 2 s
+  static constexpr uint64_t BUCKET_NS = 1'000'000;      // 1 ms
+  static constexpr size_t MAX_BUCKETS = 1000;
+
+  ClockSync &m_Clock;
+  std::mutex m_Mutex;
+
+  // The probe in flight, 0 when there is none
+  uint32_t m_Id = 0;
+  uint32_t m_LastId = 0;
+  uint64_t m_Sent = 0;
+
+  bool m_Reported = false;
+  Report m_Report;
+
+  // Set once the marked frame is decoded / presented
+  bool m_Decoded = false;
+  uint64_t m_Pts = 0;
+  uint64_t m_Received = 0;
+  uint64_t m_DecodedAt = 0;
+  uint64_t m_Presented = 0;
+
+  std::array<std::vector<uint64_t>, STAGE_COUNT> m_Samples;
+  uint64_t m_TimedOut = 0;
+
+  void Complete();
+
+public:
+  explicit LatencyProbe(ClockSync &clock) : m_Clock(clock) {}
+
+  static const char *StageName(int stage);
+
+  // Id of a new probe to send now, 0 if one is in flight or not yet due
+  uint32_t Next(uint64_t now);
+
+  void Reported(uint32_t id, const Report &report);
+
+  // A decoded frame carried marker `id`
+  void Decoded(uint32_t id, uint64_t pts, uint64_t received, uint64_t decoded);
+
+  // Called for every presented frame, only the marked one matters
+  void Presented(uint64_t pts, uint64_t presented);
+
+  void Print();
+
+  // CSV histograms, or a JSON summary with histograms when `path` ends in
+  // .json
+  void Write(const std::string &path);
+};
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <stdint.h>
+
+// Keeps the most recent latency samples and summarizes them on demand
+class LatencyStats {
+public:
+  struct Summary {
+    size_t samples = 0;
+    double averageMs = 0.0;
+    double p95Ms = 0.0;
+    double maxMs = 0.0;
+  };
+
+private:
+  static constexpr size_t SAMPLE_COUNT = 1024;
+
+  std::array<uint64_t, SAMPLE_COUNT> m_Samples = {};
+  size_t m_SampleCount = 0;
+
+public:
+  void Record(uint64_t latencyNs) {
+    m_Samples[m_SampleCount++ % SAMPLE_COUNT] = latencyNs;
+  }
+
+  Summary Summarize() const {
+    Summary summary;
+    summary.samples = m_SampleCount;
+
+    size_t count = std::min(m_SampleCount, SAMPLE_COUNT);
+    if (!count)
+      return summary;
+
+    std::array<uint64_t, SAMPLE_COUNT> sorted = m_Samples;
+    std::sort(sorted.begin(), sorted.begin() + count);
+
+    uint64_t total = 0;
+    for (size_t i = 0; i < count; i++)
+      total += sorted[i];
+
+    summary.averageMs = total / 1e6 / count;
+    summary.p95Ms = sorted[(count * 95) / 100] / 1e6;
+    summary.maxMs = sorted[count - 1] / 1e6;
+
+    return summary;
+  }
+};
@@ -0,0 +1,70 @@
+#include "Microphone.h"
+
+#include <stdexcept>
+
+#include "Utility.h"
+
+Microphone::Microphone(int sampleRate, int channels, double frameMs)
+    : m_SampleRate(sampleRate), m_Channels(channels),
+      m_Encoder(sampleRate, 32, channels, frameMs, OPUS_APPLICATION_VOIP) {
+  Pa_Initialize();
+
+  PaStreamParameters in{};
+  in.device = Pa_GetDefaultInputDevice();
+  if (in.device == paNoDevice) {
+    Pa_Terminate();
+    throw std::runtime_error("No microphone found");
+  }
+
+  in.channelCount = m_Channels;
+  in.sampleFormat = paFloat32;
+  in.suggestedLatency = Pa_GetDeviceInfo(in.device)->defaultLowInputLatency;
+
+  m_Buffer.resize(static_cast<size_t>(m_Encoder.FrameSize()) * m_Channels);
+
+  // No callback, Pa_ReadStream blocks until a whole frame is captured
+  if (Pa_OpenStream(&m_Stream, &in, nullptr, m_SampleRate,
+                    m_Encoder.FrameSize(), paNoFlag, nullptr,
+                    nullptr) != paNoError) {
+    Pa_Terminate();
+    throw std::runtime_error("Failed to open the microphone");
+  }
+}
+
+Microphone::~Microphone() {
+  Stop();
+  Pa_CloseStream(m_Stream);
+  Pa_Terminate();
+}
+
+void Microphone::Start(const AudioEncoder::PacketCallback &onPacket) {
+  if (m_Running.exchange(true))
+    return;
+
+  Pa_StartStream(m_Stream);
+
+  m_Thread = std::thread([this, onPacket]() {
+    while (m_Running.load(std::memory_order::relaxed)) {
+      PaError error =
+          Pa_ReadStream(m_Stream, m_Buffer.data(), m_Encoder.FrameSize());
+
+      // An overflow still fills the buffer, we just lost older samples
+      if (error != paNoError && error != paInputOverflowed) {
+        LOG("Microphone read failed:", Pa_GetErrorText(error));
+        break;
+      }
+
+      m_Encoder.Encode(m_Buffer.data(), m_Buffer.size(), onPacket);
+    }
+  });
+}
+
+void Microphone::Stop() {
+  if (!m_Running.exchange(false))
+    return;
+
+  if (m_Thread.joinable())
+    m_Thread.join();
+
+  Pa_StopStream(m_Stream);
+}
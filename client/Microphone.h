@@ -0,0 +1,34 @@
+#pragma once
+#include <atomic>
+#include <portaudio.h>
+#include <thread>
+#include <vector>
+
+#include "AudioEncoder.h"
+
+// Captures the default input device and encodes it for the server. Reads
+// block on a thread of their own, one Opus frame at a time.
+class Microphone {
+private:
+  PaStream *m_Stream = nullptr;
+  int m_SampleRate;
+  int m_Channels;
+
+  AudioEncoder m_Encoder;
+  std::vector<float> m_Buffer;
+
+  std::atomic<bool> m_Running = false;
+  std::thread m_Thread;
+
+public:
+  // Short speech tuned frames, the whole path has to stay conversational
+  Microphone(int sampleRate = 48000, int channels = 1, double frameMs = 10.0);
+  ~Microphone();
+
+  int SampleRate() const { return m_SampleRate; }
+  int Channels() const { return m_Channels; }
+
+  // `onPacket` runs on the capture thread
+  void Start(const AudioEncoder::PacketCallback &onPacket);
+  void Stop();
+};
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+// Persistently mapped pixel buffers the video thread decodes straight into,
+// so presenting a frame only issues the texture upload from one. The render
+// thread creates, fences and deletes the buffers (GL names are kept opaque
+// here), the video thread takes a free one, fills it and queues it with the
+// frame. A buffer comes back when its frame is dropped, or once the render
+// thread saw the GPU finish the upload from it.
+class PixelBufferPool {
+public:
+  struct Buffer {
+    uint32_t id = 0;
+    uint8_t *data = nullptr;
+  };
+
+  // Owned by the queued frame, returns the buffer when the last owner lets go
+  class Slot {
+  private:
+    friend class PixelBufferPool;
+
+    PixelBufferPool *m_Pool = nullptr;
+    Buffer m_Buffer;
+    uint32_t m_Generation = 0;
+    size_t m_Size = 0;
+    bool m_Writing = true;
+
+  public:
+    Slot(PixelBufferPool *pool, Buffer buffer, uint32_t generation,
+         size_t size)
+        : m_Pool(pool), m_Buffer(buffer), m_Generation(generation),
+          m_Size(size) {}
+
+    ~Slot() {
+      Written();
+      m_Pool->Release(m_Buffer, m_Generation);
+    }
+
+    Slot(const Slot &) = delete;
+    Slot &operator=(const Slot &) = delete;
+
+    // Write only, the mapping is not readable
+    uint8_t *data() const { return m_Buffer.data; }
+    size_t size() const { return m_Size; }
+    uint32_t id() const { return m_Buffer.id; }
+
+    // The video thread is done with the memory, after this the render
+    // thread may unmap it at any time
+    void Written() {
+      if (!m_Writing)
+        return;
+
+      m_Writing = false;
+      m_Pool->Written();
+    }
+  };
+
+private:
+  std::mutex m_Mutex;
+  std::condition_variable m_CV;
+
+  std::vector<Buffer> m_Free;
+  // From before the last resize, deleted by the render thread as they come
+  // back
+  std::vector<uint32_t> m_Retired;
+  uint32_t m_Generation = 0;
+  size_t m_Size = 0;
+  // Slots the video thread is still filling
+  int m_Writing = 0;
+  bool m_Closed = false;
+
+  void Written() {
+    {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      m_Writing--;
+    }
+    m_CV.notify_all();
+  }
+
+  void Release(Buffer buffer, uint32_t generation) {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    if (m_Closed)
+      return;
+
+    if (generation == m_Generation)
+      m_Free.push_back(buffer);
+    else
+      m_Retired.push_back(buffer.id);
+  }
+
+public:
+  // Video thread. A free buffer for a frame of `size` bytes, nullptr if the
+  // pool has none of that size right now
+  std::shared_ptr<Slot> Acquire(size_t size) {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    if (m_Closed || size != m_Size || m_Free.empty())
+      return nullptr;
+
+    Buffer buffer = m_Free.back();
+    m_Free.pop_back();
+    m_Writing++;
+
+    return std::make_shared<Slot>(this, buffer, m_Generation, size);
+  }
+
+  // Render thread. Buffers handed out before are retired, the ones already
+  // back are returned for deleting
+  std::vector<uint32_t> Resize(size_t size) {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    m_Generation++;
+    m_Size = size;
+
+    std::vector<uint32_t> retired = std::move(m_Retired);
+    m_Retired.clear();
+    for (const Buffer &buffer : m_Free)
+      retired.push_back(buffer.id);
+    m_Free.clear();
+
+    return retired;
+  }
+
+  // Render thread, after Resize
+  void Add(Buffer buffer) {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Free.push_back(buffer);
+  }
+
+  // Render thread, retired buffers that came back since the last call
+  std::vector<uint32_t> TakeRetired() {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return std::exchange(m_Retired, {});
+  }
+
+  // Render thread, before it deletes every buffer. Waits for the video
+  // thread to finish the slot it is filling, nothing is handed out after
+  void Close() {
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    m_Closed = true;
+    m_CV.wait(lock, [this]() { return m_Writing == 0; });
+
+    m_Free.clear();
+    m_Retired.clear();
+  }
+};
@@ -1,13 +1,65 @@
 #include "StreamPlayer.h"
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 
+#include "Utility.h"
+
 constexpr uint64_t ONE_SECOND_NS = 1'000'000'000ULL; // 1 s
 constexpr uint64_t EARLY_TOLERANCE_NS = 5'000'000;   // 5 ms
 constexpr uint64_t MAX_LATE_NS = 30'000'000;         // 30 ms
 
-StreamPlayer::StreamPlayer(int sampleRate, int channels, uint64_t bufferNs)
-    : m_SampleRate(sampleRate), m_Channels(channels), m_BufferNs(bufferNs) {
+// Jitter buffer bounds and how aggressively it converges
+constexpr uint64_t MIN_DELAY_NS = 10'000'000;  // 10 ms
+constexpr uint64_t MAX_DELAY_NS = 250'000'000; // 250 ms
+constexpr uint64_t DEAD_BAND_NS = 5'000'000;   // 5 ms
+constexpr double JITTER_MULTIPLIER = 4.0;
+// Playback speed deviation used to converge. Resampling shifts the pitch
+// with it, 0.5% is about 9 cents
+constexpr double MAX_STRETCH = 0.005;
+// How far the speed may move per chunk, ramped across the chunk
+constexpr double STRETCH_STEP = 0.001;
+
+static Metrics::Gauge &bufferedDelay = Metrics::Get().GetGauge(
+    "ssrd_audio_buffered_seconds", "Audio waiting in the jitter buffer");
+static Metrics::Gauge &targetDelay = Metrics::Get().GetGauge(
+    "ssrd_audio_target_delay_seconds", "Jitter buffer target");
+static Metrics::Gauge &jitter = Metrics::Get().GetGauge(
+    "ssrd_audio_jitter_seconds", "Interarrival jitter (RFC 3550)");
+static Metrics::Histogram &videoQueueTime = Metrics::Get().GetHistogram(
+    "ssrd_video_queue_seconds", "Decoded frame waiting for its presentation");
+static Metrics::Counter &lateFrames = Metrics::Get().GetCounter(
+    "ssrd_video_late_frames_total", "Decoded frames dropped as too late");
+
+StreamPlayer::StreamPlayer(uint64_t initialDelayNs)
+    : m_TargetDelayNs(std::clamp(initialDelayNs, MIN_DELAY_NS, MAX_DELAY_NS)) {
   Pa_Initialize();
+}
+
+StreamPlayer::~StreamPlayer() {
+  if (m_Stream) {
+    Pa_StopStream(m_Stream);
+    Pa_CloseStream(m_Stream);
+  }
+  Pa_Terminate();
+}
+
+void StreamPlayer::ConfigureAudio(int sampleRate, int channels) {
+  if (m_Stream && sampleRate == m_SampleRate && channels == m_Channels)
+    return;
+
+  m_PlaybackStarted.store(false, std::memory_order::release);
+
+  if (m_Stream) {
+    Pa_StopStream(m_Stream);
+    Pa_CloseStream(m_Stream);
+    m_Stream = nullptr;
+  }
+
+  std::lock_guard<std::mutex> lock(m_FormatMutex);
+
+  m_SampleRate = sampleRate;
+  m_Channels = channels;
 
   PaStreamParameters out{};
   out.device = Pa_GetDefaultOutputDevice();
@@ -15,18 +67,23 @@ StreamPlayer::StreamPlayer(int sampleRate, int channels, uint64_t bufferNs)
   out.sampleFormat = paFloat32;
   out.suggestedLatency = Pa_GetDeviceInfo(out.device)->defaultLowOutputLatency;
 
-  m_RingBuffer.resize((m_SampleRate * m_Channels) +
-                      (m_SampleRate * m_Channels *
-                       (static_cast<float>(m_BufferNs) / ONE_SECOND_NS)));
+  // The stream is stopped so neither side of the ring is running, the lock
+  // keeps the clock readers out
+  m_Ring.Reset((m_SampleRate * m_Channels) +
+               (m_SampleRate * m_Channels *
+                (static_cast<float>(MAX_DELAY_NS) / ONE_SECOND_NS)));
+
+  m_StretchPosition = 0.0;
+  m_StretchRatio = 1.0;
+  m_StretchLast.assign(m_Channels, 0.0f);
+  m_LastArrivalNs = 0;
 
   Pa_OpenStream(&m_Stream, nullptr, &out, m_SampleRate, 256, paNoFlag, Callback,
                 this);
-}
 
-StreamPlayer::~StreamPlayer() {
-  Pa_StopStream(m_Stream);
-  Pa_CloseStream(m_Stream);
-  Pa_Terminate();
+  m_OutputLatencyNs = 0;
+  if (const PaStreamInfo *info = Pa_GetStreamInfo(m_Stream))
+    m_OutputLatencyNs = static_cast<uint64_t>(info->outputLatency * 1e9);
 }
 
 int StreamPlayer::Callback(const void *, void *output, unsigned long frameCount,
@@ -34,71 +91,214 @@ int StreamPlayer::Callback(const void *, void *output, unsigned long frameCount,
                            PaStreamCallbackFlags, void *userData) {
   auto *self = static_cast<StreamPlayer *>(userData);
   float *out = static_cast<float *>(output);
+  size_t wanted = frameCount * self->m_Channels;
+
+  if (!self->m_PlaybackStarted.load(std::memory_order::acquire)) {
+    std::fill_n(out, wanted, 0.0f);
+    return paContinue;
+  }
 
-  size_t read = self->m_ReadPos.load(std::memory_order::acquire);
-  size_t write = self->m_WritePos.load(std::memory_order::acquire);
+  size_t read = self->m_Ring.Read(out, wanted);
 
-  bool played = false;
+  if (read < wanted) {
+    std::fill_n(out + read, wanted - read, 0.0f);
+    self->m_Underruns.Add();
+  }
+
+  return paContinue;
+}
+
+void StreamPlayer::UpdateTargetDelay(uint64_t pts, uint64_t packetNs) {
+  uint64_t arrival = monotonicNs();
 
-  for (unsigned long i = 0; i < frameCount * self->m_Channels; ++i) {
-    if (!self->m_PlaybackStarted.load(std::memory_order::acquire) ||
-        read == write)
-      out[i] = 0.0f;
-    else {
-      out[i] = self->m_RingBuffer[read];
-      read = (read + 1) % self->m_RingBuffer.size();
-      played = true;
+  // RFC 3550 interarrival jitter
+  if (m_LastArrivalNs) {
+    double transit = static_cast<double>(arrival - m_LastArrivalNs) -
+                     (static_cast<double>(pts) - static_cast<double>(m_LastPts));
+    double jitter = m_JitterNs.load(std::memory_order::relaxed);
+    m_JitterNs.store(jitter + (std::abs(transit) - jitter) / 16.0,
+                     std::memory_order::relaxed);
+  }
+
+  m_LastArrivalNs = arrival;
+  m_LastPts = pts;
+
+  uint64_t desired =
+      packetNs + static_cast<uint64_t>(
+                     JITTER_MULTIPLIER * m_JitterNs.load(std::memory_order::relaxed));
+  uint64_t target = m_TargetDelayNs.load(std::memory_order::relaxed);
+
+  // Grow straight away to avoid underruns, shrink slowly once the network
+  // calms down
+  if (desired > target)
+    target = desired;
+  else
+    target -= (target - desired) / 64;
+
+  m_TargetDelayNs.store(std::clamp(target, MIN_DELAY_NS, MAX_DELAY_NS),
+                        std::memory_order::relaxed);
+}
+
+// The speed glides from `from` to `to` over the chunk
+const std::vector<float> &StreamPlayer::Stretch(const std::vector<float> &buffer,
+                                                double from, double to) {
+  size_t frames = buffer.size() / m_Channels;
+
+  m_StretchBuffer.clear();
+
+  if (!frames)
+    return m_StretchBuffer;
+
+  // Position in input frames, -1 is the last frame of the previous chunk
+  double position = m_StretchPosition;
+
+  while (position <= static_cast<double>(frames - 1)) {
+    double base = std::floor(position);
+    float fraction = static_cast<float>(position - base);
+    long index = static_cast<long>(base);
+
+    for (int ch = 0; ch < m_Channels; ch++) {
+      float a = index < 0 ? m_StretchLast[ch] : buffer[index * m_Channels + ch];
+      float b = static_cast<size_t>(index + 1) < frames
+                    ? buffer[(index + 1) * m_Channels + ch]
+                    : a;
+      m_StretchBuffer.push_back(a + (b - a) * fraction);
     }
+
+    position += from + (to - from) * std::max(position, 0.0) / frames;
   }
 
-  self->m_ReadPos.store(read, std::memory_order::release);
+  m_StretchPosition = position - static_cast<double>(frames);
 
-  if (played)
-    self->m_FramesPlayed.fetch_add(frameCount, std::memory_order::release);
+  for (int ch = 0; ch < m_Channels; ch++)
+    m_StretchLast[ch] = buffer[(frames - 1) * m_Channels + ch];
 
-  return paContinue;
+  return m_StretchBuffer;
+}
+
+void StreamPlayer::Write(const float *samples, size_t count) {
+  // Whole frames only so the channels stay interleaved after an overrun
+  size_t space = m_Ring.Free();
+  space -= space % m_Channels;
+
+  if (count > space) {
+    m_Overruns.Add();
+    count = space;
+  }
+
+  m_Ring.Write(samples, count);
 }
 
 void StreamPlayer::AudioBuffer(const std::vector<float> &buffer, uint64_t pts) {
+  if (buffer.empty() || !m_Stream)
+    return;
+
+  uint64_t packetNs =
+      (buffer.size() / m_Channels) * ONE_SECOND_NS / m_SampleRate;
+
+  UpdateTargetDelay(pts, packetNs);
+
+  uint64_t target = m_TargetDelayNs.load(std::memory_order::relaxed);
+  uint64_t buffered = BufferedDelay();
 
-  if (!m_Started.load(std::memory_order::acquire)) {
-    m_StartPTS = pts;
-    m_PlaybackStartPTS = pts + m_BufferNs;
-    m_Started.store(true, std::memory_order::release);
+  bufferedDelay.Set(buffered / 1e9);
+  targetDelay.Set(target / 1e9);
+  jitter.Set(m_JitterNs.load(std::memory_order::relaxed) / 1e9);
+
+  // Play slightly faster or slower until the buffered delay reaches the
+  // target. The speed only moves a step per chunk so crossing the dead band
+  // doesn't make the pitch wobble
+  double desired = 1.0;
+  if (m_PlaybackStarted.load(std::memory_order::acquire)) {
+    double error =
+        static_cast<double>(buffered) - static_cast<double>(target);
+    if (std::abs(error) > DEAD_BAND_NS)
+      desired =
+          1.0 + std::clamp(error / ONE_SECOND_NS, -MAX_STRETCH, MAX_STRETCH);
   }
 
-  size_t write = m_WritePos.load(std::memory_order::acquire);
-  size_t read = m_ReadPos.load(std::memory_order::acquire);
-  size_t size = m_RingBuffer.size();
+  double from = m_StretchRatio;
+  double ratio = from + std::clamp(desired - from, -STRETCH_STEP, STRETCH_STEP);
+  if (std::abs(ratio - 1.0) < STRETCH_STEP / 2 && desired == 1.0)
+    ratio = 1.0;
+  m_StretchRatio = ratio;
 
-  for (float s : buffer) {
-    size_t next = (write + 1) % size;
-    if (next == read)
-      break;
-    m_RingBuffer[write] = s;
-    write = next;
+  if (from == 1.0 && ratio == 1.0) {
+    // Dropping the sub-sample phase left by a previous stretch is inaudible
+    m_StretchPosition = 0.0;
+    Write(buffer.data(), buffer.size());
+    m_StretchLast.assign(buffer.end() - m_Channels, buffer.end());
+  } else {
+    const std::vector<float> &stretched = Stretch(buffer, from, ratio);
+    Write(stretched.data(), stretched.size());
   }
 
-  m_WritePos.store(write, std::memory_order::release);
+  m_WritePts.store(pts + packetNs, std::memory_order::release);
 
   if (!m_PlaybackStarted.load(std::memory_order::acquire) &&
-      pts >= m_PlaybackStartPTS)
+      BufferedDelay() >= target)
     Start();
 }
 
+bool StreamPlayer::IsPlaying() const {
+  return m_PlaybackStarted.load(std::memory_order::acquire);
+}
+
 uint64_t StreamPlayer::AudioClock() const {
-  if (!m_PlaybackStarted.load(std::memory_order::acquire))
-    return m_PlaybackStartPTS;
+  std::lock_guard<std::mutex> lock(m_FormatMutex);
+  uint64_t written = m_WritePts.load(std::memory_order::acquire);
+  uint64_t behind = Buffered() + m_OutputLatencyNs;
+  return written > behind ? written - behind : 0;
+}
+
+uint64_t StreamPlayer::TargetDelay() const {
+  return m_TargetDelayNs.load(std::memory_order::relaxed);
+}
+
+uint64_t StreamPlayer::BufferedDelay() const {
+  std::lock_guard<std::mutex> lock(m_FormatMutex);
+  return Buffered();
+}
+
+uint64_t StreamPlayer::Buffered() const {
+  if (!m_SampleRate)
+    return 0;
+
+  return (m_Ring.Size() / m_Channels) * ONE_SECOND_NS / m_SampleRate;
+}
+
+uint64_t StreamPlayer::Jitter() const {
+  return static_cast<uint64_t>(m_JitterNs.load(std::memory_order::relaxed));
+}
+
+uint64_t StreamPlayer::Underruns() const {
+  return m_Underruns.Value();
+}
+
+uint64_t StreamPlayer::Overruns() const {
+  return m_Overruns.Value();
+}
 
-  uint64_t frames = m_FramesPlayed.load(std::memory_order::acquire);
-  uint64_t ns = (frames * ONE_SECOND_NS) / m_SampleRate;
-  return m_StartPTS + ns;
+void StreamPlayer::VideoBuffer(std::vector<uint8_t> buffer, uint64_t ns) {
+  std::lock_guard<std::mutex> lock(m_VideoMutex);
+  m_VideoQueue.push_back({std::move(buffer), nullptr, ns, monotonicNs()});
+
+  if (m_OnVideoFrame)
+    m_OnVideoFrame();
 }
 
-void StreamPlayer::VideoBuffer(const std::vector<uint8_t> &buffer,
+void StreamPlayer::VideoBuffer(std::shared_ptr<PixelBufferPool::Slot> slot,
                                uint64_t ns) {
   std::lock_guard<std::mutex> lock(m_VideoMutex);
-  m_VideoQueue.push_back({buffer, ns});
+  m_VideoQueue.push_back({{}, std::move(slot), ns, monotonicNs()});
+
+  if (m_OnVideoFrame)
+    m_OnVideoFrame();
+}
+
+void StreamPlayer::OnVideoFrame(const std::function<void()> &callback) {
+  std::lock_guard<std::mutex> lock(m_VideoMutex);
+  m_OnVideoFrame = callback;
 }
 
 void StreamPlayer::Start() {
@@ -106,17 +306,19 @@ void StreamPlayer::Start() {
   Pa_StartStream(m_Stream);
 }
 
-std::vector<uint8_t> StreamPlayer::Update() {
+StreamPlayer::VideoFrame StreamPlayer::Update() {
   if (!m_PlaybackStarted.load(std::memory_order::acquire))
     return {};
 
   uint64_t audioNs = AudioClock();
-  std::vector<uint8_t> result;
+  VideoFrame result;
 
   std::lock_guard<std::mutex> lock(m_VideoMutex);
 
-  while (!m_VideoQueue.empty() && m_VideoQueue.front().ns < audioNs - MAX_LATE_NS)
+  while (!m_VideoQueue.empty() && m_VideoQueue.front().ns < audioNs - MAX_LATE_NS) {
     m_VideoQueue.pop_front();
+    lateFrames.Add();
+  }
 
   if (m_VideoQueue.empty())
     return {};
@@ -124,9 +326,29 @@ std::vector<uint8_t> StreamPlayer::Update() {
   auto &frame = m_VideoQueue.front();
 
   if (frame.ns <= audioNs + EARLY_TOLERANCE_NS) {
-    result = frame.data;
+    result = std::move(frame);
     m_VideoQueue.pop_front();
+    videoQueueTime.Record(monotonicNs() - result.queuedNs);
   }
 
   return result;
+}
+
+int64_t StreamPlayer::NextFrameDelay() {
+  std::lock_guard<std::mutex> lock(m_VideoMutex);
+
+  if (m_VideoQueue.empty())
+    return -1;
+
+  // Playback starts from the audio thread, poll until then
+  if (!m_PlaybackStarted.load(std::memory_order::acquire))
+    return EARLY_TOLERANCE_NS;
+
+  uint64_t audioNs = AudioClock();
+  uint64_t due = m_VideoQueue.front().ns;
+
+  if (due <= audioNs + EARLY_TOLERANCE_NS)
+    return 0;
+
+  return static_cast<int64_t>(due - audioNs - EARLY_TOLERANCE_NS);
 }
\ No newline at end of file
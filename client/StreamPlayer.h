@@ -1,17 +1,31 @@
 #pragma once
 #include <atomic>
 #include <deque>
+#include <functional>
+#include <memory>
 #include <mutex>
 #include <portaudio.h>
 #include <vector>
 
+#include "Metrics.h"
+#include "PixelBufferPool.h"
+#include "SpscRing.h"
+
 class StreamPlayer {
-private:
+public:
   struct VideoFrame {
+    // I420 planes either in data or, decoded straight into a pixel buffer, in
+    // slot
     std::vector<uint8_t> data;
-    uint64_t ns;
+    std::shared_ptr<PixelBufferPool::Slot> slot;
+    uint64_t ns = 0;
+    // Local monotonic time the frame was queued after decoding
+    uint64_t queuedNs = 0;
+
+    bool empty() const { return data.empty() && !slot; }
   };
 
+private:
   std::deque<VideoFrame> m_VideoQueue;
 
   static int Callback(const void *input, void *output, unsigned long frameCount,
@@ -19,33 +33,87 @@ private:
                       void *userData);
 
   PaStream *m_Stream = nullptr;
-  int m_SampleRate;
-  int m_Channels;
-  uint64_t m_BufferNs;
-
-  std::vector<float> m_RingBuffer;
-  std::atomic<size_t> m_ReadPos{0};
-  std::atomic<size_t> m_WritePos{0};
-  std::atomic<uint64_t> m_FramesPlayed{0};
+
+  // Held while ConfigureAudio replaces the format and the ring, the video
+  // and render threads read them through AudioClock and BufferedDelay
+  mutable std::mutex m_FormatMutex;
+  int m_SampleRate = 0;
+  int m_Channels = 0;
+  uint64_t m_OutputLatencyNs = 0;
+
+  // Written by the thread calling AudioBuffer, read by the PortAudio callback
+  SpscRing<float> m_Ring;
+  // Callbacks that ran dry while playing / writes that didn't fit
+  Metrics::Counter &m_Underruns = Metrics::Get().GetCounter(
+      "ssrd_audio_underruns_total", "Playback callbacks that ran dry");
+  Metrics::Counter &m_Overruns = Metrics::Get().GetCounter(
+      "ssrd_audio_overruns_total", "Decoded audio that didn't fit the ring");
   std::mutex m_VideoMutex;
+  std::function<void()> m_OnVideoFrame = nullptr;
 
   std::atomic<bool> m_PlaybackStarted = false;
-  std::atomic<bool> m_Started = false;
 
-  uint64_t m_StartPTS = 0;
-  uint64_t m_PlaybackStartPTS = 0;
+  // Jitter buffer, only touched by the thread calling AudioBuffer except for
+  // the atomics which are read for metrics and the clock
+  uint64_t m_LastArrivalNs = 0;
+  uint64_t m_LastPts = 0;
+  std::atomic<double> m_JitterNs{0.0};
+  std::atomic<uint64_t> m_TargetDelayNs;
+  std::atomic<uint64_t> m_WritePts{0};
+
+  // Time stretch state carried across chunks so boundaries don't click, the
+  // ratio the last chunk ended on included so the speed never jumps
+  double m_StretchPosition = 0.0;
+  double m_StretchRatio = 1.0;
+  std::vector<float> m_StretchLast;
+  std::vector<float> m_StretchBuffer;
 
   void Start();
 
-  uint64_t AudioClock() const;
+  void UpdateTargetDelay(uint64_t pts, uint64_t packetNs);
+
+  const std::vector<float> &Stretch(const std::vector<float> &buffer,
+                                    double from, double to);
+
+  void Write(const float *samples, size_t count);
+
+  // BufferedDelay with m_FormatMutex held
+  uint64_t Buffered() const;
 
 public:
-  StreamPlayer(int sampleRate, int channels = 2,
-               uint64_t bufferNs = 100'000'000);
+  StreamPlayer(uint64_t initialDelayNs = 40'000'000);
   ~StreamPlayer();
 
+  // Opens the output for the format the server encodes at. Called from the
+  // thread feeding AudioBuffer, before the first buffer and again whenever the
+  // format changes, playback restarts once the jitter buffer refills
+  void ConfigureAudio(int sampleRate, int channels);
+
   void AudioBuffer(const std::vector<float> &buffer, uint64_t pts);
-  void VideoBuffer(const std::vector<uint8_t> &buffer, uint64_t pts);
+  void VideoBuffer(std::vector<uint8_t> buffer, uint64_t pts);
+  void VideoBuffer(std::shared_ptr<PixelBufferPool::Slot> slot, uint64_t pts);
+
+  void OnVideoFrame(const std::function<void()> &callback);
+
+  bool IsPlaying() const;
+
+  // Stream time of the sample currently being played
+  uint64_t AudioClock() const;
+
+  // Delay the jitter buffer is converging to
+  uint64_t TargetDelay() const;
+
+  // Audio currently queued ahead of the speaker
+  uint64_t BufferedDelay() const;
+
+  // Smoothed packet arrival jitter
+  uint64_t Jitter() const;
+
+  uint64_t Underruns() const;
+  uint64_t Overruns() const;
+
+  VideoFrame Update();
 
-  std::vector<uint8_t> Update();
+  // Nanoseconds until the next queued frame is due, -1 if nothing is queued
+  int64_t NextFrameDelay();
 };
\ No newline at end of file
@@ -3,6 +3,11 @@
 #include "glad/glad.h"
 #include <GLFW/glfw3.h>
 
+#include "FramePacer.h"
+#include "PixelBufferPool.h"
+
+#include <algorithm>
+#include <cstring>
 #include <functional>
 #include <stdio.h>
 #include <stdlib.h>
@@ -21,28 +26,56 @@ void main()
 }
 )";
 
+// BT.601 limited range, matches the swscale conversion done by the encoder
 static const char *fragmentShaderT = R"(
 #version 110
 varying vec2 TexCoord;
-uniform sampler2D m_Texture;
+uniform sampler2D m_TextureY;
+uniform sampler2D m_TextureU;
+uniform sampler2D m_TextureV;
 void main()
 {
     vec2 flippedUV = vec2(TexCoord.x, 1.0 - TexCoord.y);
-    gl_FragColor = texture2D(m_Texture, flippedUV);
+    float y = 1.164 * (texture2D(m_TextureY, flippedUV).r - 0.0625);
+    float u = texture2D(m_TextureU, flippedUV).r - 0.5;
+    float v = texture2D(m_TextureV, flippedUV).r - 0.5;
+    gl_FragColor = vec4(y + 1.596 * v,
+                        y - 0.392 * u - 0.813 * v,
+                        y + 2.017 * u,
+                        1.0);
 }
 )";
 
+// Frames in flight between the CPU and the GPU
+static constexpr int PIXEL_BUFFER_COUNT = 3;
+// Pixel buffers the video thread decodes into, enough for the frames queued
+// for pacing plus the ones in flight
+static constexpr int POOL_BUFFER_COUNT = 8;
+
 static void errorCallback(int error, const char *description) {
   fprintf(stderr, "Error: %s\n", description);
 }
 
 class Window {
+public:
+  // One column of the overlay graph, height in pixels
+  struct OverlayBar {
+    int height = 0;
+    float r = 0.0f, g = 0.0f, b = 0.0f;
+  };
+
 private:
   struct Vertex {
     float x, y;
     float u, v;
   };
 
+  struct PixelBuffer {
+    GLuint id = 0;
+    GLsync fence = nullptr;
+    uint8_t *mapped = nullptr;
+  };
+
   struct Init {
     void *data = nullptr;
     GLFWframebuffersizefun onResize = nullptr;
@@ -50,25 +83,273 @@ private:
     GLFWcursorposfun onMouseMove = nullptr;
     GLFWmousebuttonfun onMouseButton = nullptr;
     GLFWscrollfun onScroll = nullptr;
+    PresentMode presentMode = PresentMode::VSYNC;
+    // Filled with persistently mapped buffers when the context has them
+    PixelBufferPool *pixelBufferPool = nullptr;
+  };
+
+  // A slot uploaded from, handed back once the GPU is done with it
+  struct PendingSlot {
+    std::shared_ptr<PixelBufferPool::Slot> slot;
+    GLsync fence = nullptr;
   };
 
 private:
   GLFWwindow *m_Window = nullptr;
 
-  GLuint m_VertexBuffer = 0, m_Texture = 0, m_VertexShader = 0,
-         m_FragmentShader = 0, m_Program = 0;
+  // Y, U and V planes
+  GLuint m_Textures[3] = {0, 0, 0};
+
+  GLuint m_VertexBuffer = 0, m_VertexShader = 0, m_FragmentShader = 0,
+         m_Program = 0;
   GLint m_VPosLocation = 0, m_VTexLocation = 0;
 
   uint32_t m_TexWidth = 0, m_TexHeight = 0;
 
-  std::vector<uint8_t> m_Buffer = {};
+  PixelBuffer m_PixelBuffers[PIXEL_BUFFER_COUNT] = {};
+  int m_PixelBufferIndex = 0;
+  bool m_PersistentMapping = false;
+
+  // Every buffer the pool knows about, current or retired
+  PixelBufferPool *m_Pool = nullptr;
+  std::vector<GLuint> m_PoolBuffers;
+  std::vector<PendingSlot> m_PendingSlots;
+
+  FramePacer m_Pacer;
+  int m_RefreshRate = 60;
+
+  int m_FramebufferWidth = 0, m_FramebufferHeight = 0;
+  bool m_HasFrame = false;
+
+  // Drawn over the bottom left corner of every presented frame, a ring once
+  // full with m_OverlayNext the oldest column
+  std::vector<OverlayBar> m_Overlay;
+  size_t m_OverlayNext = 0;
 
   Init m_Init;
 
+private:
+  int planeWidth(int plane) const {
+    return plane ? (m_TexWidth + 1) / 2 : m_TexWidth;
+  }
+
+  int planeHeight(int plane) const {
+    return plane ? (m_TexHeight + 1) / 2 : m_TexHeight;
+  }
+
+  // Scissored clears, cheaper than a shader and independent of the viewport
+  void drawOverlay() {
+    if (m_Overlay.empty())
+      return;
+
+    constexpr int BAR_WIDTH = 2;
+
+    glEnable(GL_SCISSOR_TEST);
+
+    for (size_t i = 0; i < m_Overlay.size(); i++) {
+      const OverlayBar &bar = m_Overlay[(m_OverlayNext + i) % m_Overlay.size()];
+      if (bar.height <= 0)
+        continue;
+
+      glScissor(static_cast<GLint>(i) * BAR_WIDTH, 0, BAR_WIDTH,
+                std::min(bar.height, m_FramebufferHeight));
+      glClearColor(bar.r, bar.g, bar.b, 1.0f);
+      glClear(GL_COLOR_BUFFER_BIT);
+    }
+
+    glDisable(GL_SCISSOR_TEST);
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+  }
+
+  size_t frameSize() const {
+    return planeWidth(0) * planeHeight(0) + planeWidth(1) * planeHeight(1) * 2;
+  }
+
+  void deletePixelBuffers() {
+    for (PixelBuffer &pbo : m_PixelBuffers) {
+      if (pbo.fence)
+        glDeleteSync(pbo.fence);
+
+      if (pbo.mapped) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo.id);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+      }
+
+      if (pbo.id)
+        glDeleteBuffers(1, &pbo.id);
+
+      pbo = {};
+    }
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  }
+
+  void createPixelBuffers() {
+    deletePixelBuffers();
+
+    GLsizeiptr size = static_cast<GLsizeiptr>(frameSize());
+
+    for (PixelBuffer &pbo : m_PixelBuffers) {
+      glGenBuffers(1, &pbo.id);
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo.id);
+
+      if (m_PersistentMapping) {
+        GLbitfield flags =
+            GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, nullptr, flags);
+        pbo.mapped = static_cast<uint8_t *>(
+            glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags));
+      } else
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+    }
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    m_PixelBufferIndex = 0;
+  }
+
+  void deletePoolBuffers(const std::vector<uint32_t> &ids) {
+    for (GLuint id : ids) {
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, id);
+      glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+      glDeleteBuffers(1, &id);
+      std::erase(m_PoolBuffers, id);
+    }
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  }
+
+  // Buffers still out with queued frames are deleted as they come back
+  void createPoolBuffers() {
+    if (!m_Pool)
+      return;
+
+    size_t size = frameSize();
+    deletePoolBuffers(m_Pool->Resize(size));
+
+    GLbitfield flags =
+        GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+    for (int i = 0; i < POOL_BUFFER_COUNT; i++) {
+      PixelBufferPool::Buffer buffer;
+      glGenBuffers(1, &buffer.id);
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer.id);
+      glBufferStorage(GL_PIXEL_UNPACK_BUFFER, static_cast<GLsizeiptr>(size),
+                      nullptr, flags);
+      buffer.data = static_cast<uint8_t *>(glMapBufferRange(
+          GL_PIXEL_UNPACK_BUFFER, 0, static_cast<GLsizeiptr>(size), flags));
+
+      m_PoolBuffers.push_back(buffer.id);
+      if (buffer.data)
+        m_Pool->Add(buffer);
+    }
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  }
+
+  // Hands back the slots whose upload finished, never waits
+  void reclaimSlots() {
+    std::erase_if(m_PendingSlots, [](PendingSlot &pending) {
+      GLenum status = glClientWaitSync(pending.fence, 0, 0);
+      if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+        return false;
+
+      glDeleteSync(pending.fence);
+      return true;
+    });
+
+    if (m_Pool)
+      deletePoolBuffers(m_Pool->TakeRetired());
+  }
+
+  // The video thread already decoded into the slot, only the upload is left
+  void uploadSlot(std::shared_ptr<PixelBufferPool::Slot> slot) {
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot->id());
+    uploadPlanes();
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    m_PendingSlots.push_back(
+        {std::move(slot), glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0)});
+  }
+
+  // From the bound pixel unpack buffer
+  void uploadPlanes() {
+    size_t offset = 0;
+
+    for (int i = 0; i < 3; i++) {
+      glActiveTexture(GL_TEXTURE0 + i);
+      glBindTexture(GL_TEXTURE_2D, m_Textures[i]);
+      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, planeWidth(i), planeHeight(i),
+                      GL_RED, GL_UNSIGNED_BYTE,
+                      reinterpret_cast<const void *>(offset));
+      offset += planeWidth(i) * planeHeight(i);
+    }
+  }
+
+  // Copies the frame into the next pixel buffer and issues the texture upload
+  // from it, the transfer to the GPU happens asynchronously. Only frames the
+  // pool had no buffer for take this path.
+  void upload(const std::vector<uint8_t> &buffer) {
+    PixelBuffer &pbo = m_PixelBuffers[m_PixelBufferIndex];
+    m_PixelBufferIndex = (m_PixelBufferIndex + 1) % PIXEL_BUFFER_COUNT;
+
+    size_t size = frameSize();
+
+    // Only blocks if the GPU is still reading this buffer from
+    // PIXEL_BUFFER_COUNT frames ago
+    if (pbo.fence) {
+      glClientWaitSync(pbo.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1'000'000'000);
+      glDeleteSync(pbo.fence);
+      pbo.fence = nullptr;
+    }
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo.id);
+
+    if (pbo.mapped)
+      memcpy(pbo.mapped, buffer.data(), size);
+    else {
+      // Orphan the storage so the driver doesn't sync with the previous upload
+      glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+      void *destination = glMapBufferRange(
+          GL_PIXEL_UNPACK_BUFFER, 0, size,
+          GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT |
+              GL_MAP_UNSYNCHRONIZED_BIT);
+      if (destination) {
+        memcpy(destination, buffer.data(), size);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+      }
+    }
+
+    uploadPlanes();
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    if (GLAD_GL_VERSION_3_2)
+      pbo.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  }
+
 public:
   Window() = default;
 
   ~Window() {
+    if (m_Pool) {
+      // Waits for a slot the video thread is still decoding into, queued
+      // frames never touch their buffer again
+      m_Pool->Close();
+
+      glFinish();
+      for (PendingSlot &pending : m_PendingSlots)
+        glDeleteSync(pending.fence);
+      m_PendingSlots.clear();
+
+      deletePoolBuffers(std::vector<uint32_t>(m_PoolBuffers.begin(),
+                                              m_PoolBuffers.end()));
+    }
+
+    deletePixelBuffers();
+
+    if (m_Textures[0])
+      glDeleteTextures(3, m_Textures);
+
     if (m_Program)
       glDeleteProgram(m_Program);
 
@@ -86,16 +367,26 @@ public:
     if (!glfwInit())
       exit(EXIT_FAILURE);
 
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
+    // GL_R8 textures, glMapBufferRange and pixel unpack buffers are 3.0, the
+    // shaders stay GLSL 1.10 so a compatibility context is fine
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 0);
 
     GLFWmonitor *monitor = glfwGetPrimaryMonitor();
     const GLFWvidmode *mode = glfwGetVideoMode(monitor);
 
+    m_RefreshRate = mode->refreshRate;
+
     m_Window =
         glfwCreateWindow(mode->width, mode->height, "ssrd", monitor, nullptr);
     // m_Window = glfwCreateWindow(800, 600, "ssrd", nullptr, nullptr);
 
+    if (!m_Window) {
+      fprintf(stderr, "Failed to create a window with OpenGL 3.0\n");
+      glfwTerminate();
+      exit(EXIT_FAILURE);
+    }
+
     glfwSetWindowUserPointer(m_Window, init.data);
     glfwSetKeyCallback(m_Window, init.onKeyPress);
     glfwSetCursorPosCallback(m_Window, init.onMouseMove);
@@ -103,14 +394,41 @@ public:
     glfwSetMouseButtonCallback(m_Window, init.onMouseButton);
     glfwSetScrollCallback(m_Window, init.onScroll);
 
-    if (!m_Window) {
+    glfwMakeContextCurrent(m_Window);
+
+    if (!gladLoadGL() || !GLAD_GL_VERSION_3_0) {
+      fprintf(stderr, "OpenGL 3.0 or newer is required\n");
+      glfwDestroyWindow(m_Window);
       glfwTerminate();
       exit(EXIT_FAILURE);
     }
 
-    glfwMakeContextCurrent(m_Window);
-    gladLoadGL();
-    glfwSwapInterval(1);
+    switch (init.presentMode) {
+    case PresentMode::VSYNC:
+      glfwSwapInterval(1);
+      break;
+
+    case PresentMode::LOW_LATENCY:
+      // Anchored to vblank on the first present
+      glfwSwapInterval(0);
+      m_Pacer.SetRefreshRate(mode->refreshRate);
+      break;
+
+    case PresentMode::ADAPTIVE:
+      // Tear only when a frame misses vblank
+      glfwSwapInterval(glfwExtensionSupported("GLX_EXT_swap_control_tear") ||
+                               glfwExtensionSupported("WGL_EXT_swap_control_tear")
+                           ? -1
+                           : 1);
+      break;
+    }
+
+    // glBufferStorage, otherwise fall back to orphaning the pixel buffers
+    m_PersistentMapping = GLAD_GL_VERSION_4_4;
+
+    // The video thread can only decode into buffers that stay mapped
+    if (m_PersistentMapping)
+      m_Pool = init.pixelBufferPool;
 
     Vertex quad[4] = {{-1.0f, -1.0f, 0.0f, 0.0f},
                       {1.0f, -1.0f, 1.0f, 0.0f},
@@ -147,6 +465,14 @@ public:
     glEnableVertexAttribArray(m_VTexLocation);
     glVertexAttribPointer(m_VTexLocation, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex),
                           (void *)(2 * sizeof(float)));
+
+    glUseProgram(m_Program);
+    glUniform1i(glGetUniformLocation(m_Program, "m_TextureY"), 0);
+    glUniform1i(glGetUniformLocation(m_Program, "m_TextureU"), 1);
+    glUniform1i(glGetUniformLocation(m_Program, "m_TextureV"), 2);
+
+    // Chroma planes are not 4-byte aligned for every width
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
   }
 
   bool resize(uint32_t width, uint32_t height) {
@@ -156,17 +482,26 @@ public:
     m_TexWidth = width;
     m_TexHeight = height;
 
-    if (m_Texture)
-      glDeleteTextures(1, &m_Texture);
+    if (m_Textures[0])
+      glDeleteTextures(3, m_Textures);
+
+    glGenTextures(3, m_Textures);
+
+    for (int plane = 0; plane < 3; plane++) {
+      glBindTexture(GL_TEXTURE_2D, m_Textures[plane]);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                      plane ? GL_LINEAR : GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER,
+                      plane ? GL_LINEAR : GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+      glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, planeWidth(plane),
+                   planeHeight(plane), 0, GL_RED, GL_UNSIGNED_BYTE, NULL);
+    }
 
-    glGenTextures(1, &m_Texture);
-    glBindTexture(GL_TEXTURE_2D, m_Texture);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB,
-                 GL_UNSIGNED_BYTE, NULL);
+    createPixelBuffers();
+    createPoolBuffers();
+    m_HasFrame = false;
 
     //  Trigger a resize, aspect ratio may have changed
     {
@@ -178,31 +513,112 @@ public:
     return true;
   }
 
-  void present(uint32_t width, uint32_t height) {
-    resize(width, height);
+  // Draws and swaps only when there is a new frame or the framebuffer changed,
+  // otherwise the last uploaded texture stays on screen untouched. The frame
+  // is in `frame`, or already decoded into a pool buffer in `slot`. Returns
+  // true if the buffers were swapped.
+  bool present(uint32_t width, uint32_t height,
+               const std::vector<uint8_t> &frame,
+               std::shared_ptr<PixelBufferPool::Slot> slot = nullptr) {
+    bool dirty = resize(width, height);
+    reclaimSlots();
+
+    int framebufferWidth, framebufferHeight;
+    glfwGetFramebufferSize(m_Window, &framebufferWidth, &framebufferHeight);
+
+    if (framebufferWidth != m_FramebufferWidth ||
+        framebufferHeight != m_FramebufferHeight) {
+      m_FramebufferWidth = framebufferWidth;
+      m_FramebufferHeight = framebufferHeight;
+      dirty = true;
+    }
 
-    if (m_Buffer.empty()) {
-      glClear(GL_COLOR_BUFFER_BIT);
-      glfwSwapBuffers(m_Window);
-      glfwPollEvents();
-      return;
+    if (m_TexWidth && slot && slot->size() == frameSize()) {
+      uploadSlot(std::move(slot));
+      m_HasFrame = true;
+      dirty = true;
+    } else if (m_TexWidth && !frame.empty() && frame.size() >= frameSize()) {
+      upload(frame);
+      m_HasFrame = true;
+      dirty = true;
     }
 
-    glBindTexture(GL_TEXTURE_2D, m_Texture);
+    if (!dirty)
+      return false;
+
+    bool anchor = false;
 
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGB,
-                    GL_UNSIGNED_BYTE, m_Buffer.data());
+    if (m_Init.presentMode == PresentMode::LOW_LATENCY) {
+      // Sync this one swap to vblank to learn where vblank is
+      anchor = m_Pacer.ShouldAnchor(monotonicNs());
+      if (anchor)
+        glfwSwapInterval(1);
+      else
+        m_Pacer.WaitForVblank();
+    }
 
     glClear(GL_COLOR_BUFFER_BIT);
-    glUseProgram(m_Program);
-    glBindTexture(GL_TEXTURE_2D, m_Texture);
-    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+    if (m_HasFrame) {
+      glUseProgram(m_Program);
+      glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    }
+
+    drawOverlay();
 
     glfwSwapBuffers(m_Window);
-    glfwPollEvents();
+
+    if (anchor) {
+      glFinish();
+      m_Pacer.Anchor(monotonicNs());
+      glfwSwapInterval(0);
+    }
+
+    return true;
   }
 
-  int shouldClose() { return glfwWindowShouldClose(m_Window); }
+  // Sleeps until an input event arrives, wake() is called or the timeout in
+  // seconds expires
+  void waitEvents(double timeout) {
+    if (timeout > 0.0)
+      glfwWaitEventsTimeout(timeout);
+    else
+      glfwPollEvents();
+  }
+
+  // Safe to call from any thread
+  static void wake() { glfwPostEmptyEvent(); }
+
+  int refreshRate() const { return m_RefreshRate; }
+
+  // Appends a column shown from the next present on, replacing the oldest
+  // once there are `columns`
+  void pushOverlay(const OverlayBar &bar, size_t columns) {
+    if (m_Overlay.size() < columns) {
+      m_Overlay.push_back(bar);
+      return;
+    }
+
+    m_Overlay[m_OverlayNext] = bar;
+    m_OverlayNext = (m_OverlayNext + 1) % m_Overlay.size();
+  }
+
+  // Hides and confines the cursor so motion is reported as unbounded relative
+  // movement, raw (unaccelerated) where the platform supports it
+  static void setPointerLock(GLFWwindow *window, bool locked) {
+    glfwSetInputMode(window, GLFW_CURSOR,
+                     locked ? GLFW_CURSOR_DISABLED : GLFW_CURSOR_NORMAL);
+
+    if (glfwRawMouseMotionSupported())
+      glfwSetInputMode(window, GLFW_RAW_MOUSE_MOTION,
+                       locked ? GLFW_TRUE : GLFW_FALSE);
+  }
 
-  void setBuffer(const std::vector<uint8_t> &buffer) { m_Buffer = buffer; }
+  static bool isPointerLocked(GLFWwindow *window) {
+    return glfwGetInputMode(window, GLFW_CURSOR) == GLFW_CURSOR_DISABLED;
+  }
+
+  void setPointerLock(bool locked) { setPointerLock(m_Window, locked); }
+
+  int shouldClose() { return glfwWindowShouldClose(m_Window); }
 };
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Clamps to [-1, 1] and truncates, 8 samples per iteration where SIMD is
+// available
+static void floatToPCM16(const float *in, int16_t *out, size_t count) {
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  const __m128 low = _mm_set1_ps(-1.0f);
+  const __m128 high = _mm_set1_ps(1.0f);
+  const __m128 scale = _mm_set1_ps(32767.0f);
+
+  for (; i + 8 <= count; i += 8) {
+    __m128 a = _mm_loadu_ps(in + i);
+    __m128 b = _mm_loadu_ps(in + i + 4);
+    a = _mm_mul_ps(_mm_min_ps(_mm_max_ps(a, low), high), scale);
+    b = _mm_mul_ps(_mm_min_ps(_mm_max_ps(b, low), high), scale);
+    __m128i packed = _mm_packs_epi32(_mm_cvttps_epi32(a), _mm_cvttps_epi32(b));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), packed);
+  }
+#elif defined(__ARM_NEON)
+  const float32x4_t low = vdupq_n_f32(-1.0f);
+  const float32x4_t high = vdupq_n_f32(1.0f);
+  const float32x4_t scale = vdupq_n_f32(32767.0f);
+
+  for (; i + 8 <= count; i += 8) {
+    float32x4_t a = vld1q_f32(in + i);
+    float32x4_t b = vld1q_f32(in + i + 4);
+    a = vmulq_f32(vminq_f32(vmaxq_f32(a, low), high), scale);
+    b = vmulq_f32(vminq_f32(vmaxq_f32(b, low), high), scale);
+    int16x8_t packed = vcombine_s16(vqmovn_s32(vcvtq_s32_f32(a)),
+                                    vqmovn_s32(vcvtq_s32_f32(b)));
+    vst1q_s16(out + i, packed);
+  }
+#endif
+
+  for (; i < count; i++) {
+    float s = in[i];
+    if (s > 1.0f)
+      s = 1.0f;
+    if (s < -1.0f)
+      s = -1.0f;
+    out[i] = static_cast<int16_t>(s * 32767.0f);
+  }
+}
+
+static void pcm16ToFloat(const int16_t *in, float *out, size_t count) {
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+
+  for (; i + 8 <= count; i += 8) {
+    __m128i samples = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+    // Sign extend by placing each sample in the high half and shifting down
+    __m128i low = _mm_srai_epi32(_mm_unpacklo_epi16(samples, samples), 16);
+    __m128i high = _mm_srai_epi32(_mm_unpackhi_epi16(samples, samples), 16);
+    _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(low), scale));
+    _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(high), scale));
+  }
+#elif defined(__ARM_NEON)
+  const float32x4_t scale = vdupq_n_f32(1.0f / 32768.0f);
+
+  for (; i + 8 <= count; i += 8) {
+    int16x8_t samples = vld1q_s16(in + i);
+    float32x4_t low = vcvtq_f32_s32(vmovl_s16(vget_low_s16(samples)));
+    float32x4_t high = vcvtq_f32_s32(vmovl_s16(vget_high_s16(samples)));
+    vst1q_f32(out + i, vmulq_f32(low, scale));
+    vst1q_f32(out + i + 4, vmulq_f32(high, scale));
+  }
+#endif
+
+  for (; i < count; i++)
+    out[i] = in[i] / 32768.0f;
+}
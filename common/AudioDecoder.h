@@ -1,4 +1,5 @@
 #pragma once
+#include "AudioConvert.h"
 #include <cstdio>
 #include <opus/opus.h>
 #include <stdexcept>
@@ -9,6 +10,7 @@ private:
   OpusDecoder *m_OpusDecoder = nullptr;
   int m_SampleRate;
   int m_Channels;
+  std::vector<opus_int16> m_PCM16;
 
 public:
   AudioDecoder(int sampleRate, int channels = 2)
@@ -24,25 +26,63 @@ public:
       opus_decoder_destroy(m_OpusDecoder);
   }
 
-  std::vector<float> Decode(const std::vector<unsigned char> &buffer,
-                            int frameSize) {
-    std::vector<opus_int16> pcm16(frameSize * 6 * m_Channels);
+  // Decodes a packet and appends it to `output`, which keeps its capacity
+  // between packets
+  void Decode(const std::vector<unsigned char> &buffer,
+              std::vector<float> &output) {
+    // Room for the longest Opus packet, 120 ms
+    DecodeFrame(buffer.data(), buffer.size(), m_SampleRate * 120 / 1000, 0,
+                output);
+  }
+
+  // Whether `next` carries a copy of the packet before it, CELT only packets
+  // never do
+  bool HasFec(const std::vector<unsigned char> &next) const {
+    return opus_packet_has_lbrr(next.data(), next.size()) == 1;
+  }
+
+  // Rebuilds the packet lost just before `next` from the redundancy the
+  // encoder put in it, Opus falls back to concealment if there is none
+  void DecodeFec(const std::vector<unsigned char> &next,
+                 std::vector<float> &output) {
+    DecodeFrame(next.data(), next.size(), Samples(next), 1, output);
+  }
+
+  // Appends `frameSize` samples per channel extrapolated from the previous
+  // packets, for a packet that is gone for good
+  void Conceal(int frameSize, std::vector<float> &output) {
+    DecodeFrame(nullptr, 0, frameSize, 0, output);
+  }
 
-    int decodedFrameSize =
-        opus_decode(m_OpusDecoder, buffer.size() == 0 ? nullptr : buffer.data(),
-                    buffer.size(), pcm16.data(), frameSize * 6, 0);
+  // Samples per channel in a packet, 0 if it is malformed
+  int Samples(const std::vector<unsigned char> &buffer) const {
+    int samples =
+        opus_packet_get_nb_samples(buffer.data(), buffer.size(), m_SampleRate);
+    return samples < 0 ? 0 : samples;
+  }
+
+private:
+  void DecodeFrame(const unsigned char *data, size_t size, int frameSize,
+                   int fec, std::vector<float> &output) {
+    if (frameSize <= 0)
+      return;
+
+    size_t capacity = static_cast<size_t>(frameSize) * m_Channels;
+    if (m_PCM16.size() < capacity)
+      m_PCM16.resize(capacity);
+
+    int decodedFrameSize = opus_decode(m_OpusDecoder, size ? data : nullptr,
+                                       size, m_PCM16.data(), frameSize, fec);
 
     if (decodedFrameSize < 0) {
       fprintf(stderr, "Opus decode error: %s\n",
               opus_strerror(decodedFrameSize));
-      return std::vector<float>(frameSize, 0.0f);
+      return;
     }
 
-    std::vector<float> output(decodedFrameSize * m_Channels);
-
-    for (int i = 0; i < decodedFrameSize * m_Channels; ++i)
-      output[i] = pcm16[i] / 32768.0f;
-
-    return output;
+    size_t offset = output.size();
+    output.resize(offset + static_cast<size_t>(decodedFrameSize) * m_Channels);
+    pcm16ToFloat(m_PCM16.data(), output.data() + offset,
+                 output.size() - offset);
   }
 };
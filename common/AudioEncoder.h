@@ -1,122 +1,130 @@
 #pragma once
 #undef min
 #undef max
+#include "AudioConvert.h"
 #include <algorithm>
+#include <cstdio>
+#include <functional>
 #include <mutex>
 #include <opus/opus.h>
 #include <stdexcept>
 #include <vector>
 
 class AudioEncoder {
+public:
+  // Opus packet, only valid for the duration of the callback
+  using PacketCallback = std::function<void(const unsigned char *, int)>;
+
 private:
   OpusEncoder *m_OpusEncoder = nullptr;
   int m_SampleRate;
   int m_Channels;
   int m_MaxBytes;
-  std::vector<int16_t> m_Buffer;
+  // Samples per channel in one Opus frame
+  int m_FrameSize;
+
+  // One frame of interleaved samples, filled across calls
+  std::vector<int16_t> m_Frame;
+  size_t m_Filled = 0;
+  std::vector<unsigned char> m_Packet;
   std::mutex m_BufferMutex;
 
 public:
+  // Opus frames can be 2.5, 5, 10, 20, 40 or 60 ms, shorter frames lower the
+  // latency at the cost of compression. OPUS_APPLICATION_VOIP tunes for speech
   AudioEncoder(int sampleRate, int bitrate = 64, int channels = 2,
-               int maxBytes = 4096)
-      : m_SampleRate(sampleRate), m_Channels(channels), m_MaxBytes(maxBytes) {
+               double frameMs = 20.0,
+               int application = OPUS_APPLICATION_AUDIO, int maxBytes = 4096)
+      : m_SampleRate(sampleRate), m_Channels(channels), m_MaxBytes(maxBytes),
+        m_FrameSize(static_cast<int>(sampleRate * frameMs / 1000.0)) {
+
+    if (frameMs != 2.5 && frameMs != 5.0 && frameMs != 10.0 &&
+        frameMs != 20.0 && frameMs != 40.0 && frameMs != 60.0)
+      throw std::invalid_argument(
+          "Opus frames must be 2.5, 5, 10, 20, 40 or 60 ms");
 
     int error;
-    m_OpusEncoder = opus_encoder_create(m_SampleRate, m_Channels,
-                                        OPUS_APPLICATION_AUDIO, &error);
+    m_OpusEncoder =
+        opus_encoder_create(m_SampleRate, m_Channels, application, &error);
     if (error != OPUS_OK)
       throw std::runtime_error("Failed to create Opus encoder");
 
     opus_encoder_ctl(m_OpusEncoder, OPUS_SET_BITRATE(bitrate * 1000));
     opus_encoder_ctl(m_OpusEncoder, OPUS_SET_VBR(1));
     opus_encoder_ctl(m_OpusEncoder, OPUS_SET_VBR_CONSTRAINT(1));
-    opus_encoder_ctl(m_OpusEncoder, OPUS_SET_SIGNAL(OPUS_SIGNAL_MUSIC));
+    opus_encoder_ctl(m_OpusEncoder,
+                     OPUS_SET_SIGNAL(application == OPUS_APPLICATION_VOIP
+                                         ? OPUS_SIGNAL_VOICE
+                                         : OPUS_SIGNAL_MUSIC));
     opus_encoder_ctl(m_OpusEncoder, OPUS_SET_COMPLEXITY(8));
     opus_encoder_ctl(m_OpusEncoder, OPUS_SET_PACKET_LOSS_PERC(5));
-
-    m_Buffer.resize(m_MaxBytes, 0);
+    // Lets a packet carry a low bitrate copy of the previous one so a single
+    // loss can be rebuilt by the decoder. Only SILK and hybrid packets have
+    // room for it, Opus picks those for voice and at low bitrates. Music at
+    // the default 64 kbps is CELT only and gets none
+    opus_encoder_ctl(m_OpusEncoder, OPUS_SET_INBAND_FEC(1));
+
+    m_Frame.resize(static_cast<size_t>(m_FrameSize) * m_Channels);
+    m_Packet.resize(m_MaxBytes);
   }
 
   ~AudioEncoder() { opus_encoder_destroy(m_OpusEncoder); }
 
-  std::vector<unsigned char> Encode(const float *ieeFloat, uint32_t samples,
-                                    int frameSize) {
-    std::lock_guard<std::mutex> lock(m_BufferMutex);
+  int FrameSize() const { return m_FrameSize; }
 
-    std::vector<int16_t> pcm16 = IEEEFloatToPCM16(ieeFloat, samples);
+  int SampleRate() const { return m_SampleRate; }
+  int Channels() const { return m_Channels; }
 
-    m_Buffer.insert(m_Buffer.end(), pcm16.begin(), pcm16.end());
+  // Samples per channel a decoder discards at the start of the stream, the
+  // pre-skip of a recording
+  int Lookahead() {
+    opus_int32 lookahead = 0;
+    opus_encoder_ctl(m_OpusEncoder, OPUS_GET_LOOKAHEAD(&lookahead));
+    return lookahead;
+  }
 
-    if (m_Buffer.size() >= frameSize * m_Channels) {
-      std::vector<unsigned char> output(m_MaxBytes);
+  // Duration of one Opus frame
+  uint64_t FrameNs() const {
+    return static_cast<uint64_t>(m_FrameSize) * 1'000'000'000ULL /
+           m_SampleRate;
+  }
 
-      int bytesWritten = opus_encode(m_OpusEncoder, m_Buffer.data(), frameSize,
-                                     output.data(), m_MaxBytes);
-      if (bytesWritten < 0) {
-        fprintf(stderr, "Opus encoding failed: %s\n",
-                opus_strerror(bytesWritten));
-        return {};
-      }
+  // Audio waiting for the rest of its frame, the next packet starts this long
+  // before whatever is passed to Encode
+  uint64_t PendingNs() {
+    std::lock_guard<std::mutex> lock(m_BufferMutex);
+    return static_cast<uint64_t>(m_Filled / m_Channels) * 1'000'000'000ULL /
+           m_SampleRate;
+  }
 
-      m_Buffer.erase(m_Buffer.begin(),
-                     m_Buffer.begin() + frameSize * m_Channels);
+  // Buffers `samples` interleaved floats and calls `onPacket` for every frame
+  // they complete, however many that is
+  void Encode(const float *ieeFloat, size_t samples,
+              const PacketCallback &onPacket) {
+    std::lock_guard<std::mutex> lock(m_BufferMutex);
 
-      output.resize(bytesWritten);
+    while (samples) {
+      size_t count = std::min(samples, m_Frame.size() - m_Filled);
+      floatToPCM16(ieeFloat, m_Frame.data() + m_Filled, count);
 
-      return output;
-    }
+      ieeFloat += count;
+      samples -= count;
+      m_Filled += count;
 
-    return {};
-  }
+      if (m_Filled < m_Frame.size())
+        break;
 
-  std::vector<float> LinearResample(const std::vector<float> &input,
-                                    double srcRate, double dstRate,
-                                    int channels = 2) {
-    if (srcRate == dstRate)
-      return input;
-
-    if (input.empty())
-      return {};
-
-    if (channels <= 0)
-      throw std::invalid_argument("channels must be positive");
-
-    double ratio = dstRate / srcRate;
-    if (ratio <= 0)
-      throw std::invalid_argument("Sample rates must be positive");
-
-    size_t inputFrames = input.size() / channels;
-    size_t outputFrames = static_cast<size_t>(inputFrames * ratio);
-    std::vector<float> output(outputFrames * channels);
-
-    for (size_t i = 0; i < outputFrames; ++i) {
-      double srcPos = i / ratio;
-      size_t idx0 = static_cast<size_t>(srcPos);
-      size_t idx1 = (idx0 + 1 < inputFrames) ? idx0 + 1 : idx0;
-      double frac = srcPos - idx0;
-
-      for (int ch = 0; ch < channels; ++ch) {
-        float sample0 = input[idx0 * channels + ch];
-        float sample1 = input[idx1 * channels + ch];
-        output[i * channels + ch] =
-            static_cast<float>((1.0 - frac) * sample0 + frac * sample1);
-      }
-    }
+      m_Filled = 0;
 
-    return output;
-  }
+      int bytesWritten = opus_encode(m_OpusEncoder, m_Frame.data(), m_FrameSize,
+                                     m_Packet.data(), m_MaxBytes);
+      if (bytesWritten < 0) {
+        fprintf(stderr, "Opus encoding failed: %s\n",
+                opus_strerror(bytesWritten));
+        continue;
+      }
 
-  std::vector<int16_t> IEEEFloatToPCM16(const float *ieeFloat,
-                                        int samples) const {
-    std::vector<int16_t> pcm16(samples);
-    for (size_t i = 0; i < samples; ++i) {
-      float s = ieeFloat[i];
-      if (s > 1.0f)
-        s = 1.0f;
-      if (s < -1.0f)
-        s = -1.0f;
-      pcm16[i] = static_cast<int16_t>(s * 32767.0f);
+      onPacket(m_Packet.data(), bytesWritten);
     }
-    return pcm16;
   }
 };
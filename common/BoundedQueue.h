@@ -0,0 +1,110 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+// Blocking multi producer / multi consumer queue with a fixed capacity.
+// Producers either fail or evict the oldest item, only Push waits for room.
+template <typename T> class BoundedQueue {
+private:
+  std::deque<T> m_Queue;
+  size_t m_Capacity;
+  bool m_Closed = false;
+
+  std::mutex m_Mutex;
+  std::condition_variable m_CV;
+  // Signalled when an item leaves, for Push
+  std::condition_variable m_Space;
+
+public:
+  explicit BoundedQueue(size_t capacity) : m_Capacity(capacity) {}
+
+  // Returns false and drops the item if the queue is full or closed
+  bool TryPush(T item) {
+    {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      if (m_Closed || m_Queue.size() >= m_Capacity)
+        return false;
+      m_Queue.push_back(std::move(item));
+    }
+    m_CV.notify_one();
+    return true;
+  }
+
+  // Blocks until there is room, returns false and drops the item once closed.
+  // For items that must not be lost, the consumers keep popping until closed.
+  bool Push(T item) {
+    {
+      std::unique_lock<std::mutex> lock(m_Mutex);
+      m_Space.wait(lock,
+                   [&] { return m_Closed || m_Queue.size() < m_Capacity; });
+      if (m_Closed)
+        return false;
+      m_Queue.push_back(std::move(item));
+    }
+    m_CV.notify_one();
+    return true;
+  }
+
+  // Returns true if the oldest item was evicted to make room
+  bool PushDropOldest(T item) {
+    return PushDropOldest(std::move(item), [](const T &) { return true; });
+  }
+
+  // Only evicts items `evictable` accepts, e.g. to keep control messages.
+  // Returns true if something was dropped, the new item itself when nothing
+  // queued can go.
+  template <typename Evictable>
+  bool PushDropOldest(T item, Evictable evictable) {
+    bool dropped = false;
+    {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      if (m_Closed)
+        return false;
+
+      if (m_Queue.size() >= m_Capacity) {
+        auto oldest = std::find_if(m_Queue.begin(), m_Queue.end(), evictable);
+        if (oldest == m_Queue.end())
+          return true;
+
+        m_Queue.erase(oldest);
+        dropped = true;
+      }
+      m_Queue.push_back(std::move(item));
+    }
+    m_CV.notify_one();
+    return dropped;
+  }
+
+  // Blocks until an item is available, returns false once closed and drained
+  bool Pop(T &item) {
+    {
+      std::unique_lock<std::mutex> lock(m_Mutex);
+      m_CV.wait(lock, [&] { return m_Closed || !m_Queue.empty(); });
+
+      if (m_Queue.empty())
+        return false;
+
+      item = std::move(m_Queue.front());
+      m_Queue.pop_front();
+    }
+    m_Space.notify_one();
+    return true;
+  }
+
+  void Close() {
+    {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      m_Closed = true;
+    }
+    m_CV.notify_all();
+    m_Space.notify_all();
+  }
+
+  size_t Size() {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Queue.size();
+  }
+};
@@ -1,27 +1,41 @@
 #include "Decoder.h"
+#include "Metrics.h"
 
+#include <algorithm>
 #include <stdexcept>
+#include <thread>
 
-Decoder::~Decoder() {
+static Metrics::Histogram &decodeTime = Metrics::Get().GetHistogram(
+    "ssrd_video_decode_seconds", "H.264 decode and plane copy per packet");
+static Metrics::Counter &decodedFrames = Metrics::Get().GetCounter(
+    "ssrd_video_decoded_frames_total", "Pictures the decoder produced");
+
+Decoder::~Decoder() { release(); }
+
+void Decoder::release() {
   if (m_Sws_ctx) {
     sws_freeContext(m_Sws_ctx);
     m_Sws_ctx = nullptr;
   }
-  if (m_FrameRGB) {
-    av_frame_free(&m_FrameRGB);
-    m_FrameRGB = nullptr;
-  }
   if (m_FrameYUV) {
+    av_freep(&m_FrameYUV->data[0]);
     av_frame_free(&m_FrameYUV);
     m_FrameYUV = nullptr;
   }
+  if (m_Frame) {
+    av_frame_free(&m_Frame);
+    m_Frame = nullptr;
+  }
   if (m_Ctx) {
     avcodec_free_context(&m_Ctx);
     m_Ctx = nullptr;
   }
 }
 
-void Decoder::initialize(int width, int height) {
+void Decoder::initialize(int width, int height, const Options &options) {
+  // Called again on every resize
+  release();
+
   m_Width = width;
   m_Height = height;
 
@@ -33,31 +47,65 @@ void Decoder::initialize(int width, int height) {
   if (!m_Ctx)
     throw std::runtime_error("Failed to allocate decoder context");
 
+  int threads = options.threads > 0
+                    ? options.threads
+                    : std::max(1u, std::thread::hardware_concurrency());
+
+  // Frame threading holds back one frame per extra thread, only use as many
+  // threads as the latency budget allows
+  int frameThreads = 1;
+  if (options.frameThreadingBudgetMs > 0 && options.frameRate > 0)
+    frameThreads =
+        std::min(threads, 1 + (options.frameThreadingBudgetMs *
+                                options.frameRate) / 1000);
+
+  m_Ctx->thread_count = threads;
+
+  if (frameThreads > 1) {
+    m_Ctx->thread_count = frameThreads;
+    m_Ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+  } else {
+    // The encoder runs zerolatency (sliced threads), so slices are available
+    // to decode in parallel without adding delay
+    m_Ctx->thread_type = FF_THREAD_SLICE;
+    m_Ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+  }
+
+  if (options.fast)
+    m_Ctx->flags2 |= AV_CODEC_FLAG2_FAST;
+
   if (avcodec_open2(m_Ctx, codec, nullptr) < 0)
     throw std::runtime_error("Failed to open decoder");
 
+  m_Frame = av_frame_alloc();
   m_FrameYUV = av_frame_alloc();
-  m_FrameRGB = av_frame_alloc();
-  if (!m_FrameYUV || !m_FrameRGB)
+  if (!m_Frame || !m_FrameYUV)
     throw std::runtime_error("Failed to allocate frames");
 
-  m_FrameRGB->format = AV_PIX_FMT_RGB24;
-  m_FrameRGB->width = width;
-  m_FrameRGB->height = height;
+  // Only used when the stream is not already YUV420P
+  m_FrameYUV->format = AV_PIX_FMT_YUV420P;
+  m_FrameYUV->width = width;
+  m_FrameYUV->height = height;
+
+  if (av_image_alloc(m_FrameYUV->data, m_FrameYUV->linesize, width, height,
+                     AV_PIX_FMT_YUV420P, 32) < 0)
+    throw std::runtime_error("Failed to allocate YUV frame buffer");
+}
 
-  if (av_image_alloc(m_FrameRGB->data, m_FrameRGB->linesize, width, height,
-                     AV_PIX_FMT_RGB24, 32) < 0)
-    throw std::runtime_error("Failed to allocate RGB frame buffer");
+std::vector<uint8_t> Decoder::decode(const std::vector<uint8_t> &encoded,
+                                     bool output) {
+  std::vector<uint8_t> planes(output ? frameSize() : 0);
 
-  m_Sws_ctx =
-      sws_getContext(width, height, AV_PIX_FMT_YUV420P, width, height,
-                     AV_PIX_FMT_RGB24, SWS_BILINEAR, nullptr, nullptr, nullptr);
-  if (!m_Sws_ctx)
-    throw std::runtime_error("Failed to create sws context");
+  if (!decode(encoded, output ? planes.data() : nullptr))
+    planes.clear();
+
+  return planes;
 }
 
-std::vector<uint8_t> Decoder::decode(const std::vector<uint8_t> &encoded) {
-  std::vector<uint8_t> output;
+bool Decoder::decode(const std::vector<uint8_t> &encoded, uint8_t *planes) {
+  Metrics::Timer timer(decodeTime);
+  bool decoded = false;
+  m_Output = nullptr;
 
   AVPacket *pkt = av_packet_alloc();
   if (!pkt)
@@ -72,7 +120,7 @@ std::vector<uint8_t> Decoder::decode(const std::vector<uint8_t> &encoded) {
   }
 
   while (true) {
-    int ret = avcodec_receive_frame(m_Ctx, m_FrameYUV);
+    int ret = avcodec_receive_frame(m_Ctx, m_Frame);
     if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
       break;
     else if (ret < 0) {
@@ -80,18 +128,49 @@ std::vector<uint8_t> Decoder::decode(const std::vector<uint8_t> &encoded) {
       throw std::runtime_error("Error receiving frame from decoder");
     }
 
-    // Convert YUV → RGB
-    sws_scale(m_Sws_ctx, m_FrameYUV->data, m_FrameYUV->linesize, 0, m_Height,
-              m_FrameRGB->data, m_FrameRGB->linesize);
+    decodedFrames.Add();
+
+    if (!planes)
+      continue;
+
+    AVFrame *frame = m_Frame;
 
-    // Copy RGB data into vector
-    output.resize(m_Width * m_Height * 3);
-    for (int y = 0; y < m_Height; y++) {
-      memcpy(output.data() + y * m_Width * 3,
-             m_FrameRGB->data[0] + y * m_FrameRGB->linesize[0], m_Width * 3);
+    // x264 gives us YUV420P, anything else is converted once here
+    if (frame->format != AV_PIX_FMT_YUV420P &&
+        frame->format != AV_PIX_FMT_YUVJ420P) {
+      m_Sws_ctx = sws_getCachedContext(
+          m_Sws_ctx, frame->width, frame->height,
+          static_cast<AVPixelFormat>(frame->format), m_Width, m_Height,
+          AV_PIX_FMT_YUV420P, SWS_BILINEAR, nullptr, nullptr, nullptr);
+      if (!m_Sws_ctx) {
+        av_packet_free(&pkt);
+        throw std::runtime_error("Failed to create sws context");
+      }
+
+      sws_scale(m_Sws_ctx, frame->data, frame->linesize, 0, frame->height,
+                m_FrameYUV->data, m_FrameYUV->linesize);
+      frame = m_FrameYUV;
     }
+
+    int chromaWidth = (m_Width + 1) / 2;
+    int chromaHeight = (m_Height + 1) / 2;
+
+    // Copy the planes out [Y | U | V], row by row since the destination may
+    // be a mapped pixel buffer
+    uint8_t *destination = planes;
+
+    for (int y = 0; y < m_Height; y++, destination += m_Width)
+      memcpy(destination, frame->data[0] + y * frame->linesize[0], m_Width);
+
+    for (int plane = 1; plane < 3; plane++)
+      for (int y = 0; y < chromaHeight; y++, destination += chromaWidth)
+        memcpy(destination, frame->data[plane] + y * frame->linesize[plane],
+               chromaWidth);
+
+    m_Output = frame;
+    decoded = true;
   }
 
   av_packet_free(&pkt);
-  return output;
+  return decoded;
 }
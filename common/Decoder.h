@@ -9,19 +9,62 @@ extern "C" {
 }
 
 class Decoder {
+public:
+  struct Options {
+    // 0 uses one thread per core as reported by hardware_concurrency
+    int threads = 0;
+    // Extra delay frame threading may add, 0 keeps it slice threaded only
+    int frameThreadingBudgetMs = 0;
+    // Expected stream frame rate, used to turn the budget into frames
+    int frameRate = 60;
+    // Allow non spec compliant speedups (AV_CODEC_FLAG2_FAST)
+    bool fast = false;
+  };
+
 private:
   int m_Width = 0;
   int m_Height = 0;
 
   AVCodecContext *m_Ctx = nullptr;
+  AVFrame *m_Frame = nullptr;
   AVFrame *m_FrameYUV = nullptr;
-  AVFrame *m_FrameRGB = nullptr;
   SwsContext *m_Sws_ctx = nullptr;
+  // The last picture decode() output, m_Frame or m_FrameYUV
+  AVFrame *m_Output = nullptr;
+
+  void release();
 
 public:
   Decoder() = default;
   ~Decoder();
 
-  void initialize(int width, int height);
-  std::vector<uint8_t> decode(const std::vector<uint8_t> &encoded);
+  void initialize(int width, int height, const Options &options);
+
+  // Returns the decoded picture as tightly packed I420 planes (Y, then U, then
+  // V), colour conversion is left to the renderer. With output false the
+  // frame is only decoded to keep the reference chain intact.
+  std::vector<uint8_t> decode(const std::vector<uint8_t> &encoded,
+                              bool output = true);
+
+  // Same, but writes the planes to `planes`, frameSize() bytes that may be
+  // write only. Returns false when the packet produced no picture.
+  bool decode(const std::vector<uint8_t> &encoded, uint8_t *planes);
+
+  // Bytes of one decoded picture in the layout above
+  size_t frameSize() const {
+    size_t chromaWidth = (m_Width + 1) / 2;
+    size_t chromaHeight = (m_Height + 1) / 2;
+    return static_cast<size_t>(m_Width) * m_Height +
+           chromaWidth * chromaHeight * 2;
+  }
+
+  // Luma plane of the last picture decoded with output, for reading back
+  // without touching the planes it was written to
+  const uint8_t *luma(int &stride) const {
+    if (!m_Output)
+      return nullptr;
+
+    stride = m_Output->linesize[0];
+    return m_Output->data[0];
+  }
 };
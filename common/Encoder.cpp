@@ -1,7 +1,19 @@
 #include "Encoder.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "Utility.h"
 
 #include <stdexcept>
 
+static Metrics::Histogram &convertTime = Metrics::Get().GetHistogram(
+    "ssrd_video_convert_seconds", "RGB to YUV conversion per frame");
+static Metrics::Histogram &encodeTime = Metrics::Get().GetHistogram(
+    "ssrd_video_encode_seconds", "H.264 encode per frame");
+static Metrics::Counter &encodedFrames = Metrics::Get().GetCounter(
+    "ssrd_video_encoded_frames_total", "Frames handed to the encoder");
+static Metrics::Counter &encodedBytes = Metrics::Get().GetCounter(
+    "ssrd_video_encoded_bytes_total", "Encoded video bytes");
+
 Encoder::~Encoder() {
   if (m_Sws_ctx) {
     sws_freeContext(m_Sws_ctx);
@@ -21,7 +33,7 @@ Encoder::~Encoder() {
   }
 }
 
-void Encoder::initialize(int width, int height) {
+void Encoder::initialize(int width, int height, const char *preset) {
   m_Width = width;
   m_Height = height;
 
@@ -70,8 +82,10 @@ void Encoder::initialize(int width, int height) {
   m_Ctx->max_b_frames = 0;
 
   AVDictionary *opts = nullptr;
-  av_dict_set(&opts, "preset", "ultrafast", 0);
+  av_dict_set(&opts, "preset", preset, 0);
   av_dict_set(&opts, "tune", "zerolatency", 0);
+  // requestKeyframe() must produce an IDR the client can resync on
+  av_dict_set(&opts, "forced-idr", "1", 0);
 
   if (avcodec_open2(m_Ctx, codec, &opts) < 0)
     throw std::runtime_error("Failed to open codec");
@@ -81,6 +95,7 @@ void Encoder::initialize(int width, int height) {
 
 std::vector<uint8_t> Encoder::encode(const std::vector<uint8_t> &buffer) {
   std::vector<uint8_t> output = {};
+  uint64_t start = monotonicNs();
 
   if (buffer.size() < static_cast<size_t>(m_Width * m_Height * 3))
     throw std::runtime_error("Input buffer too small for frame dimensions");
@@ -90,10 +105,20 @@ std::vector<uint8_t> Encoder::encode(const std::vector<uint8_t> &buffer) {
            buffer.data() + y * m_Width * 3, m_Width * 3);
 
   // convert RGB -> YUV
-  sws_scale(m_Sws_ctx, m_FrameRGB->data, m_FrameRGB->linesize, 0, m_Height,
-            m_FrameYUV->data, m_FrameYUV->linesize);
+  {
+    TRACE_SCOPE(CONVERT);
+    sws_scale(m_Sws_ctx, m_FrameRGB->data, m_FrameRGB->linesize, 0, m_Height,
+              m_FrameYUV->data, m_FrameYUV->linesize);
+  }
+
+  m_Timings.converted = monotonicNs();
+
+  TRACE_SCOPE(ENCODE);
 
   m_FrameYUV->pts = m_Pts++;
+  m_FrameYUV->pict_type = m_ForceKeyframe.exchange(false)
+                              ? AV_PICTURE_TYPE_I
+                              : AV_PICTURE_TYPE_NONE;
 
   // encode frame
   AVPacket *pkt = av_packet_alloc();
@@ -119,5 +144,14 @@ std::vector<uint8_t> Encoder::encode(const std::vector<uint8_t> &buffer) {
 
   av_packet_free(&pkt);
 
+  m_Timings.encoded = monotonicNs();
+
+  convertTime.Record(m_Timings.converted - start);
+  encodeTime.Record(m_Timings.encoded - m_Timings.converted);
+  encodedFrames.Add();
+  encodedBytes.Add(output.size());
+
   return output;
-}
\ No newline at end of file
+}
+
+void Encoder::requestKeyframe() { m_ForceKeyframe.store(true); }
\ No newline at end of file
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <vector>
 
 extern "C" {
@@ -9,12 +10,23 @@ extern "C" {
 }
 
 class Encoder {
+public:
+  // Monotonic times the last encode() finished each stage
+  struct Timings {
+    uint64_t converted = 0;
+    uint64_t encoded = 0;
+  };
+
 private:
   int m_Width = 0;
   int m_Height = 0;
 
   uint64_t m_Pts = 0;
 
+  std::atomic<bool> m_ForceKeyframe = false;
+
+  Timings m_Timings;
+
   AVCodecContext *m_Ctx = nullptr;
   AVFrame *m_FrameRGB = nullptr;
   AVFrame *m_FrameYUV = nullptr;
@@ -24,7 +36,16 @@ public:
   Encoder() = default;
   ~Encoder();
 
-  void initialize(int width, int height);
+  // `preset` is an x264 preset, faster ones trade compression for latency
+  void initialize(int width, int height, const char *preset = "ultrafast");
+
+  int width() const { return m_Width; }
+  int height() const { return m_Height; }
 
   std::vector<uint8_t> encode(const std::vector<uint8_t> &buffer);
+
+  const Timings &timings() const { return m_Timings; }
+
+  // Makes the next encoded frame an IDR, safe to call from any thread
+  void requestKeyframe();
 };
\ No newline at end of file
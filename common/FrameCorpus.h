@@ -0,0 +1,146 @@
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Raw captured frames for ssrd-bench, stored as PipeWire delivered them: a
+// fixed header followed by one record per frame, an 8 byte capture time and
+// width * height * bytesPerPixel of pixels.
+struct FrameCorpusHeader {
+  char magic[8] = {'S', 'S', 'R', 'D', 'R', 'A', 'W', '1'};
+  uint32_t width = 0;
+  uint32_t height = 0;
+  // spa_video_format
+  uint32_t format = 0;
+  uint32_t bytesPerPixel = 0;
+  uint32_t frames = 0;
+  uint32_t reserved = 0;
+
+  size_t FrameBytes() const {
+    return static_cast<size_t>(width) * height * bytesPerPixel;
+  }
+
+  size_t RecordBytes() const { return sizeof(uint64_t) + FrameBytes(); }
+};
+
+class FrameCorpusWriter {
+private:
+  FILE *m_File = nullptr;
+  FrameCorpusHeader m_Header;
+
+public:
+  FrameCorpusWriter(const std::string &path, uint32_t width, uint32_t height,
+                    uint32_t format, uint32_t bytesPerPixel) {
+    m_Header.width = width;
+    m_Header.height = height;
+    m_Header.format = format;
+    m_Header.bytesPerPixel = bytesPerPixel;
+
+    m_File = fopen(path.c_str(), "wb");
+    if (!m_File)
+      throw std::runtime_error("Failed to open " + path);
+
+    fwrite(&m_Header, sizeof(m_Header), 1, m_File);
+  }
+
+  // Patches the frame count into the header
+  ~FrameCorpusWriter() {
+    fseek(m_File, 0, SEEK_SET);
+    fwrite(&m_Header, sizeof(m_Header), 1, m_File);
+    fclose(m_File);
+  }
+
+  FrameCorpusWriter(const FrameCorpusWriter &) = delete;
+  FrameCorpusWriter &operator=(const FrameCorpusWriter &) = delete;
+
+  uint32_t Width() const { return m_Header.width; }
+  uint32_t Height() const { return m_Header.height; }
+  uint32_t Format() const { return m_Header.format; }
+  uint32_t Frames() const { return m_Header.frames; }
+
+  void Write(const uint8_t *frame, uint64_t time) {
+    if (fwrite(&time, sizeof(time), 1, m_File) != 1 ||
+        fwrite(frame, m_Header.FrameBytes(), 1, m_File) != 1)
+      throw std::runtime_error("Failed to write frame");
+
+    m_Header.frames++;
+  }
+};
+
+// Maps a recorded corpus read only, frames are paged in as they're used
+class FrameCorpus {
+private:
+  const uint8_t *m_Data = nullptr;
+  size_t m_Size = 0;
+  FrameCorpusHeader m_Header;
+
+public:
+  explicit FrameCorpus(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      throw std::runtime_error("Failed to open " + path);
+
+    struct stat info = {};
+    fstat(fd, &info);
+    m_Size = info.st_size;
+
+    if (m_Size < sizeof(FrameCorpusHeader)) {
+      close(fd);
+      throw std::runtime_error(path + " is not a frame corpus");
+    }
+
+    void *data = mmap(nullptr, m_Size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED)
+      throw std::runtime_error("Failed to map " + path);
+
+    m_Data = static_cast<const uint8_t *>(data);
+    std::memcpy(&m_Header, m_Data, sizeof(m_Header));
+
+    if (std::memcmp(m_Header.magic, FrameCorpusHeader().magic,
+                    sizeof(m_Header.magic)) != 0) {
+      munmap(const_cast<uint8_t *>(m_Data), m_Size);
+      throw std::runtime_error(path + " is not a frame corpus");
+    }
+
+    // A recording that was cut short still has its whole frames
+    size_t available = (m_Size - sizeof(m_Header)) / m_Header.RecordBytes();
+    if (available < m_Header.frames || !m_Header.frames)
+      m_Header.frames = available;
+
+    madvise(const_cast<uint8_t *>(m_Data), m_Size, MADV_SEQUENTIAL);
+  }
+
+  ~FrameCorpus() { munmap(const_cast<uint8_t *>(m_Data), m_Size); }
+
+  FrameCorpus(const FrameCorpus &) = delete;
+  FrameCorpus &operator=(const FrameCorpus &) = delete;
+
+  uint32_t Width() const { return m_Header.width; }
+  uint32_t Height() const { return m_Header.height; }
+  uint32_t Format() const { return m_Header.format; }
+  uint32_t Frames() const { return m_Header.frames; }
+
+  uint64_t Time(uint32_t index) const {
+    uint64_t time;
+    std::memcpy(&time, Record(index), sizeof(time));
+    return time;
+  }
+
+  const uint8_t *Frame(uint32_t index) const {
+    return Record(index) + sizeof(uint64_t);
+  }
+
+private:
+  const uint8_t *Record(uint32_t index) const {
+    return m_Data + sizeof(m_Header) + index * m_Header.RecordBytes();
+  }
+};
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Minimal Annex B parsing, enough to classify the access units x264 emits
+namespace H264 {
+
+enum NalType : uint8_t {
+  NAL_SLICE = 1,
+  NAL_IDR = 5,
+  NAL_SEI = 6,
+  NAL_SPS = 7,
+  NAL_PPS = 8,
+};
+
+// Calls callback(nalHeader, payload, payloadSize) for every NAL unit, the
+// payload starts right after the start code
+template <typename Callback>
+static void ForEachNal(const uint8_t *data, size_t size, Callback &&callback) {
+  size_t i = 0;
+  size_t start = size;
+
+  while (i + 3 <= size) {
+    if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) {
+      if (start < size)
+        callback(data[start], data + start,
+                 i - start - (i > 0 && data[i - 1] == 0 ? 1 : 0));
+      i += 3;
+      start = i;
+      continue;
+    }
+    i++;
+  }
+
+  if (start < size)
+    callback(data[start], data + start, size - start);
+}
+
+static bool IsKeyframe(const uint8_t *data, size_t size) {
+  bool keyframe = false;
+  ForEachNal(data, size, [&](uint8_t header, const uint8_t *, size_t) {
+    if ((header & 0x1F) == NAL_IDR)
+      keyframe = true;
+  });
+  return keyframe;
+}
+
+// False when no slice in the access unit is used as a reference by later
+// frames, those can be skipped without breaking the decode
+static bool IsReference(const uint8_t *data, size_t size) {
+  bool reference = false;
+  ForEachNal(data, size, [&](uint8_t header, const uint8_t *, size_t) {
+    uint8_t type = header & 0x1F;
+    if ((type == NAL_SLICE || type == NAL_IDR) && (header >> 5) != 0)
+      reference = true;
+  });
+  return reference;
+}
+
+} // namespace H264
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "OpenSSL.h"
+
+// Server host keys a client has seen, one "<host>:<port> <fingerprint>" per
+// line. The first connection to an address pins the key it presented, a
+// different key there later fails the connection until the line is removed.
+namespace KnownHosts {
+
+enum class Result { KNOWN, ADDED, CHANGED };
+
+inline Result Check(const std::string &path, const std::string &address,
+                    const std::string &fingerprint) {
+  std::ifstream in(path);
+  std::string line;
+
+  while (std::getline(in, line)) {
+    std::istringstream fields(line);
+    std::string host, pinned;
+
+    if (!(fields >> host >> pinned) || host != address)
+      continue;
+
+    return pinned == fingerprint ? Result::KNOWN : Result::CHANGED;
+  }
+
+  std::filesystem::path file(path);
+  if (file.has_parent_path())
+    std::filesystem::create_directories(file.parent_path());
+
+  std::ofstream out(path, std::ios::app);
+  out << address << " " << fingerprint << "\n";
+  if (!out)
+    throw std::runtime_error("Failed to write " + path);
+
+  return Result::ADDED;
+}
+
+// Check with the messages a user needs, false if the key changed
+inline bool Verify(const std::string &path, const std::string &address,
+                   const std::vector<uint8_t> &hostKey) {
+  std::string fingerprint = OpenSSL::fingerprint(hostKey);
+
+  switch (Check(path, address, fingerprint)) {
+  case Result::KNOWN:
+    return true;
+
+  case Result::ADDED:
+    std::cout << "Pinned host key " << fingerprint << " for " << address
+              << " in " << path << std::endl;
+    return true;
+
+  case Result::CHANGED:
+    std::cerr << "The host key for " << address << " changed, it is now "
+              << fingerprint << ". Someone may be impersonating the server. "
+              << "If the server's host key was replaced, remove its line "
+              << "from " << path << std::endl;
+    return false;
+  }
+
+  return false;
+}
+
+} // namespace KnownHosts
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdint.h>
+#include <string>
+
+#include "Utility.h"
+
+// Process wide counters, gauges and latency histograms. Call sites look their
+// metric up once (usually into a function local static) and after that
+// recording is a relaxed atomic add, cheap enough for the PipeWire and
+// PortAudio threads. Render() produces the Prometheus text format.
+class Metrics {
+public:
+  class Counter {
+  private:
+    std::atomic<uint64_t> m_Value{0};
+
+  public:
+    void Add(uint64_t value = 1) {
+      m_Value.fetch_add(value, std::memory_order::relaxed);
+    }
+
+    uint64_t Value() const { return m_Value.load(std::memory_order::relaxed); }
+  };
+
+  class Gauge {
+  private:
+    std::atomic<double> m_Value{0.0};
+
+  public:
+    void Set(double value) { m_Value.store(value, std::memory_order::relaxed); }
+
+    double Value() const { return m_Value.load(std::memory_order::relaxed); }
+  };
+
+  // Nanosecond durations in log-linear buckets, eight per power of two, so
+  // any quantile is within 12.5% of the real value (HDR histogram style)
+  class Histogram {
+  private:
+    static constexpr int SUB_BITS = 3;
+    static constexpr size_t SUB_BUCKETS = 1 << SUB_BITS;
+    static constexpr size_t BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+    std::array<std::atomic<uint64_t>, BUCKETS> m_Buckets{};
+    std::atomic<uint64_t> m_Count{0};
+    std::atomic<uint64_t> m_Sum{0};
+    std::atomic<uint64_t> m_Max{0};
+
+    static size_t Index(uint64_t value) {
+      if (value < SUB_BUCKETS)
+        return value;
+
+      int exponent = 63 - std::countl_zero(value);
+      return (exponent - SUB_BITS + 1) * SUB_BUCKETS +
+             ((value >> (exponent - SUB_BITS)) & (SUB_BUCKETS - 1));
+    }
+
+    // Smallest value that lands in `index`
+    static uint64_t LowerBound(size_t index) {
+      if (index < SUB_BUCKETS)
+        return index;
+
+      int exponent = index / SUB_BUCKETS + SUB_BITS - 1;
+      return (SUB_BUCKETS + index % SUB_BUCKETS) << (exponent - SUB_BITS);
+    }
+
+  public:
+    void Record(uint64_t ns) {
+      m_Buckets[Index(ns)].fetch_add(1, std::memory_order::relaxed);
+      m_Count.fetch_add(1, std::memory_order::relaxed);
+      m_Sum.fetch_add(ns, std::memory_order::relaxed);
+
+      uint64_t max = m_Max.load(std::memory_order::relaxed);
+      while (ns > max &&
+             !m_Max.compare_exchange_weak(max, ns, std::memory_order::relaxed))
+        ;
+    }
+
+    uint64_t Count() const { return m_Count.load(std::memory_order::relaxed); }
+    uint64_t Sum() const { return m_Sum.load(std::memory_order::relaxed); }
+    uint64_t Max() const { return m_Max.load(std::memory_order::relaxed); }
+
+    // Upper end of the bucket holding quantile `q`, 0 when empty. Buckets
+    // are read one by one while others record, close enough for monitoring
+    uint64_t Quantile(double q) const {
+      uint64_t count = Count();
+      if (!count)
+        return 0;
+
+      uint64_t rank = static_cast<uint64_t>(q * count);
+      uint64_t seen = 0;
+
+      for (size_t i = 0; i < BUCKETS; i++) {
+        seen += m_Buckets[i].load(std::memory_order::relaxed);
+        if (seen > rank)
+          return std::min(i + 1 < BUCKETS ? LowerBound(i + 1) - 1 : UINT64_MAX,
+                          Max());
+      }
+
+      return Max();
+    }
+  };
+
+  // Times the enclosing scope
+  class Timer {
+  private:
+    Histogram &m_Histogram;
+    uint64_t m_Start;
+
+  public:
+    explicit Timer(Histogram &histogram)
+        : m_Histogram(histogram), m_Start(monotonicNs()) {}
+    ~Timer() { m_Histogram.Record(monotonicNs() - m_Start); }
+
+    Timer(const Timer &) = delete;
+    Timer &operator=(const Timer &) = delete;
+  };
+
+private:
+  template <typename T> struct Entry {
+    std::string help;
+    std::unique_ptr<T> metric;
+  };
+
+  std::mutex m_Mutex;
+  // Sorted by name so the output is stable between scrapes
+  std::map<std::string, Entry<Counter>> m_Counters;
+  std::map<std::string, Entry<Gauge>> m_Gauges;
+  std::map<std::string, Entry<Histogram>> m_Histograms;
+
+  template <typename T>
+  T &Find(std::map<std::string, Entry<T>> &metrics, const std::string &name,
+          const std::string &help) {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    auto &entry = metrics[name];
+    if (!entry.metric)
+      entry.metric = std::make_unique<T>();
+    if (entry.help.empty())
+      entry.help = help;
+
+    return *entry.metric;
+  }
+
+public:
+  static Metrics &Get() {
+    static Metrics metrics;
+    return metrics;
+  }
+
+  // Registers the metric on first use, later calls return the same one and
+  // may leave the help text out
+  Counter &GetCounter(const std::string &name, const std::string &help = "") {
+    return Find(m_Counters, name, help);
+  }
+
+  Gauge &GetGauge(const std::string &name, const std::string &help = "") {
+    return Find(m_Gauges, name, help);
+  }
+
+  // Names should end in _seconds, values are recorded in ns and exported
+  // as a summary in seconds
+  Histogram &GetHistogram(const std::string &name,
+                          const std::string &help = "") {
+    return Find(m_Histograms, name, help);
+  }
+
+  std::string Render() {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    std::ostringstream out;
+
+    for (const auto &[name, entry] : m_Counters) {
+      out << "# HELP " << name << " " << entry.help << "\n";
+      out << "# TYPE " << name << " counter\n";
+      out << name << " " << entry.metric->Value() << "\n";
+    }
+
+    for (const auto &[name, entry] : m_Gauges) {
+      out << "# HELP " << name << " " << entry.help << "\n";
+      out << "# TYPE " << name << " gauge\n";
+      out << name << " " << entry.metric->Value() << "\n";
+    }
+
+    for (const auto &[name, entry] : m_Histograms) {
+      const Histogram &histogram = *entry.metric;
+
+      out << "# HELP " << name << " " << entry.help << "\n";
+      out << "# TYPE " << name << " summary\n";
+      for (double q : {0.5, 0.9, 0.99, 0.999})
+        out << name << "{quantile=\"" << q << "\"} "
+            << histogram.Quantile(q) / 1e9 << "\n";
+      out << name << "_sum " << histogram.Sum() / 1e9 << "\n";
+      out << name << "_count " << histogram.Count() << "\n";
+    }
+
+    return out.str();
+  }
+};
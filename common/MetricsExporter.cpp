@@ -0,0 +1,97 @@
+#include "MetricsExporter.h"
+
+#include <poll.h>
+#include <stdexcept>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Metrics.h"
+
+// How often the accept loop checks for shutdown
+static constexpr int POLL_TIMEOUT_MS = 200;
+// How long a scraper gets to send its request before it is answered anyway
+static constexpr int REQUEST_TIMEOUT_MS = 100;
+
+// Only ever removes a socket, a mistyped --metrics path must not cost a file
+static void unlinkSocket(const std::string &path) {
+  struct stat info = {};
+  if (lstat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode))
+    unlink(path.c_str());
+}
+
+MetricsExporter::MetricsExporter(const std::string &path) : m_Path(path) {
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+
+  if (path.size() >= sizeof(address.sun_path))
+    throw std::runtime_error("Metrics socket path too long");
+
+  strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+  m_Fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (m_Fd < 0)
+    throw std::runtime_error("Failed to create metrics socket");
+
+  // Left behind by a previous run, anything else makes bind fail below
+  unlinkSocket(path);
+
+  if (bind(m_Fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) <
+          0 ||
+      listen(m_Fd, 4) < 0) {
+    close(m_Fd);
+    throw std::runtime_error("Failed to listen on " + path);
+  }
+
+  m_Thread = std::thread([this]() {
+    while (m_Running.load(std::memory_order::relaxed)) {
+      pollfd fd = {m_Fd, POLLIN, 0};
+      if (poll(&fd, 1, POLL_TIMEOUT_MS) <= 0)
+        continue;
+
+      int client = accept4(m_Fd, nullptr, nullptr, SOCK_CLOEXEC);
+      if (client < 0)
+        continue;
+
+      Serve(client);
+      close(client);
+    }
+  });
+}
+
+MetricsExporter::~MetricsExporter() {
+  m_Running.store(false);
+
+  if (m_Thread.joinable())
+    m_Thread.join();
+
+  close(m_Fd);
+  unlinkSocket(m_Path);
+}
+
+void MetricsExporter::Serve(int client) {
+  // The request itself doesn't matter, drain what arrived so closing the
+  // socket doesn't reset the connection under the response
+  pollfd fd = {client, POLLIN, 0};
+  if (poll(&fd, 1, REQUEST_TIMEOUT_MS) > 0) {
+    char request[1024];
+    ::recv(client, request, sizeof(request), MSG_DONTWAIT);
+  }
+
+  std::string body = Metrics::Get().Render();
+  std::string response = "HTTP/1.0 200 OK\r\n"
+                         "Content-Type: text/plain; version=0.0.4\r\n"
+                         "Content-Length: " +
+                         std::to_string(body.size()) + "\r\n\r\n" + body;
+
+  size_t sent = 0;
+  while (sent < response.size()) {
+    ssize_t n = ::send(client, response.data() + sent, response.size() - sent,
+                       MSG_NOSIGNAL);
+    if (n <= 0)
+      break;
+    sent += n;
+  }
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <thread>
+
+// Serves Metrics::Get().Render() on a Unix domain socket, one response per
+// connection with a minimal HTTP header so
+//   curl --unix-socket <path> http://localhost/metrics
+// and anything that can scrape through a socket proxy both work.
+class MetricsExporter {
+private:
+  std::string m_Path;
+  int m_Fd = -1;
+
+  std::atomic<bool> m_Running = true;
+  std::thread m_Thread;
+
+  void Serve(int client);
+
+public:
+  explicit MetricsExporter(const std::string &path);
+  ~MetricsExporter();
+};
@@ -2,18 +2,33 @@
 
 #include <openssl/err.h>
 #include <openssl/evp.h>
+#include <openssl/kdf.h>
 #include <openssl/pem.h>
 
+#include <fcntl.h>
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <unistd.h>
 #include <vector>
 
+#include "Payload.h"
+
 class OpenSSL {
 private:
   EVP_PKEY *m_PrivateKey = nullptr;
 
 public:
+  struct Handshake {
+    // Answers the server's challenge
+    std::vector<uint8_t> response;
+    // For Socket::encrypt once the response is sent
+    std::vector<uint8_t> keyMaterial;
+    // The server's host public key (DER), its signature already checked.
+    // Whether it is the key we expect is up to the caller
+    std::vector<uint8_t> hostKey;
+  };
+
   OpenSSL() { OpenSSL_add_all_algorithms(); };
 
   ~OpenSSL() { EVP_PKEY_free(m_PrivateKey); };
@@ -32,6 +47,56 @@ public:
       throw std::runtime_error("Failed to load private key");
   }
 
+  // A new RSA key only the current user can read, for a server's host key
+  static void createPrivateKey(const char *filename) {
+    EVP_PKEY *key = EVP_RSA_gen(2048);
+    if (!key)
+      throw std::runtime_error("Failed to generate a key");
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    FILE *fp = fd < 0 ? nullptr : fdopen(fd, "w");
+    if (fd >= 0 && !fp)
+      close(fd);
+
+    bool written = fp && PEM_write_PrivateKey(fp, key, nullptr, nullptr, 0,
+                                              nullptr, nullptr) == 1;
+    if (fp)
+      fclose(fp);
+    EVP_PKEY_free(key);
+
+    if (!written)
+      throw std::runtime_error("Failed to write " + std::string(filename));
+  }
+
+  // The loaded private key's public half as DER, what a client pins
+  std::vector<uint8_t> publicKey() {
+    int size = i2d_PUBKEY(m_PrivateKey, nullptr);
+    if (size <= 0)
+      throw std::runtime_error("Failed to encode public key");
+
+    std::vector<uint8_t> der(size);
+    uint8_t *out = der.data();
+    i2d_PUBKEY(m_PrivateKey, &out);
+    return der;
+  }
+
+  // SHA-256 of a DER public key in hex
+  static std::string fingerprint(const std::vector<uint8_t> &publicKey) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int size = 0;
+    if (EVP_Digest(publicKey.data(), publicKey.size(), digest, &size,
+                   EVP_sha256(), nullptr) != 1)
+      throw std::runtime_error("Failed to hash public key");
+
+    static constexpr char HEX[] = "0123456789abcdef";
+    std::string hex;
+    for (unsigned int i = 0; i < size; i++) {
+      hex.push_back(HEX[digest[i] >> 4]);
+      hex.push_back(HEX[digest[i] & 0xF]);
+    }
+    return hex;
+  }
+
   EVP_PKEY *loadPublicKey(const char *filename) {
     FILE *fp = fopen(filename, "r");
     if (!fp)
@@ -104,4 +169,157 @@ public:
 
     return ok;
   }
+
+  // Ephemeral X25519 key for one handshake, free it with EVP_PKEY_free
+  EVP_PKEY *generateExchangeKey() {
+    EVP_PKEY *key = EVP_PKEY_Q_keygen(nullptr, nullptr, "X25519");
+    if (!key)
+      throw std::runtime_error("Failed to generate X25519 key");
+    return key;
+  }
+
+  std::vector<uint8_t> rawPublicKey(EVP_PKEY *key) {
+    size_t size = 0;
+    if (EVP_PKEY_get_raw_public_key(key, nullptr, &size) != 1)
+      throw std::runtime_error("Failed to get public key size");
+
+    std::vector<uint8_t> publicKey(size);
+    if (EVP_PKEY_get_raw_public_key(key, publicKey.data(), &size) != 1)
+      throw std::runtime_error("Failed to get public key");
+
+    return publicKey;
+  }
+
+  // X25519 with the peer's public key, stretched with HKDF-SHA256 into
+  // `size` bytes. The handshake transcript is the salt, so both sides only
+  // agree if they saw the same messages.
+  std::vector<uint8_t> deriveKeys(EVP_PKEY *key,
+                                  const std::vector<uint8_t> &peerPublicKey,
+                                  const std::vector<uint8_t> &transcript,
+                                  size_t size) {
+    static constexpr unsigned char INFO[] = "ssrd session keys";
+
+    EVP_PKEY *peer = EVP_PKEY_new_raw_public_key(
+        EVP_PKEY_X25519, nullptr, peerPublicKey.data(), peerPublicKey.size());
+    if (!peer)
+      throw std::runtime_error("Invalid X25519 public key");
+
+    // Fails on small order points, a shared secret of zero
+    std::vector<uint8_t> secret;
+    size_t secretSize = 0;
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(key, nullptr);
+
+    bool ok = ctx && EVP_PKEY_derive_init(ctx) == 1 &&
+              EVP_PKEY_derive_set_peer(ctx, peer) == 1 &&
+              EVP_PKEY_derive(ctx, nullptr, &secretSize) == 1;
+
+    if (ok) {
+      secret.resize(secretSize);
+      ok = EVP_PKEY_derive(ctx, secret.data(), &secretSize) == 1;
+    }
+
+    EVP_PKEY_CTX_free(ctx);
+    EVP_PKEY_free(peer);
+
+    if (!ok)
+      throw std::runtime_error("X25519 key exchange failed");
+
+    std::vector<uint8_t> keys(size);
+    EVP_PKEY_CTX *hkdf = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+
+    ok = hkdf && EVP_PKEY_derive_init(hkdf) == 1 &&
+         EVP_PKEY_CTX_set_hkdf_md(hkdf, EVP_sha256()) == 1 &&
+         EVP_PKEY_CTX_set1_hkdf_salt(hkdf, transcript.data(),
+                                     static_cast<int>(transcript.size())) == 1 &&
+         EVP_PKEY_CTX_set1_hkdf_key(hkdf, secret.data(),
+                                    static_cast<int>(secret.size())) == 1 &&
+         EVP_PKEY_CTX_add1_hkdf_info(hkdf, INFO, sizeof(INFO) - 1) == 1 &&
+         EVP_PKEY_derive(hkdf, keys.data(), &size) == 1;
+
+    EVP_PKEY_CTX_free(hkdf);
+    OPENSSL_cleanse(secret.data(), secret.size());
+
+    if (!ok)
+      throw std::runtime_error("Failed to derive session keys");
+
+    return keys;
+  }
+
+  // What the server signs with its host key, proving its exchange key is its
+  // own
+  static std::vector<uint8_t>
+  hostTranscript(const std::vector<uint8_t> &challenge,
+                 const std::vector<uint8_t> &serverPublicKey) {
+    std::vector<uint8_t> transcript = challenge;
+    transcript.insert(transcript.end(), serverPublicKey.begin(),
+                      serverPublicKey.end());
+    return transcript;
+  }
+
+  // What the client signs and both sides salt the key derivation with
+  static std::vector<uint8_t>
+  handshakeTranscript(const std::vector<uint8_t> &challenge,
+                      const std::vector<uint8_t> &serverPublicKey,
+                      const std::vector<uint8_t> &clientPublicKey) {
+    std::vector<uint8_t> transcript = challenge;
+    transcript.insert(transcript.end(), serverPublicKey.begin(),
+                      serverPublicKey.end());
+    transcript.insert(transcript.end(), clientPublicKey.begin(),
+                      clientPublicKey.end());
+    return transcript;
+  }
+
+  // The client half of the handshake, with the loaded private key. The
+  // challenge is the server's random bytes, X25519 public key, host public
+  // key and the host key's signature over the first two. The response is our
+  // own public key and a signature over the challenge and both exchange
+  // keys, which ties the session keys to our identity. Throws if the host
+  // signature doesn't check out.
+  Handshake clientHandshake(const std::vector<uint8_t> &challenge,
+                            size_t keySize) {
+    std::vector<uint8_t> bytes = Payload::get(0, challenge);
+    std::vector<uint8_t> serverPublicKey = Payload::get(1, challenge);
+    std::vector<uint8_t> hostKey = Payload::get(2, challenge);
+    std::vector<uint8_t> hostSignature = Payload::get(3, challenge);
+
+    const uint8_t *der = hostKey.data();
+    EVP_PKEY *host =
+        d2i_PUBKEY(nullptr, &der, static_cast<long>(hostKey.size()));
+    std::vector<uint8_t> hostTranscript =
+        OpenSSL::hostTranscript(bytes, serverPublicKey);
+    bool signedByHost =
+        verify(host, hostTranscript.data(), hostTranscript.size(),
+               hostSignature.data(), hostSignature.size());
+    EVP_PKEY_free(host);
+
+    if (!signedByHost)
+      throw std::runtime_error("Server host key signature is invalid");
+
+    EVP_PKEY *exchangeKey = generateExchangeKey();
+    Handshake handshake;
+    handshake.hostKey = std::move(hostKey);
+
+    try {
+      std::vector<uint8_t> clientPublicKey = rawPublicKey(exchangeKey);
+      std::vector<uint8_t> transcript =
+          handshakeTranscript(bytes, serverPublicKey, clientPublicKey);
+
+      std::vector<uint8_t> signature =
+          sign(transcript.data(), transcript.size());
+
+      Payload response;
+      response.set(signature.data(), signature.size());
+      response.set(clientPublicKey.data(), clientPublicKey.size());
+      handshake.response = std::move(response.buffer);
+
+      handshake.keyMaterial =
+          deriveKeys(exchangeKey, serverPublicKey, transcript, keySize);
+    } catch (...) {
+      EVP_PKEY_free(exchangeKey);
+      throw;
+    }
+
+    EVP_PKEY_free(exchangeKey);
+    return handshake;
+  }
 };
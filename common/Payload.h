@@ -61,11 +61,18 @@ struct Payload {
     size_t offset = 0;
 
     for (size_t i = 0; i < index + 1; i++) {
+      // Truncated or not a payload, e.g. a handshake from a stranger
+      if (buffer.size() - offset < sizeof(uint32_t))
+        return {};
+
       uint32_t size = 0;
       std::memcpy(&size, buffer.data() + offset, sizeof(uint32_t));
 
       offset += sizeof(uint32_t);
 
+      if (buffer.size() - offset < size)
+        return {};
+
       if (i == index) {
         result.resize(size);
         std::memcpy(result.data(), buffer.data() + offset, size);
@@ -78,6 +85,27 @@ struct Payload {
     return result;
   };
 
+  // Reads the field at `offset` and moves past it, for walking a message
+  // once instead of calling get() per field. False at the end of the buffer
+  // or on a truncated field.
+  static bool next(const std::vector<uint8_t> &buffer, size_t &offset,
+                   std::vector<uint8_t> &field) {
+    if (offset > buffer.size() ||
+        buffer.size() - offset < sizeof(uint32_t))
+      return false;
+
+    uint32_t size = 0;
+    std::memcpy(&size, buffer.data() + offset, sizeof(uint32_t));
+
+    if (buffer.size() - offset - sizeof(uint32_t) < size)
+      return false;
+
+    const uint8_t *data = buffer.data() + offset + sizeof(uint32_t);
+    field.assign(data, data + size);
+    offset += sizeof(uint32_t) + size;
+    return true;
+  };
+
   static double toDouble(const std::vector<uint8_t> &buffer) {
     uint64_t net;
     std::memcpy(&net, buffer.data(), sizeof(net));
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdint.h>
+
+// Latency probes are tagged by painting their id into the top left corner of
+// the captured frame: a white and a black block as a start pattern, then one
+// block per bit, white for 1. Blocks are big and flat enough to survive
+// encoding, the client reads the center of each one back from the luma plane.
+namespace ProbeMarker {
+
+constexpr int BLOCK = 16;
+constexpr int BITS = 16;
+constexpr int BLOCKS = BITS + 2;
+
+// Ids wrap within the bits the marker carries, 0 is never used
+inline uint32_t NextId(uint32_t id) {
+  id = (id + 1) & ((1u << BITS) - 1);
+  return id ? id : 1;
+}
+
+inline void Paint(uint8_t *rgb, int width, int height, uint32_t id) {
+  if (width < BLOCKS * BLOCK || height < BLOCK)
+    return;
+
+  for (int block = 0; block < BLOCKS; block++) {
+    bool white = block == 0 ||
+                 (block >= 2 && (id >> (BITS - 1 - (block - 2))) & 1);
+    uint8_t value = white ? 255 : 0;
+
+    for (int y = 0; y < BLOCK; y++) {
+      uint8_t *row = rgb + (static_cast<size_t>(y) * width + block * BLOCK) * 3;
+      for (int x = 0; x < BLOCK * 3; x++)
+        row[x] = value;
+    }
+  }
+}
+
+// False when the start pattern isn't there. `stride` defaults to `width`
+inline bool Read(const uint8_t *luma, int width, int height, uint32_t &id,
+                 int stride = 0) {
+  if (width < BLOCKS * BLOCK || height < BLOCK)
+    return false;
+
+  if (!stride)
+    stride = width;
+
+  auto bit = [&](int block) {
+    const uint8_t *center = luma + static_cast<size_t>(BLOCK / 2) * stride +
+                            block * BLOCK + BLOCK / 2;
+    return *center >= 128;
+  };
+
+  if (!bit(0) || bit(1))
+    return false;
+
+  id = 0;
+  for (int i = 0; i < BITS; i++)
+    id = (id << 1) | (bit(i + 2) ? 1 : 0);
+
+  return id != 0;
+}
+
+} // namespace ProbeMarker
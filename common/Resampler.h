@@ -0,0 +1,156 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <numbers>
+#include <numeric>
+#include <stdexcept>
+#include <vector>
+
+// Polyphase windowed-sinc resampler for interleaved float audio. The ratio is
+// reduced to up / down, one Blackman windowed kernel is precomputed per output
+// phase and the tail of each chunk is kept so chunk boundaries are seamless.
+class Resampler {
+private:
+  // Zero crossings of the sinc on each side of the kernel center
+  static constexpr int ZERO_CROSSINGS = 16;
+  // Pass band as a fraction of the lower Nyquist frequency
+  static constexpr double ROLLOFF = 0.94;
+
+  int m_InputRate;
+  int m_OutputRate;
+  int m_Channels;
+
+  int m_Up = 1;
+  int m_Down = 1;
+  int m_HalfTaps = 0;
+  int m_Taps = 0;
+  // m_Up kernels of m_Taps coefficients each
+  std::vector<float> m_Filter;
+
+  // Interleaved input not yet fully consumed, starts with the kernel history
+  std::vector<float> m_History;
+  // Input frame in m_History under the current output sample and its phase
+  size_t m_Index = 0;
+  int m_Phase = 0;
+
+  void Design() {
+    constexpr double pi = std::numbers::pi;
+    int divisor = std::gcd(m_InputRate, m_OutputRate);
+    m_Up = m_OutputRate / divisor;
+    m_Down = m_InputRate / divisor;
+
+    // When downsampling the cutoff moves below the input Nyquist frequency and
+    // the kernel widens to keep the same number of zero crossings
+    double cutoff = std::min(1.0, static_cast<double>(m_Up) / m_Down) * ROLLOFF;
+    m_HalfTaps = static_cast<int>(std::ceil(ZERO_CROSSINGS / cutoff));
+    m_Taps = m_HalfTaps * 2;
+    m_Filter.resize(static_cast<size_t>(m_Up) * m_Taps);
+
+    for (int phase = 0; phase < m_Up; phase++) {
+      float *kernel = &m_Filter[static_cast<size_t>(phase) * m_Taps];
+      double offset = static_cast<double>(phase) / m_Up;
+      double sum = 0.0;
+
+      for (int tap = 0; tap < m_Taps; tap++) {
+        // Distance in input samples between this tap and the output sample
+        double x = offset + m_HalfTaps - 1 - tap;
+        double t = cutoff * x;
+        double sinc = t == 0.0 ? 1.0 : std::sin(pi * t) / (pi * t);
+
+        double position = (x + m_HalfTaps) / (2.0 * m_HalfTaps);
+        double window = 0.0;
+        if (position > 0.0 && position < 1.0)
+          window = 0.42 - 0.5 * std::cos(2.0 * pi * position) +
+                   0.08 * std::cos(4.0 * pi * position);
+
+        kernel[tap] = static_cast<float>(sinc * window);
+        sum += kernel[tap];
+      }
+
+      // Unity gain at DC for every phase
+      for (int tap = 0; tap < m_Taps; tap++)
+        kernel[tap] = static_cast<float>(kernel[tap] / sum);
+    }
+  }
+
+public:
+  Resampler(int inputRate, int outputRate, int channels = 2)
+      : m_InputRate(inputRate), m_OutputRate(outputRate),
+        m_Channels(channels) {
+    if (inputRate <= 0 || outputRate <= 0)
+      throw std::invalid_argument("Sample rates must be positive");
+
+    if (channels <= 0)
+      throw std::invalid_argument("channels must be positive");
+
+    Design();
+    Reset();
+  }
+
+  int InputRate() const { return m_InputRate; }
+  int OutputRate() const { return m_OutputRate; }
+  int Channels() const { return m_Channels; }
+
+  // Latency added by the filter, in input frames
+  int Delay() const { return m_InputRate == m_OutputRate ? 0 : m_HalfTaps; }
+
+  void Reset() {
+    // Silence before the first sample so the first output lines up with it
+    m_History.assign(static_cast<size_t>(m_Taps - 1) * m_Channels, 0.0f);
+    m_Index = m_HalfTaps - 1;
+    m_Phase = 0;
+  }
+
+  // Resamples `samples` interleaved values into `output`, which is cleared
+  // first and keeps its capacity between calls
+  void Process(const float *input, size_t samples, std::vector<float> &output) {
+    output.clear();
+
+    if (m_InputRate == m_OutputRate) {
+      output.assign(input, input + samples);
+      return;
+    }
+
+    m_History.insert(m_History.end(), input, input + samples);
+
+    size_t frames = m_History.size() / m_Channels;
+    size_t expected = (frames - m_Index) * m_Up / m_Down + 1;
+    output.reserve(expected * m_Channels);
+
+    while (m_Index + m_HalfTaps < frames) {
+      const float *kernel = &m_Filter[static_cast<size_t>(m_Phase) * m_Taps];
+      const float *source =
+          &m_History[(m_Index + 1 - m_HalfTaps) * m_Channels];
+
+      if (m_Channels == 2) {
+        float left = 0.0f;
+        float right = 0.0f;
+        for (int tap = 0; tap < m_Taps; tap++) {
+          left += source[tap * 2] * kernel[tap];
+          right += source[tap * 2 + 1] * kernel[tap];
+        }
+        output.push_back(left);
+        output.push_back(right);
+      } else {
+        for (int channel = 0; channel < m_Channels; channel++) {
+          float sum = 0.0f;
+          for (int tap = 0; tap < m_Taps; tap++)
+            sum += source[tap * m_Channels + channel] * kernel[tap];
+          output.push_back(sum);
+        }
+      }
+
+      m_Phase += m_Down;
+      m_Index += m_Phase / m_Up;
+      m_Phase %= m_Up;
+    }
+
+    // Keep only the frames the next output sample still reaches back to
+    size_t consumed = m_Index + 1 - m_HalfTaps;
+    consumed = std::min(consumed, frames);
+    m_History.erase(m_History.begin(),
+                    m_History.begin() + consumed * m_Channels);
+    m_Index -= consumed;
+  }
+};
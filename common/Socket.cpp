@@ -1,4 +1,5 @@
 #include "Socket.h"
+#include "Metrics.h"
 
 #include <cstring>
 #include <iostream>
@@ -6,6 +7,28 @@
 #include <thread>
 #include <unistd.h>
 
+static Metrics::Histogram &sendTime = Metrics::Get().GetHistogram(
+    "ssrd_socket_send_seconds",
+    "Message send including waiting for other senders");
+static Metrics::Counter &sentMessages = Metrics::Get().GetCounter(
+    "ssrd_socket_sent_messages_total", "Messages sent");
+static Metrics::Counter &sentBytes = Metrics::Get().GetCounter(
+    "ssrd_socket_sent_bytes_total", "Bytes sent, framing included");
+static Metrics::Counter &receivedMessages = Metrics::Get().GetCounter(
+    "ssrd_socket_received_messages_total", "Messages received");
+static Metrics::Counter &receivedBytes = Metrics::Get().GetCounter(
+    "ssrd_socket_received_bytes_total", "Bytes received, framing included");
+
+// GCM authentication tag after each encrypted record
+static constexpr size_t TAG_SIZE = 16;
+
+// The 4 byte prefix stays, the big endian record counter follows it
+static void nextNonce(std::array<uint8_t, 12> &nonce, uint64_t &counter) {
+  for (int i = 0; i < 8; i++)
+    nonce[4 + i] = static_cast<uint8_t>(counter >> (56 - 8 * i));
+  counter++;
+}
+
 bool Socket::isSocketBound(int socket) {
   struct sockaddr_in address;
   socklen_t len = sizeof(address);
@@ -21,7 +44,12 @@ Socket::Socket() {
     throw std::runtime_error("Socket failed");
 }
 
+Socket::Socket(int connected) : m_Client(connected) {}
+
 Socket::~Socket() {
+  EVP_CIPHER_CTX_free(m_SendCipher.ctx);
+  EVP_CIPHER_CTX_free(m_ReceiveCipher.ctx);
+
   if (m_Server > -1)
     ::close(m_Server);
 
@@ -64,6 +92,9 @@ void Socket::listen(uint16_t port) {
 
   if (m_Client > 0)
     LOG("Establish a connection with client", m_Client);
+
+  // The previous client's keys are of no use to this one
+  disableEncryption();
 }
 
 void Socket::connect(const char *ip, uint16_t port) {
@@ -124,21 +155,54 @@ ssize_t Socket::read(int fd, void *bytes, size_t size) {
 ssize_t Socket::send(const void *bytes, size_t size) {
   int fd = getSocketID();
 
-  uint32_t pSize = htonl(static_cast<uint32_t>(size));
-
-  // [size + data]
-  std::vector<uint8_t> buffer(sizeof(pSize) + size);
-  std::memcpy(buffer.data(), &pSize, sizeof(pSize));
-  std::memcpy(buffer.data() + sizeof(pSize), bytes, size);
+  Metrics::Timer timer(sendTime);
+  std::lock_guard<std::mutex> lock(m_SendMutex);
+
+  bool encrypted = m_SendCipher.enabled;
+  size_t recordSize = size + (encrypted ? TAG_SIZE : 0);
+  uint32_t pSize = htonl(static_cast<uint32_t>(recordSize));
+
+  // [size + data], encrypted [size + ciphertext + tag]
+  size_t total = sizeof(pSize) + recordSize;
+  if (m_SendBuffer.size() < total)
+    m_SendBuffer.resize(total);
+
+  std::memcpy(m_SendBuffer.data(), &pSize, sizeof(pSize));
+  uint8_t *record = m_SendBuffer.data() + sizeof(pSize);
+
+  if (encrypted) {
+    // Encrypts while copying out of the caller's buffer, the size is
+    // authenticated along with it
+    EVP_CIPHER_CTX *ctx = m_SendCipher.ctx;
+    nextNonce(m_SendCipher.nonce, m_SendCipher.counter);
+    int length = 0;
+
+    if (EVP_EncryptInit_ex(ctx, nullptr, nullptr, nullptr,
+                           m_SendCipher.nonce.data()) != 1 ||
+        EVP_EncryptUpdate(ctx, nullptr, &length, m_SendBuffer.data(),
+                          sizeof(pSize)) != 1 ||
+        EVP_EncryptUpdate(ctx, record, &length,
+                          static_cast<const uint8_t *>(bytes),
+                          static_cast<int>(size)) != 1 ||
+        EVP_EncryptFinal_ex(ctx, record + length, &length) != 1 ||
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, TAG_SIZE,
+                            record + size) != 1)
+      throw std::runtime_error("Failed to encrypt message");
+  } else {
+    std::memcpy(record, bytes, size);
+  }
 
-  ssize_t sent = send(fd, buffer.data(), buffer.size(), 0);
+  ssize_t sent = send(fd, m_SendBuffer.data(), total, 0);
 
   if (sent <= 0)
     return sent;
 
-  if (static_cast<size_t>(sent) < buffer.size())
+  if (static_cast<size_t>(sent) < total)
     throw std::runtime_error("Failed to send all bytes");
 
+  sentMessages.Add();
+  sentBytes.Add(sent);
+
   return sent;
 }
 
@@ -171,6 +235,37 @@ ssize_t Socket::read(std::vector<uint8_t> &buffer) {
   if (received < size)
     throw std::runtime_error("Failed to read bytes");
 
+  if (m_ReceiveCipher.enabled) {
+    // Decrypted in place, the tag is cut off afterwards
+    EVP_CIPHER_CTX *ctx = m_ReceiveCipher.ctx;
+    nextNonce(m_ReceiveCipher.nonce, m_ReceiveCipher.counter);
+    int length = 0;
+
+    bool authentic =
+        size >= TAG_SIZE &&
+        EVP_DecryptInit_ex(ctx, nullptr, nullptr, nullptr,
+                           m_ReceiveCipher.nonce.data()) == 1 &&
+        EVP_DecryptUpdate(ctx, nullptr, &length,
+                          reinterpret_cast<const uint8_t *>(&sBuffer),
+                          sizeof(sBuffer)) == 1 &&
+        EVP_DecryptUpdate(ctx, buffer.data(), &length, buffer.data(),
+                          static_cast<int>(size - TAG_SIZE)) == 1 &&
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_SIZE,
+                            buffer.data() + size - TAG_SIZE) == 1 &&
+        EVP_DecryptFinal_ex(ctx, buffer.data() + length, &length) == 1;
+
+    if (!authentic) {
+      LOG("Message failed authentication");
+      buffer.clear();
+      return -1;
+    }
+
+    buffer.resize(size - TAG_SIZE);
+  }
+
+  receivedMessages.Add();
+  receivedBytes.Add(sizeof(sBuffer) + received);
+
   return received;
 }
 
@@ -190,3 +285,52 @@ void Socket::close(Close type) {
     break;
   }
 }
+
+void Socket::encrypt(const std::vector<uint8_t> &keyMaterial, bool server) {
+  if (keyMaterial.size() != KEY_MATERIAL_SIZE)
+    throw std::runtime_error("Invalid key material");
+
+  const uint8_t *clientKey = keyMaterial.data();
+  const uint8_t *serverKey = clientKey + 32;
+  const uint8_t *clientPrefix = serverKey + 32;
+  const uint8_t *serverPrefix = clientPrefix + 4;
+
+  {
+    std::lock_guard<std::mutex> lock(m_SendMutex);
+    initializeCipher(m_SendCipher, server ? serverKey : clientKey,
+                     server ? serverPrefix : clientPrefix, true);
+  }
+
+  initializeCipher(m_ReceiveCipher, server ? clientKey : serverKey,
+                   server ? clientPrefix : serverPrefix, false);
+}
+
+void Socket::initializeCipher(Cipher &cipher, const uint8_t *key,
+                              const uint8_t *prefix, bool encrypt) {
+  if (!cipher.ctx)
+    cipher.ctx = EVP_CIPHER_CTX_new();
+
+  if (!cipher.ctx)
+    throw std::runtime_error("Failed to create EVP_CIPHER_CTX");
+
+  // Expands the key once, records only set their nonce
+  int result = encrypt ? EVP_EncryptInit_ex(cipher.ctx, EVP_aes_256_gcm(),
+                                            nullptr, key, nullptr)
+                       : EVP_DecryptInit_ex(cipher.ctx, EVP_aes_256_gcm(),
+                                            nullptr, key, nullptr);
+  if (result != 1)
+    throw std::runtime_error("Failed to initialize AES-256-GCM");
+
+  std::memcpy(cipher.nonce.data(), prefix, 4);
+  cipher.counter = 0;
+  cipher.enabled = true;
+}
+
+void Socket::disableEncryption() {
+  {
+    std::lock_guard<std::mutex> lock(m_SendMutex);
+    m_SendCipher.enabled = false;
+  }
+
+  m_ReceiveCipher.enabled = false;
+}
@@ -2,6 +2,9 @@
 
 #include "Utility.h"
 #include <arpa/inet.h>
+#include <array>
+#include <mutex>
+#include <openssl/evp.h>
 
 class Socket {
 
@@ -14,10 +17,39 @@ private:
 public:
   enum class Close { CLIENT = 0, SERVER = 1 };
 
+  // Both directions' AES-256 keys followed by their 4 byte nonce prefixes,
+  // client to server first
+  static constexpr size_t KEY_MATERIAL_SIZE = 2 * 32 + 2 * 4;
+
 private:
   int m_Server = -1, m_Client = -1;
   sockaddr_in m_ServerAddress, m_ClientAddress;
 
+  // Messages are sent from several threads, keep their frames whole
+  std::mutex m_SendMutex;
+  // Reused for every message, only grows. Guarded by m_SendMutex
+  std::vector<uint8_t> m_SendBuffer;
+
+  // AES-256-GCM state of one direction. The context keeps the expanded key,
+  // each record only sets a new nonce: the prefix and a counter, so a
+  // dropped, replayed or reordered record fails to decrypt
+  struct Cipher {
+    EVP_CIPHER_CTX *ctx = nullptr;
+    bool enabled = false;
+    std::array<uint8_t, 12> nonce = {};
+    uint64_t counter = 0;
+  };
+
+  // Guarded by m_SendMutex
+  Cipher m_SendCipher;
+  // Only used by the one thread reading
+  Cipher m_ReceiveCipher;
+
+  void initializeCipher(Cipher &cipher, const uint8_t *key,
+                        const uint8_t *prefix, bool encrypt);
+
+  void disableEncryption();
+
   int getSocketID() { return m_Client > -1 ? m_Client : m_Server; };
 
   bool isSocketBound(int socket);
@@ -38,6 +70,8 @@ private:
 
 public:
   Socket();
+  // Takes over an already connected descriptor, e.g. one end of a socketpair
+  explicit Socket(int connected);
   ~Socket();
 
   void listen(uint16_t port);
@@ -50,7 +84,14 @@ public:
 
   ssize_t send(const void *bytes, size_t size);
 
+  // With encryption a failed tag check returns -1, the stream can't be
+  // trusted anymore
   ssize_t read(std::vector<uint8_t> &buffer);
 
+  // Encrypts and authenticates every message from here on, both ends switch
+  // right after the handshake. `server` picks which keys are for sending.
+  // A new connection accepted by listen() starts in the clear again.
+  void encrypt(const std::vector<uint8_t> &keyMaterial, bool server);
+
   void close(Close type);
 };
\ No newline at end of file
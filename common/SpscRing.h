@@ -0,0 +1,85 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+// Lock free single producer / single consumer ring of trivially copyable
+// values. The capacity is rounded up to a power of two so wrapping is a mask,
+// and the indices only ever grow so a full ring needs no spare slot.
+template <typename T> class SpscRing {
+  static_assert(std::is_trivially_copyable_v<T>);
+
+private:
+  std::vector<T> m_Buffer;
+  size_t m_Mask = 0;
+
+  // Kept on separate cache lines so the two threads don't bounce them
+  alignas(64) std::atomic<size_t> m_Head{0}; // Next slot to write
+  alignas(64) std::atomic<size_t> m_Tail{0}; // Next slot to read
+
+public:
+  SpscRing() = default;
+  explicit SpscRing(size_t capacity) { Reset(capacity); }
+
+  // Not thread safe, neither side may be running
+  void Reset(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity)
+      size <<= 1;
+
+    m_Buffer.assign(size, T{});
+    m_Mask = size - 1;
+    m_Head.store(0, std::memory_order::relaxed);
+    m_Tail.store(0, std::memory_order::relaxed);
+  }
+
+  size_t Capacity() const { return m_Buffer.size(); }
+
+  // Exact from the producer or the consumer. Any other thread gets a
+  // snapshot: tail is loaded first so the consumer moving it in between
+  // can't make the difference wrap, and the producer moving head in between
+  // is clamped to the capacity.
+  size_t Size() const {
+    size_t tail = m_Tail.load(std::memory_order::acquire);
+    size_t head = m_Head.load(std::memory_order::acquire);
+    return std::min(head - tail, Capacity());
+  }
+
+  size_t Free() const { return Capacity() - Size(); }
+
+  // Producer only, returns how many values fit
+  size_t Write(const T *data, size_t count) {
+    size_t head = m_Head.load(std::memory_order::relaxed);
+    size_t tail = m_Tail.load(std::memory_order::acquire);
+
+    count = std::min(count, Capacity() - (head - tail));
+
+    // At most two copies, up to the end of the buffer and from its start
+    size_t index = head & m_Mask;
+    size_t first = std::min(count, Capacity() - index);
+    std::memcpy(m_Buffer.data() + index, data, first * sizeof(T));
+    std::memcpy(m_Buffer.data(), data + first, (count - first) * sizeof(T));
+
+    m_Head.store(head + count, std::memory_order::release);
+    return count;
+  }
+
+  // Consumer only, returns how many values were available
+  size_t Read(T *data, size_t count) {
+    size_t tail = m_Tail.load(std::memory_order::relaxed);
+    size_t head = m_Head.load(std::memory_order::acquire);
+
+    count = std::min(count, head - tail);
+
+    size_t index = tail & m_Mask;
+    size_t first = std::min(count, Capacity() - index);
+    std::memcpy(data, m_Buffer.data() + index, first * sizeof(T));
+    std::memcpy(data + first, m_Buffer.data(), (count - first) * sizeof(T));
+
+    m_Tail.store(tail + count, std::memory_order::release);
+    return count;
+  }
+};
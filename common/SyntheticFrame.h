@@ -0,0 +1,87 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <stdint.h>
+#include <vector>
+
+#include "Utility.h"
+
+// Desktop-like test content in a capture format: a static gradient with a
+// window dragged across it, showing text-like detail that scrolls a line per
+// frame. Only the window's old and new area is redrawn, so rendering stays
+// cheap next to what is being measured.
+class SyntheticFrame {
+private:
+  int m_Width;
+  int m_Height;
+  spa_video_format m_Format;
+  PixelFormatInfo m_Info;
+
+  std::vector<uint8_t> m_Background;
+  std::vector<uint8_t> m_Frame;
+
+  int m_BoxWidth;
+  int m_BoxHeight;
+  int m_BoxY;
+  // Where the window was last drawn, -1 before the first frame
+  int m_BoxX = -1;
+
+  void Put(std::vector<uint8_t> &buffer, int x, int y, uint8_t r, uint8_t g,
+           uint8_t b) {
+    uint8_t *pixel =
+        &buffer[(static_cast<size_t>(y) * m_Width + x) * m_Info.bytesPerPixel];
+    pixel[m_Info.order[0]] = r;
+    pixel[m_Info.order[1]] = g;
+    pixel[m_Info.order[2]] = b;
+  }
+
+  size_t Offset(int x, int y) const {
+    return (static_cast<size_t>(y) * m_Width + x) * m_Info.bytesPerPixel;
+  }
+
+public:
+  SyntheticFrame(int width, int height, spa_video_format format)
+      : m_Width(width), m_Height(height), m_Format(format),
+        m_Info(pixelFormatInfo(format)),
+        m_Background(static_cast<size_t>(width) * height * m_Info.bytesPerPixel,
+                     255),
+        m_BoxWidth(width / 4), m_BoxHeight(height / 3), m_BoxY(height / 3) {
+    for (int y = 0; y < m_Height; y++)
+      for (int x = 0; x < m_Width; x++)
+        Put(m_Background, x, y, static_cast<uint8_t>(x * 255 / m_Width),
+            static_cast<uint8_t>(y * 255 / m_Height), 128);
+
+    m_Frame = m_Background;
+  }
+
+  int Width() const { return m_Width; }
+  int Height() const { return m_Height; }
+  spa_video_format Format() const { return m_Format; }
+  size_t Size() const { return m_Frame.size(); }
+
+  // Valid until the next call
+  const uint8_t *Render(uint32_t index) {
+    size_t rowBytes = static_cast<size_t>(m_BoxWidth) * m_Info.bytesPerPixel;
+
+    if (m_BoxX >= 0)
+      for (int y = m_BoxY; y < m_BoxY + m_BoxHeight; y++)
+        std::memcpy(&m_Frame[Offset(m_BoxX, y)],
+                    &m_Background[Offset(m_BoxX, y)], rowBytes);
+
+    m_BoxX = (index * 8) % std::max(1, m_Width - m_BoxWidth);
+
+    for (int y = m_BoxY; y < m_BoxY + m_BoxHeight; y++) {
+      for (int x = m_BoxX; x < m_BoxX + m_BoxWidth; x++) {
+        // Glyph sized noise
+        uint32_t line = (y - m_BoxY + index) / 2;
+        uint32_t column = (x - m_BoxX) / 2;
+        uint32_t hash = (line * 2654435761u) ^ (column * 40503u);
+        uint8_t ink = (hash >> 13) & 1 ? 30 : 240;
+        Put(m_Frame, x, y, ink, ink, ink);
+      }
+    }
+
+    return m_Frame.data();
+  }
+};
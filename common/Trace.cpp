@@ -0,0 +1,239 @@
+#include "Trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <fcntl.h>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "SpscRing.h"
+#include "Utility.h"
+
+namespace {
+
+constexpr size_t RING_EVENTS = 16384;
+constexpr auto DRAIN_INTERVAL = std::chrono::milliseconds(50);
+
+// One per thread that recorded, the thread writes and the writer drains. The
+// writer lets go of it once the thread is gone and it is empty.
+struct ThreadBuffer {
+  SpscRing<Trace::Event> ring{RING_EVENTS};
+  pid_t tid = 0;
+  std::atomic<uint64_t> dropped = 0;
+};
+
+std::mutex buffersMutex;
+std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+
+std::atomic<bool> toggleRequested = false;
+std::atomic<bool> running = false;
+std::thread writer;
+
+// Wakes the writer from the signal handler and Shutdown, it sleeps on the
+// read end while nothing is recorded
+int wakePipe[2] = {-1, -1};
+
+void wake() {
+  char byte = 0;
+  // Non blocking, a full pipe already wakes it
+  ssize_t written = write(wakePipe[1], &byte, 1);
+  (void)written;
+}
+
+// Registers on the thread's first event, the only time recording locks
+ThreadBuffer &localBuffer() {
+  thread_local std::shared_ptr<ThreadBuffer> buffer = [] {
+    auto created = std::make_shared<ThreadBuffer>();
+    created->tid = gettid();
+
+    std::lock_guard<std::mutex> lock(buffersMutex);
+    buffers.push_back(created);
+    return created;
+  }();
+
+  return *buffer;
+}
+
+void onSignal(int) {
+  toggleRequested.store(true);
+  wake();
+}
+
+// Hands every buffered event to `write`, null just discards them
+template <typename Write> uint64_t drain(Write &&write) {
+  std::vector<std::shared_ptr<ThreadBuffer>> threads;
+  {
+    std::lock_guard<std::mutex> lock(buffersMutex);
+    threads = buffers;
+  }
+
+  Trace::Event events[256];
+  uint64_t dropped = 0;
+
+  for (auto &thread : threads) {
+    size_t count;
+    while ((count = thread->ring.Read(events, std::size(events))))
+      for (size_t i = 0; i < count; i++)
+        write(events[i], thread->tid);
+
+    dropped += thread->dropped.exchange(0);
+  }
+
+  threads.clear();
+
+  // Threads come and go with every session, only the list keeps the
+  // buffers of finished ones alive
+  {
+    std::lock_guard<std::mutex> lock(buffersMutex);
+    std::erase_if(buffers, [](const std::shared_ptr<ThreadBuffer> &buffer) {
+      return buffer.use_count() == 1 && !buffer->ring.Size();
+    });
+  }
+
+  return dropped;
+}
+
+} // namespace
+
+void Trace::Record(Stage stage, Phase phase, uint64_t id) {
+  ThreadBuffer &buffer = localBuffer();
+  Event event = {monotonicNs(), id, stage, phase};
+
+  if (!buffer.ring.Write(&event, 1))
+    buffer.dropped.fetch_add(1, std::memory_order::relaxed);
+}
+
+const char *Trace::StageName(Stage stage) {
+  static constexpr const char *names[] = {
+      "capture", "convert",      "encode",       "send",  "receive", "decode",
+      "present", "audio-encode", "audio-decode", "input", "frame",
+  };
+  static_assert(std::size(names) == static_cast<size_t>(Stage::STAGE_COUNT));
+
+  return names[static_cast<size_t>(stage)];
+}
+
+void Trace::Initialize(const std::string &process, const std::string &path,
+                       bool record) {
+#ifndef SSRD_TRACE
+  if (record)
+    std::cerr << "Built without ENABLE_TRACE, nothing to trace" << std::endl;
+  return;
+#endif
+
+  if (running.exchange(true))
+    return;
+
+  std::string file = path.empty() ? "/tmp/ssrd-" + process + "-" +
+                                        std::to_string(getpid()) + ".json"
+                                  : path;
+
+  if (wakePipe[0] < 0 && pipe2(wakePipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+    running.store(false);
+    std::cerr << "Failed to create the trace wake pipe" << std::endl;
+    return;
+  }
+
+  // Restarted so blocking socket reads don't fail with EINTR
+  struct sigaction action = {};
+  action.sa_handler = onSignal;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGUSR1, &action, nullptr);
+
+  toggleRequested.store(record);
+
+  writer = std::thread([process, file]() {
+    FILE *out = nullptr;
+    pid_t pid = getpid();
+
+    auto write = [&](const Event &event, pid_t tid) {
+      static constexpr char phases[] = {'B', 'E', 'i'};
+
+      fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,"
+                   "\"tid\":%d",
+              StageName(event.stage), phases[static_cast<int>(event.phase)],
+              event.ns / 1e3, pid, tid);
+
+      if (event.phase == Phase::INSTANT)
+        fputs(",\"s\":\"t\"", out);
+
+      if (event.id)
+        fprintf(out, ",\"args\":{\"frame\":%llu}",
+                static_cast<unsigned long long>(event.id));
+
+      fputc('}', out);
+    };
+
+    auto stop = [&]() {
+      s_Recording.store(false);
+
+      // Scopes that saw recording on may still be closing
+      std::this_thread::sleep_for(DRAIN_INTERVAL);
+      uint64_t dropped = drain(write);
+
+      fprintf(out, ",\n{\"name\":\"dropped events\",\"ph\":\"i\",\"ts\":%.3f,"
+                   "\"pid\":%d,\"s\":\"g\",\"args\":{\"count\":%llu}}\n]\n",
+              monotonicNs() / 1e3, pid,
+              static_cast<unsigned long long>(dropped));
+      fclose(out);
+      out = nullptr;
+
+      std::cerr << "Trace written to " << file << std::endl;
+    };
+
+    while (running.load()) {
+      if (toggleRequested.exchange(false)) {
+        if (out) {
+          stop();
+        } else if ((out = fopen(file.c_str(), "w"))) {
+          // Left over from the previous recording
+          drain([](const Event &, pid_t) {});
+
+          // The JSON array format, still loadable without the closing ]
+          fprintf(out, "[{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+                       "\"args\":{\"name\":\"ssrd-%s\"}}",
+                  pid, process.c_str());
+          s_Recording.store(true);
+        } else {
+          std::cerr << "Failed to open " << file << std::endl;
+        }
+      }
+
+      if (out) {
+        drain(write);
+        fflush(out);
+      }
+
+      // Drains at an interval while recording, otherwise sleeps until
+      // SIGUSR1 or Shutdown
+      pollfd wakeup = {wakePipe[0], POLLIN, 0};
+      if (poll(&wakeup, 1, out ? static_cast<int>(DRAIN_INTERVAL.count()) : -1) >
+          0) {
+        char bytes[64];
+        while (read(wakePipe[0], bytes, sizeof(bytes)) > 0) {
+        }
+      }
+    }
+
+    if (out)
+      stop();
+  });
+}
+
+void Trace::Shutdown() {
+  if (!running.exchange(false))
+    return;
+
+  wake();
+
+  if (writer.joinable())
+    writer.join();
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+
+// Binary trace events recorded into per thread lock free rings and written
+// out by a background thread as a Chrome trace (chrome://tracing, Perfetto).
+// Recording starts with --trace or SIGUSR1 and SIGUSR1 stops it again, the
+// file is flushed as it goes and stays loadable if the process dies. Built
+// without ENABLE_TRACE the TRACE_ macros compile to nothing, built with it an
+// idle trace point costs a relaxed load and a branch.
+class Trace {
+public:
+  enum class Stage : uint16_t {
+    CAPTURE,
+    CONVERT,
+    ENCODE,
+    SEND,
+    RECEIVE,
+    DECODE,
+    PRESENT,
+    AUDIO_ENCODE,
+    AUDIO_DECODE,
+    INPUT,
+    FRAME,
+    STAGE_COUNT
+  };
+
+  enum class Phase : uint8_t { BEGIN, END, INSTANT };
+
+  struct Event {
+    uint64_t ns;
+    // Frame capture time, ties server and client events together, 0 if none
+    uint64_t id;
+    Stage stage;
+    Phase phase;
+  };
+
+  // Begins at construction and ends at destruction, if recording was on
+  class Scope {
+  private:
+    Stage m_Stage;
+    uint64_t m_Id;
+    bool m_Recording;
+
+  public:
+    Scope(Stage stage, uint64_t id = 0)
+        : m_Stage(stage), m_Id(id), m_Recording(Recording()) {
+      if (m_Recording)
+        Record(m_Stage, Phase::BEGIN, m_Id);
+    }
+
+    ~Scope() {
+      if (m_Recording)
+        Record(m_Stage, Phase::END, m_Id);
+    }
+
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+  };
+
+private:
+  inline static std::atomic<bool> s_Recording = false;
+
+public:
+  static bool Recording() {
+    return s_Recording.load(std::memory_order::relaxed);
+  }
+
+  // Appends to the calling thread's ring, drops the event if it is full
+  static void Record(Stage stage, Phase phase, uint64_t id);
+
+  static const char *StageName(Stage stage);
+
+  // Starts the writer thread and the SIGUSR1 toggle, the writer sleeps until
+  // recording starts. An empty `path` writes to /tmp/ssrd-<process>-<pid>.json
+  static void Initialize(const std::string &process, const std::string &path,
+                         bool record);
+
+  // Stops recording, finishes the file and joins the writer
+  static void Shutdown();
+};
+
+#ifdef SSRD_TRACE
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(stage, ...)                                                \
+  Trace::Scope TRACE_CONCAT(traceScope, __LINE__)(                             \
+      Trace::Stage::stage __VA_OPT__(, ) __VA_ARGS__)
+#define TRACE_INSTANT(stage, id)                                               \
+  do {                                                                         \
+    if (Trace::Recording())                                                    \
+      Trace::Record(Trace::Stage::stage, Trace::Phase::INSTANT, id);           \
+  } while (0)
+#else
+#define TRACE_SCOPE(stage, ...)
+#define TRACE_INSTANT(stage, id)                                               \
+  do {                                                                         \
+  } while (0)
+#endif
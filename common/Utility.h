@@ -10,6 +10,7 @@
 #include <iostream>
 #include <pwd.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <openssl/rand.h>
 
@@ -105,16 +106,11 @@ static void writeRGBBufferToPPM(const std::string &filename,
   out.close();
 }
 
-static void writeEncodedRGBBufferToDisk(const std::string &filename,
-                                        const std::vector<uint8_t> &buffer) {
-  std::ofstream out(filename, std::ios::binary | std::ios::app);
-  if (!out.is_open()) {
-    std::cerr << "Failed to open file " << filename << std::endl;
-    return;
-  }
-
-  out.write(reinterpret_cast<const char *>(buffer.data()), buffer.size());
-  out.close();
+// CLOCK_MONOTONIC, the timebase media is stamped with and clocks are synced in
+static uint64_t monotonicNs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1'000'000'000ULL + ts.tv_nsec;
 }
 
 static std::string getHomeDirectory() {
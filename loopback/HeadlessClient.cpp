@@ -0,0 +1,273 @@
+#include "HeadlessClient.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+
+#include "H264.h"
+#include "InputBatch.h"
+#include "KnownHosts.h"
+#include "Utility.h"
+
+HeadlessClient::~HeadlessClient() {
+  StopMicrophone();
+  m_VideoQueue.Close();
+
+  if (m_VideoThread.joinable())
+    m_VideoThread.join();
+}
+
+bool HeadlessClient::Connect(const char *ip, uint16_t port,
+                             const std::string &identity,
+                             const std::string &knownHosts) {
+  m_Socket.connect(ip, port);
+  return Authenticate(identity, std::string(ip) + ":" + std::to_string(port),
+                      knownHosts);
+}
+
+bool HeadlessClient::Authenticate(const std::string &identity,
+                                  const std::string &address,
+                                  const std::string &knownHosts) {
+  std::vector<uint8_t> challenge;
+  if (m_Socket.read(challenge) <= 0)
+    return false;
+
+  m_Openssl.loadPrivateKey(identity.c_str());
+
+  // The same handshake code as ssrd-client
+  OpenSSL::Handshake handshake;
+  try {
+    handshake = m_Openssl.clientHandshake(challenge, Socket::KEY_MATERIAL_SIZE);
+  } catch (const std::exception &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return false;
+  }
+
+  if (!KnownHosts::Verify(knownHosts, address, handshake.hostKey))
+    return false;
+
+  m_Socket.send(handshake.response.data(), handshake.response.size());
+  m_Socket.encrypt(handshake.keyMaterial, false);
+
+  std::vector<uint8_t> reply;
+  return m_Socket.read(reply) > 0 && !reply.empty() && reply[0];
+}
+
+void HeadlessClient::Send(const Payload &payload) {
+  m_Socket.send(payload.buffer.data(), payload.buffer.size());
+}
+
+void HeadlessClient::Run() {
+  m_VideoThread = std::thread(&HeadlessClient::Decode, this);
+
+  std::vector<float> samples;
+  uint32_t expected = 0;
+  bool sequenced = false;
+  bool waitForKeyframe = false;
+
+  while (true) {
+    std::vector<uint8_t> buffer;
+    if (m_Socket.read(buffer) <= 0)
+      break;
+
+    uint64_t received = monotonicNs();
+
+    std::vector<uint8_t> bytes = Payload::get(0, buffer);
+    auto type =
+        std::string(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+
+    if (type == "end-session")
+      break;
+
+    if (type == "resize") {
+      VideoPacket packet;
+      packet.width = Payload::toUInt32(Payload::get(1, buffer));
+      packet.height = Payload::toUInt32(Payload::get(2, buffer));
+
+      m_VideoQueue.Push(std::move(packet));
+
+      waitForKeyframe = false;
+    }
+
+    if (type == "stream-video") {
+      VideoPacket packet;
+      packet.pts = Payload::toUInt64(Payload::get(1, buffer));
+      packet.received = received;
+      packet.data = Payload::get(2, buffer);
+
+      m_VideoBytes += buffer.size();
+      m_ReceiveLatency.Record(received - packet.pts);
+
+      if (waitForKeyframe &&
+          !H264::IsKeyframe(packet.data.data(), packet.data.size())) {
+        m_DroppedFrames++;
+        continue;
+      }
+
+      if (m_VideoQueue.TryPush(std::move(packet))) {
+        waitForKeyframe = false;
+        continue;
+      }
+
+      if (!waitForKeyframe) {
+        Payload payload;
+        payload.set("keyframe");
+        Send(payload);
+      }
+
+      waitForKeyframe = true;
+      m_DroppedFrames++;
+    }
+
+    if (type == "audio-format") {
+      m_AudioDecoder = std::make_unique<AudioDecoder>(
+          Payload::toUInt32(Payload::get(1, buffer)),
+          Payload::toUInt32(Payload::get(2, buffer)));
+      sequenced = false;
+    }
+
+    if (type == "stream-audio" && m_AudioDecoder) {
+      uint64_t pts = Payload::toUInt64(Payload::get(1, buffer));
+      uint32_t sequence = Payload::toUInt32(Payload::get(2, buffer));
+
+      if (sequenced && sequence != expected)
+        m_LostAudio += static_cast<uint32_t>(sequence - expected);
+
+      expected = sequence + 1;
+      sequenced = true;
+
+      samples.clear();
+      m_AudioDecoder->Decode(Payload::get(3, buffer), samples);
+
+      m_AudioBytes += buffer.size();
+      m_AudioPackets++;
+      m_AudioLatency.Record(monotonicNs() - pts);
+    }
+  }
+
+  m_VideoQueue.Close();
+  m_VideoThread.join();
+  StopMicrophone();
+
+  m_Socket.close(Socket::Close::SERVER);
+}
+
+void HeadlessClient::StartMicrophone(int sampleRate, int channels) {
+  if (m_Microphone.exchange(true))
+    return;
+
+  Payload format;
+  format.set("mic-format");
+  format.set(sampleRate);
+  format.set(channels);
+  Send(format);
+
+  m_MicrophoneThread = std::thread([this, sampleRate, channels]() {
+    AudioEncoder encoder(sampleRate, 32, channels, 10.0, OPUS_APPLICATION_VOIP);
+    std::vector<float> frame(static_cast<size_t>(encoder.FrameSize()) *
+                             channels);
+
+    uint64_t frameNs = encoder.FrameNs();
+    uint64_t due = monotonicNs();
+    uint64_t sample = 0;
+
+    while (m_Microphone.load()) {
+      for (size_t i = 0; i < frame.size(); i += channels, sample++) {
+        float value = 0.2f * std::sin(2.0 * M_PI * 440.0 * sample / sampleRate);
+        std::fill_n(frame.begin() + i, channels, value);
+      }
+
+      encoder.Encode(frame.data(), frame.size(),
+                     [this](const unsigned char *data, int size) {
+                       Payload payload;
+                       payload.set("mic-audio");
+                       payload.set(data, size);
+                       Send(payload);
+                       m_MicrophonePackets++;
+                     });
+
+      due += frameNs;
+      uint64_t now = monotonicNs();
+      if (due > now)
+        std::this_thread::sleep_for(std::chrono::nanoseconds(due - now));
+    }
+  });
+}
+
+void HeadlessClient::StopMicrophone() {
+  m_Microphone.store(false);
+
+  if (m_MicrophoneThread.joinable())
+    m_MicrophoneThread.join();
+}
+
+void HeadlessClient::Decode() {
+  VideoPacket packet;
+  InputBatch input;
+  uint32_t frames = 0;
+
+  while (m_VideoQueue.Pop(packet)) {
+    if (packet.width && packet.height) {
+      m_Decoder.initialize(packet.width, packet.height, Decoder::Options{});
+      continue;
+    }
+
+    std::vector<uint8_t> frame = m_Decoder.decode(packet.data);
+    if (frame.empty())
+      continue;
+
+    uint64_t now = monotonicNs();
+    m_DecodeLatency.Record(now - packet.pts);
+
+    if (!m_FirstFrameNs.load())
+      m_FirstFrameNs.store(now);
+    m_LastFrameNs.store(now);
+    m_DecodedFrames++;
+
+    // Circles the pointer so the input path carries traffic too
+    frames++;
+    input.MouseMove(0.5 + 0.25 * std::cos(frames / 30.0),
+                    0.5 + 0.25 * std::sin(frames / 30.0));
+
+    Payload message;
+    if (input.Take(now, message)) {
+      Send(message);
+      m_InputMessages++;
+    }
+  }
+}
+
+void HeadlessClient::Print() const {
+  auto ms = [](uint64_t ns) { return ns / 1e6; };
+
+  auto latency = [&](const char *name, const Metrics::Histogram &histogram) {
+    printf("  %-22s p50 %7.2f ms  p99 %7.2f ms  max %7.2f ms\n", name,
+           ms(histogram.Quantile(0.5)), ms(histogram.Quantile(0.99)),
+           ms(histogram.Max()));
+  };
+
+  uint64_t frames = m_DecodedFrames.load();
+  double seconds = (m_LastFrameNs.load() - m_FirstFrameNs.load()) / 1e9;
+  if (seconds <= 0.0)
+    seconds = 1.0;
+
+  printf("  %-22s %7.2f fps over %.1f s, %llu decoded, %llu dropped\n",
+         "video", frames > 1 ? (frames - 1) / seconds : 0.0, seconds,
+         static_cast<unsigned long long>(frames),
+         static_cast<unsigned long long>(m_DroppedFrames.load()));
+  printf("  %-22s %7.2f Mbit/s video, %7.1f kbit/s audio\n", "bandwidth",
+         m_VideoBytes * 8 / seconds / 1e6, m_AudioBytes * 8 / seconds / 1e3);
+  printf("  %-22s %llu packets, %llu lost\n", "audio",
+         static_cast<unsigned long long>(m_AudioPackets),
+         static_cast<unsigned long long>(m_LostAudio));
+  printf("  %-22s %llu messages\n", "input",
+         static_cast<unsigned long long>(m_InputMessages));
+
+  if (m_MicrophonePackets)
+    printf("  %-22s %llu packets sent\n", "microphone",
+           static_cast<unsigned long long>(m_MicrophonePackets));
+
+  latency("capture -> received", m_ReceiveLatency);
+  latency("capture -> decoded", m_DecodeLatency);
+  latency("audio capture -> dec.", m_AudioLatency);
+}
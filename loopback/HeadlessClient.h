@@ -0,0 +1,89 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "AudioDecoder.h"
+#include "AudioEncoder.h"
+#include "BoundedQueue.h"
+#include "Decoder.h"
+#include "Metrics.h"
+#include "OpenSSL.h"
+#include "Payload.h"
+#include "Socket.h"
+
+// The client side of the protocol without a window or audio device. It
+// authenticates like ssrd-client, decodes every frame and audio packet it is
+// sent and moves the pointer once per decoded frame, then throws the pictures
+// away. Latencies are measured against the server's capture stamps, which
+// only means something when both run in the same process or on one clock.
+class HeadlessClient {
+private:
+  // A resize when width and height are set, otherwise an encoded frame
+  struct VideoPacket {
+    std::vector<uint8_t> data;
+    uint64_t pts = 0;
+    uint64_t received = 0;
+    int width = 0;
+    int height = 0;
+  };
+
+private:
+  Socket m_Socket;
+  OpenSSL m_Openssl;
+  Decoder m_Decoder;
+  std::unique_ptr<AudioDecoder> m_AudioDecoder;
+
+  BoundedQueue<VideoPacket> m_VideoQueue{8};
+  std::thread m_VideoThread;
+
+  // Feeds the server's virtual microphone while set
+  std::atomic<bool> m_Microphone = false;
+  std::thread m_MicrophoneThread;
+
+  // Capture to arriving off the socket / to decoded
+  Metrics::Histogram m_ReceiveLatency;
+  Metrics::Histogram m_DecodeLatency;
+  Metrics::Histogram m_AudioLatency;
+
+  std::atomic<uint64_t> m_FirstFrameNs = 0;
+  std::atomic<uint64_t> m_LastFrameNs = 0;
+  std::atomic<uint64_t> m_DecodedFrames = 0;
+  // Dropped because decoding fell behind, up to the next keyframe
+  std::atomic<uint64_t> m_DroppedFrames = 0;
+  uint64_t m_VideoBytes = 0;
+  uint64_t m_AudioBytes = 0;
+  uint64_t m_AudioPackets = 0;
+  uint64_t m_LostAudio = 0;
+  uint64_t m_InputMessages = 0;
+  uint64_t m_MicrophonePackets = 0;
+
+public:
+  HeadlessClient() = default;
+  ~HeadlessClient();
+
+  // Connects and authenticates with the private key at `identity`, pinning
+  // the server's host key in `knownHosts`
+  bool Connect(const char *ip, uint16_t port, const std::string &identity,
+               const std::string &knownHosts);
+
+  // Streams a tone into the server's virtual microphone in 10 ms Opus
+  // packets, paced like ssrd-client's microphone, until Run() returns
+  void StartMicrophone(int sampleRate = 48000, int channels = 1);
+
+  // Receives until the server ends the session or the connection drops
+  void Run();
+
+  uint64_t DecodedFrames() const { return m_DecodedFrames.load(); }
+
+  void Print() const;
+
+private:
+  bool Authenticate(const std::string &identity, const std::string &address,
+                    const std::string &knownHosts);
+  void Decode();
+  void StopMicrophone();
+  void Send(const Payload &payload);
+};
@@ -0,0 +1,154 @@
+#include "SyntheticSource.h"
+
+#include <chrono>
+#include <cmath>
+#include <numbers>
+
+#include "SyntheticFrame.h"
+#include "Utility.h"
+
+// PipeWire's usual audio quantum
+constexpr auto AUDIO_CHUNK = std::chrono::milliseconds(10);
+
+SyntheticSource::SyntheticSource(const Options &options)
+    : m_Options(options) {}
+
+SyntheticSource::~SyntheticSource() {
+  EndSession();
+
+  if (m_Thread.joinable())
+    m_Thread.join();
+}
+
+void SyntheticSource::BeginSession() {
+  if (m_Active.load())
+    return;
+
+  // Left over from the previous session, it has stopped on its own
+  if (m_Thread.joinable())
+    m_Thread.join();
+
+  m_Active.store(true);
+  m_Thread = std::thread(&SyntheticSource::Run, this);
+}
+
+void SyntheticSource::EndSession() { m_Active.store(false); }
+
+bool SyntheticSource::IsRemoteDesktopActive() { return m_Active.load(); }
+
+bool SyntheticSource::IsSessionActive() { return m_Active.load(); }
+
+void SyntheticSource::OnStreamVideo(const VideoStreamCallback &callback) {
+  m_OnStreamVideo = callback;
+}
+
+void SyntheticSource::OnStreamAudio(const AudioStreamCallback &callback) {
+  m_OnStreamAudio = callback;
+}
+
+void SyntheticSource::OnRawVideo(const RawVideoCallback &callback) {
+  m_OnRawVideo = callback;
+}
+
+void SyntheticSource::OnResize(const ResizeCallback &callback) {
+  m_OnResize = callback;
+}
+
+void SyntheticSource::OnSessionConnected(
+    const std::function<void()> &callback) {
+  m_OnSessionConnected = callback;
+}
+
+void SyntheticSource::OnSessionDisconnected(
+    const std::function<void()> &callback) {
+  m_OnSessionDisconnected = callback;
+}
+
+void SyntheticSource::Keyboard(int, int, int) { m_InputEvents++; }
+
+void SyntheticSource::Mouse(double, double) { m_InputEvents++; }
+
+void SyntheticSource::MouseMotion(int, int) { m_InputEvents++; }
+
+void SyntheticSource::MouseButton(int, int, int) { m_InputEvents++; }
+
+void SyntheticSource::MouseScroll(int, int) { m_InputEvents++; }
+
+void SyntheticSource::AfterInput(std::function<void()> callback) {
+  callback();
+}
+
+void SyntheticSource::Run() {
+  using clock = std::chrono::steady_clock;
+
+  const Options &options = m_Options;
+
+  SyntheticFrame frame(options.width, options.height, options.format);
+  std::vector<uint8_t> framebuffer(static_cast<size_t>(options.width) *
+                                   options.height * 3);
+
+  uint32_t chunkFrames = options.sampleRate * AUDIO_CHUNK.count() / 1000;
+  std::vector<float> samples(chunkFrames * options.channels);
+  uint64_t sampleIndex = 0;
+
+  auto frameInterval =
+      std::chrono::nanoseconds(1'000'000'000 / options.frameRate);
+  auto nextFrame = clock::now();
+  auto nextAudio = nextFrame;
+  uint32_t index = 0;
+
+  if (m_OnSessionConnected)
+    m_OnSessionConnected();
+
+  if (m_OnResize)
+    m_OnResize(options.width, options.height);
+
+  while (m_Active.load()) {
+    auto now = clock::now();
+
+    if (now >= nextAudio) {
+      // 440 Hz at -14 dBFS, something Opus has to actually encode
+      for (uint32_t i = 0; i < chunkFrames; i++, sampleIndex++) {
+        float value = 0.2f * std::sin(2.0 * std::numbers::pi * 440.0 *
+                                      sampleIndex / options.sampleRate);
+        for (uint32_t channel = 0; channel < options.channels; channel++)
+          samples[i * options.channels + channel] = value;
+      }
+
+      Chunk chunk = {samples, chunkFrames, options.sampleRate,
+                     options.channels, 32};
+      if (m_OnStreamAudio)
+        m_OnStreamAudio(chunk, monotonicNs());
+
+      nextAudio += AUDIO_CHUNK;
+    }
+
+    if (now >= nextFrame) {
+      const uint8_t *raw = frame.Render(index++);
+      writeTobuffer(&framebuffer, raw, options.width, options.height,
+                    options.format);
+
+      uint64_t time = monotonicNs();
+
+      if (m_OnRawVideo)
+        m_OnRawVideo(raw, options.width, options.height, options.format, time);
+
+      if (m_OnStreamVideo)
+        m_OnStreamVideo(framebuffer, time);
+
+      // A compositor skips frames rather than catching up on them
+      nextFrame += frameInterval;
+      now = clock::now();
+      if (nextFrame <= now) {
+        auto missed = (now - nextFrame) / frameInterval + 1;
+        m_MissedFrames += missed;
+        nextFrame += missed * frameInterval;
+      }
+    }
+
+    std::this_thread::sleep_until(std::min(nextFrame, nextAudio));
+  }
+
+  if (m_OnSessionDisconnected)
+    m_OnSessionDisconnected();
+}
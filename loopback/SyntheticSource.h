@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+
+#include "MediaSource.h"
+
+// Stands in for R2 without a portal, PipeWire or a display. Renders
+// SyntheticFrame content and a sine tone on one thread at a fixed rate and
+// hands them over like PipeWire does, input is only counted.
+class SyntheticSource : public MediaSource {
+public:
+  struct Options {
+    int width = 1920;
+    int height = 1080;
+    spa_video_format format = SPA_VIDEO_FORMAT_BGRx;
+    int frameRate = 60;
+    uint32_t sampleRate = 48000;
+    uint32_t channels = 2;
+  };
+
+private:
+  Options m_Options;
+
+  std::atomic<bool> m_Active = false;
+  std::thread m_Thread;
+
+  VideoStreamCallback m_OnStreamVideo = nullptr;
+  AudioStreamCallback m_OnStreamAudio = nullptr;
+  RawVideoCallback m_OnRawVideo = nullptr;
+  ResizeCallback m_OnResize = nullptr;
+  std::function<void()> m_OnSessionConnected = nullptr;
+  std::function<void()> m_OnSessionDisconnected = nullptr;
+
+  // Frames the source fell behind on, the server was too slow to take them
+  std::atomic<uint64_t> m_MissedFrames = 0;
+  std::atomic<uint64_t> m_InputEvents = 0;
+
+public:
+  explicit SyntheticSource(const Options &options);
+  ~SyntheticSource() override;
+
+  void BeginSession() override;
+  // Safe from a callback, the thread finishes the frame it is on
+  void EndSession() override;
+
+  bool IsRemoteDesktopActive() override;
+  bool IsSessionActive() override;
+
+  void OnStreamVideo(const VideoStreamCallback &callback) override;
+  void OnStreamAudio(const AudioStreamCallback &callback) override;
+  void OnRawVideo(const RawVideoCallback &callback) override;
+  void OnResize(const ResizeCallback &callback) override;
+  void OnSessionConnected(const std::function<void()> &callback) override;
+  void OnSessionDisconnected(const std::function<void()> &callback) override;
+
+  void Keyboard(int key, int action, int mods) override;
+  void Mouse(double x, double y) override;
+  void MouseMotion(int dx, int dy) override;
+  void MouseButton(int button, int action, int mods) override;
+  void MouseScroll(int x, int y) override;
+
+  // Nothing is queued, runs `callback` right away
+  void AfterInput(std::function<void()> callback) override;
+
+  uint64_t MissedFrames() const { return m_MissedFrames.load(); }
+  uint64_t InputEvents() const { return m_InputEvents.load(); }
+
+private:
+  void Run();
+};
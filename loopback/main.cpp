@@ -0,0 +1,219 @@
+#include <arpa/inet.h>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <filesystem>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+
+#include "CLI11.h"
+#include "HeadlessClient.h"
+#include "Metrics.h"
+#include "Server.h"
+#include "SyntheticSource.h"
+#include "Trace.h"
+
+namespace fs = std::filesystem;
+
+// Removes the throwaway keys however the run ends
+struct TemporaryDirectory {
+  fs::path path;
+
+  explicit TemporaryDirectory(fs::path directory) : path(std::move(directory)) {}
+
+  ~TemporaryDirectory() {
+    std::error_code error;
+    fs::remove_all(path, error);
+  }
+};
+
+// Serve() blocks in accept until a client shows up. A connection that closes
+// straight away fails the handshake and lets it return.
+static void wakeServer(uint16_t port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return;
+
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  ::connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+  close(fd);
+}
+
+// A throwaway identity so the run goes through the real authentication
+static void createKeys(const fs::path &directory) {
+  EVP_PKEY *key = EVP_RSA_gen(2048);
+  if (!key)
+    throw std::runtime_error("Failed to generate a key");
+
+  fs::create_directories(directory / "authorized_keys");
+
+  FILE *privateFile = fopen((directory / "id_rsa").c_str(), "w");
+  FILE *publicFile =
+      fopen((directory / "authorized_keys" / "id_rsa.pub").c_str(), "w");
+
+  bool written = privateFile && publicFile &&
+                 PEM_write_PrivateKey(privateFile, key, nullptr, nullptr, 0,
+                                      nullptr, nullptr) == 1 &&
+                 PEM_write_PUBKEY(publicFile, key) == 1;
+
+  if (privateFile)
+    fclose(privateFile);
+  if (publicFile)
+    fclose(publicFile);
+  EVP_PKEY_free(key);
+
+  if (!written)
+    throw std::runtime_error("Failed to write keys to " + directory.string());
+}
+
+int main(int argc, char *argv[]) {
+  signal(SIGPIPE, SIG_IGN);
+
+  CLI::App app{"Runs ssrd-server's pipeline on synthetic content and a "
+               "headless client over loopback"};
+
+  SyntheticSource::Options options;
+  std::string size = "1920x1080";
+  std::string format = "bgrx";
+  uint16_t port = 1999;
+  double seconds = 10.0;
+  std::string tracePath;
+  bool microphone = false;
+
+  const std::map<std::string, spa_video_format> formats = {
+      {"rgbx", SPA_VIDEO_FORMAT_RGBx},
+      {"bgrx", SPA_VIDEO_FORMAT_BGRx},
+      {"xrgb", SPA_VIDEO_FORMAT_xRGB},
+      {"xbgr", SPA_VIDEO_FORMAT_xBGR},
+  };
+
+  app.add_option("--size", size, "Frame size, e.g. 1280x720");
+  app.add_option("--format", format, "Capture format: rgbx, bgrx, xrgb, xbgr")
+      ->check(CLI::IsMember(formats));
+  app.add_option("--fps", options.frameRate, "Frames the source offers per "
+                                             "second")
+      ->check(CLI::Range(1, 1000));
+  app.add_option("--seconds", seconds, "How long to stream")
+      ->check(CLI::PositiveNumber);
+  app.add_option("--port", port, "Loopback port the server listens on");
+  app.add_option("--trace", tracePath,
+                 "Record a Chrome trace of both sides to this file");
+  app.add_flag("--microphone", microphone,
+               "Stream a tone into the server's virtual microphone, needs a "
+               "running PipeWire daemon");
+
+  CLI11_PARSE(app, argc, argv);
+
+  if (sscanf(size.c_str(), "%dx%d", &options.width, &options.height) != 2 ||
+      options.width <= 0 || options.height <= 0) {
+    fprintf(stderr, "Invalid size %s\n", size.c_str());
+    return 1;
+  }
+  options.format = formats.at(format);
+
+  Trace::Initialize("loopback", tracePath, !tracePath.empty());
+
+  TemporaryDirectory temporary(fs::temp_directory_path() /
+                               ("ssrd-loopback-" + std::to_string(getpid())));
+  const fs::path &keys = temporary.path;
+
+  try {
+    createKeys(keys);
+  } catch (const std::exception &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+
+  auto source = std::make_unique<SyntheticSource>(options);
+  SyntheticSource *synthetic = source.get();
+
+  Server server(std::move(source));
+  server.AuthorizeKeys(keys / "authorized_keys");
+  server.HostKey(keys / "host_key");
+
+  std::thread serverThread([&]() {
+    try {
+      server.Serve(port);
+    } catch (const std::exception &e) {
+      fprintf(stderr, "Server: %s\n", e.what());
+    }
+  });
+
+  // The server may not be listening yet, a failed connect uses up the socket
+  std::unique_ptr<HeadlessClient> client;
+  bool authenticated = false;
+  for (int attempt = 0; attempt < 50 && !client; attempt++) {
+    try {
+      client = std::make_unique<HeadlessClient>();
+      authenticated = client->Connect("127.0.0.1", port, keys / "id_rsa",
+                                      keys / "known_hosts");
+    } catch (const std::exception &) {
+      client.reset();
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+  }
+
+  if (!client || !authenticated) {
+    if (client)
+      fprintf(stderr, "Authentication failed\n");
+    else
+      fprintf(stderr, "Failed to connect to the server on port %u\n", port);
+
+    client.reset();
+    wakeServer(port);
+    serverThread.join();
+    return 1;
+  }
+
+  if (microphone)
+    client->StartMicrophone();
+
+  std::thread clientThread([&]() { client->Run(); });
+
+  std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+
+  // Ends it like a closed portal session, the server tells the client
+  synthetic->EndSession();
+
+  clientThread.join();
+  serverThread.join();
+
+  Metrics::Histogram &encodeTime =
+      Metrics::Get().GetHistogram("ssrd_video_encode_seconds");
+
+  printf("%dx%d %s at %d fps\n", options.width, options.height,
+         format.c_str(), options.frameRate);
+  client->Print();
+  printf("  %-22s p50 %7.2f ms  p99 %7.2f ms, %llu source frames missed\n",
+         "server encode", encodeTime.Quantile(0.5) / 1e6,
+         encodeTime.Quantile(0.99) / 1e6,
+         static_cast<unsigned long long>(synthetic->MissedFrames()));
+  printf("  %-22s %llu events injected\n", "server input",
+         static_cast<unsigned long long>(synthetic->InputEvents()));
+
+  if (microphone) {
+    uint64_t samples =
+        Metrics::Get().GetCounter("ssrd_microphone_samples_total").Value();
+    uint64_t underruns =
+        Metrics::Get().GetCounter("ssrd_microphone_underruns_total").Value();
+
+    if (samples)
+      printf("  %-22s %llu samples queued, %llu underruns\n",
+             "server microphone", static_cast<unsigned long long>(samples),
+             static_cast<unsigned long long>(underruns));
+    else
+      printf("  %-22s no virtual source, is PipeWire running?\n",
+             "server microphone");
+  }
+
+  return client->DecodedFrames() ? 0 : 1;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <functional>
+#include <stdint.h>
+#include <vector>
+
+#include <spa/param/video/raw.h>
+
+struct Chunk {
+  std::vector<float> &buffer;
+  uint32_t frames;
+  uint32_t sampleRate;
+  uint32_t channels;
+  uint32_t bits;
+};
+
+using VideoStreamCallback =
+    std::function<void(std::vector<uint8_t> buffer, uint64_t time)>;
+using AudioStreamCallback =
+    std::function<void(const Chunk &chunk, uint64_t time)>;
+using ResizeCallback = std::function<void(int width, int height)>;
+// The frame as it was captured, only valid during the call
+using RawVideoCallback =
+    std::function<void(const uint8_t *frame, int width, int height,
+                       spa_video_format format, uint64_t time)>;
+
+// What the server streams from and injects input into. R2 is the desktop
+// through the portal and PipeWire, loopback tests use a synthetic one.
+// Video, audio and resize callbacks all arrive on one thread, resize before
+// the first frame of a new size.
+class MediaSource {
+public:
+  virtual ~MediaSource() = default;
+
+  virtual void BeginSession() = 0;
+  virtual void EndSession() = 0;
+
+  virtual bool IsRemoteDesktopActive() = 0;
+  virtual bool IsSessionActive() = 0;
+
+  virtual void OnStreamVideo(const VideoStreamCallback &callback) = 0;
+  virtual void OnStreamAudio(const AudioStreamCallback &callback) = 0;
+
+  // Runs before OnStreamVideo for every captured frame, set it before the
+  // session starts
+  virtual void OnRawVideo(const RawVideoCallback &callback) = 0;
+
+  virtual void OnResize(const ResizeCallback &callback) = 0;
+
+  virtual void OnSessionConnected(const std::function<void()> &callback) = 0;
+  virtual void OnSessionDisconnected(const std::function<void()> &callback) = 0;
+
+  virtual void Keyboard(int key, int action, int mods) = 0;
+
+  virtual void Mouse(double x, double y) = 0;
+
+  // Relative motion in pixels, for clients with the pointer locked
+  virtual void MouseMotion(int dx, int dy) = 0;
+
+  virtual void MouseButton(int button, int action, int mods) = 0;
+
+  virtual void MouseScroll(int x, int y) = 0;
+
+  // Runs `callback` once every event queued before it has been injected
+  virtual void AfterInput(std::function<void()> callback) = 0;
+};
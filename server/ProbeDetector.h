@@ -0,0 +1,121 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <stdint.h>
+#include <vector>
+
+// Finds the first captured frame that actually shows a probe's pointer move,
+// so the capture stage includes the compositor drawing it. The area around
+// the pointer's destination is remembered from the last frame captured before
+// the move was injected, the first frame captured after it where that area
+// differs gets the marker. Needs the cursor embedded in the capture. Only
+// used from the thread frames arrive on.
+class ProbeDetector {
+private:
+  // Square around the hotspot, cursors are drawn down and right of it
+  static constexpr int BOX = 64;
+  static constexpr int HOTSPOT = 16;
+
+  // The last frame, kept while detecting since the screen may not produce
+  // one between the probe arriving and its injection
+  std::vector<uint8_t> m_Last;
+  int m_Width = 0;
+  int m_Height = 0;
+
+  uint32_t m_Id = 0;
+  uint64_t m_Injected = 0;
+  // Where the probe moved the pointer, normalized
+  double m_X = 0.0;
+  double m_Y = 0.0;
+  int m_BoxX = 0;
+  int m_BoxY = 0;
+  int m_BoxWidth = 0;
+  int m_BoxHeight = 0;
+  std::vector<uint8_t> m_Reference;
+  std::vector<uint8_t> m_Box;
+
+  void Place(double x, double y) {
+    int px = static_cast<int>(x * m_Width) - HOTSPOT;
+    int py = static_cast<int>(y * m_Height) - HOTSPOT;
+    m_BoxX = std::clamp(px, 0, std::max(0, m_Width - BOX));
+    m_BoxY = std::clamp(py, 0, std::max(0, m_Height - BOX));
+    m_BoxWidth = std::min(BOX, m_Width);
+    m_BoxHeight = std::min(BOX, m_Height);
+  }
+
+  void Extract(const uint8_t *rgb, std::vector<uint8_t> &box) const {
+    size_t rowBytes = static_cast<size_t>(m_BoxWidth) * 3;
+    box.resize(rowBytes * m_BoxHeight);
+
+    for (int y = 0; y < m_BoxHeight; y++)
+      std::memcpy(box.data() + y * rowBytes,
+                  rgb + (static_cast<size_t>(m_BoxY + y) * m_Width + m_BoxX) *
+                            3,
+                  rowBytes);
+  }
+
+public:
+  // A probe moved the pointer to normalized `x`, `y`. The newest frame seen
+  // so far is its reference, or the next one if there is none yet.
+  void Arm(uint32_t id, double x, double y) {
+    m_Id = id;
+    m_Injected = 0;
+    m_X = x;
+    m_Y = y;
+    m_Reference.clear();
+
+    if (m_Last.empty())
+      return;
+
+    Place(x, y);
+    Extract(m_Last.data(), m_Reference);
+  }
+
+  void Injected(uint32_t id, uint64_t ns) {
+    if (id == m_Id)
+      m_Injected = ns;
+  }
+
+  // Call for every RGB24 frame in capture order. Returns the probe id when
+  // this is the first frame showing its move, 0 otherwise.
+  uint32_t Check(const uint8_t *rgb, int width, int height, uint64_t captured) {
+    // A resize moves everything, the probe times out on the client
+    if (width != m_Width || height != m_Height) {
+      m_Width = width;
+      m_Height = height;
+      m_Last.clear();
+
+      if (!m_Reference.empty())
+        m_Id = 0;
+    }
+
+    uint32_t found = 0;
+
+    if (m_Id) {
+      Place(m_X, m_Y);
+      Extract(rgb, m_Box);
+
+      if (!m_Injected || captured < m_Injected) {
+        // Still from before the move
+        m_Reference.swap(m_Box);
+      } else if (m_Reference.empty()) {
+        // Nothing captured before the move to compare with
+        m_Id = 0;
+      } else if (m_Box != m_Reference) {
+        found = m_Id;
+        m_Id = 0;
+      }
+    }
+
+    m_Last.assign(rgb, rgb + static_cast<size_t>(width) * height * 3);
+    return found;
+  }
+
+  // Stops keeping frames until the next probe arms it
+  void Reset() {
+    m_Id = 0;
+    m_Last.clear();
+    m_Last.shrink_to_fit();
+  }
+};
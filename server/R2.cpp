@@ -5,8 +5,18 @@
 
 #include "Helpers.h"
 #include "Keys.h"
+#include "Metrics.h"
+#include "Trace.h"
 #include "Utility.h"
 
+static Metrics::Histogram &captureConvertTime = Metrics::Get().GetHistogram(
+    "ssrd_capture_convert_seconds",
+    "PipeWire buffer to packed RGB conversion per frame");
+static Metrics::Histogram &captureInterval = Metrics::Get().GetHistogram(
+    "ssrd_capture_interval_seconds", "Time between captured frames");
+static Metrics::Counter &capturedFrames = Metrics::Get().GetCounter(
+    "ssrd_capture_frames_total", "Frames PipeWire delivered");
+
 R2::R2() : m_Running(true), m_Thread(&R2::Start, this) {}
 
 R2::~R2() { Stop(); }
@@ -16,32 +26,37 @@ void R2::Stop() {
     return;
 
   EndSession();
-  m_CV.notify_one();
+
+  // Behind the release so the session closes before the loop ends
+  Post([this]() { g_main_loop_quit(m_UserData.g.loop); });
   m_Thread.join();
 }
 
 void R2::EndSession() {
-  if (m_UserData.xdp.session &&
-      xdp_session_get_session_state(m_UserData.xdp.session) ==
-          XdpSessionState::XDP_SESSION_ACTIVE) {
-    for (uint32_t key : m_PressedKeyboardKeys)
-      xdp_session_keyboard_key(m_UserData.xdp.session, FALSE, glfwToXdpKey(key),
-                               XDP_KEY_RELEASED);
-
-    for (uint32_t mod : m_PressedKeyboardMods)
-      xdp_session_keyboard_key(m_UserData.xdp.session, FALSE, glfwToXdpKey(mod),
-                               XDP_KEY_RELEASED);
-
-    for (uint32_t button : m_PressedMouseButtons)
-      xdp_session_pointer_button(m_UserData.xdp.session,
-                                 glfwToXdpMouseButton(button),
-                                 XDP_BUTTON_RELEASED);
-
-    m_PressedKeyboardKeys.clear();
-    m_PressedKeyboardMods.clear();
-    m_PressedMouseButtons.clear();
-    xdp_session_close(m_UserData.xdp.session);
-  }
+  // Behind any input still queued so nothing is pressed after the release
+  Post([this]() {
+    if (m_UserData.xdp.session &&
+        xdp_session_get_session_state(m_UserData.xdp.session) ==
+            XdpSessionState::XDP_SESSION_ACTIVE) {
+      for (uint32_t key : m_PressedKeyboardKeys)
+        xdp_session_keyboard_key(m_UserData.xdp.session, FALSE,
+                                 glfwToXdpKey(key), XDP_KEY_RELEASED);
+
+      for (uint32_t mod : m_PressedKeyboardMods)
+        xdp_session_keyboard_key(m_UserData.xdp.session, FALSE,
+                                 glfwToXdpKey(mod), XDP_KEY_RELEASED);
+
+      for (uint32_t button : m_PressedMouseButtons)
+        xdp_session_pointer_button(m_UserData.xdp.session,
+                                   glfwToXdpMouseButton(button),
+                                   XDP_BUTTON_RELEASED);
+
+      m_PressedKeyboardKeys.clear();
+      m_PressedKeyboardMods.clear();
+      m_PressedMouseButtons.clear();
+      xdp_session_close(m_UserData.xdp.session);
+    }
+  });
 
   m_UserData.isRunning.store(false);
 }
@@ -76,6 +91,10 @@ void R2::OnStreamVideo(const VideoStreamCallback &callback) {
   m_UserData.onStreamVideo = callback;
 }
 
+void R2::OnRawVideo(const RawVideoCallback &callback) {
+  m_UserData.onRawVideo = callback;
+}
+
 void R2::OnStreamAudio(const AudioStreamCallback &callback) {
   m_UserData.onStreamAudio = callback;
 }
@@ -103,56 +122,120 @@ bool R2::IsSessionActive() {
 }
 
 void R2::Keyboard(int key, int action, int mods) {
-  m_PressedKeyboardKeys.insert(key);
-  m_PressedKeyboardMods.insert(mods);
-  xdp_session_keyboard_key(m_UserData.xdp.session, FALSE, glfwToXdpKey(mods),
-                           GLFWToXDPKeyState(action));
-  xdp_session_keyboard_key(m_UserData.xdp.session, FALSE, glfwToXdpKey(key),
-                           GLFWToXDPKeyState(action));
+  Post([this, key, action, mods]() {
+    m_PressedKeyboardKeys.insert(key);
+    m_PressedKeyboardMods.insert(mods);
+    xdp_session_keyboard_key(m_UserData.xdp.session, FALSE, glfwToXdpKey(mods),
+                             GLFWToXDPKeyState(action));
+    xdp_session_keyboard_key(m_UserData.xdp.session, FALSE, glfwToXdpKey(key),
+                             GLFWToXDPKeyState(action));
+  });
 }
 
 void R2::Mouse(double x, double y) {
-  if (!m_UserData.pw.videoStream.stream)
-    return;
+  Post([this, x, y]() {
+    if (!m_UserData.pw.videoStream.stream)
+      return;
 
-  int width = m_UserData.videoFormat.info.raw.size.width;
-  int height = m_UserData.videoFormat.info.raw.size.height;
+    int width = m_UserData.videoFormat.info.raw.size.width;
+    int height = m_UserData.videoFormat.info.raw.size.height;
 
-  double positionX = width * x;
-  double positionY = height * y;
+    double positionX = width * x;
+    double positionY = height * y;
 
-  xdp_session_pointer_position(m_UserData.xdp.session, m_UserData.targetId,
-                               positionX, positionY);
+    xdp_session_pointer_position(m_UserData.xdp.session, m_UserData.targetId,
+                                 positionX, positionY);
+  });
+}
+
+void R2::MouseMotion(int dx, int dy) {
+  Post([this, dx, dy]() {
+    if (!m_UserData.xdp.session)
+      return;
+
+    xdp_session_pointer_motion(m_UserData.xdp.session, dx, dy);
+  });
 }
 
 void R2::MouseButton(int button, int action, int mods) {
-  m_PressedMouseButtons.insert(button);
-  xdp_session_pointer_button(m_UserData.xdp.session,
-                             glfwToXdpMouseButton(button),
-                             glfwToXdpMouseButtonState(action));
+  Post([this, button, action]() {
+    m_PressedMouseButtons.insert(button);
+    xdp_session_pointer_button(m_UserData.xdp.session,
+                               glfwToXdpMouseButton(button),
+                               glfwToXdpMouseButtonState(action));
+  });
 }
 
 void R2::MouseScroll(int x, int y) {
-  // Swap axes, XDP interprets them inverted
-  if (y != 0)
-    xdp_session_pointer_axis_discrete(
-        m_UserData.xdp.session, XdpDiscreteAxis::XDP_AXIS_HORIZONTAL_SCROLL,
-        -y);
-
-  if (x != 0)
-    xdp_session_pointer_axis_discrete(
-        m_UserData.xdp.session, XdpDiscreteAxis::XDP_AXIS_VERTICAL_SCROLL, -x);
+  Post([this, x, y]() {
+    // Swap axes, XDP interprets them inverted
+    if (y != 0)
+      xdp_session_pointer_axis_discrete(
+          m_UserData.xdp.session, XdpDiscreteAxis::XDP_AXIS_HORIZONTAL_SCROLL,
+          -y);
+
+    if (x != 0)
+      xdp_session_pointer_axis_discrete(
+          m_UserData.xdp.session, XdpDiscreteAxis::XDP_AXIS_VERTICAL_SCROLL,
+          -x);
+  });
 }
 
-void R2::Start() {
+void R2::AfterInput(std::function<void()> callback) {
+  Post(std::move(callback));
+}
 
-  Initialize();
+void R2::Post(std::function<void()> task) {
+  GMainContext *context = nullptr;
+
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Queue.push(std::move(task));
+
+    // Before Initialize the task waits, it is scheduled with the rest there
+    if (!m_UserData.g.context || m_DispatchPending)
+      return;
+
+    context = m_UserData.g.context;
+    m_DispatchPending = true;
+  }
+
+  ScheduleDispatch(context);
+}
+
+void R2::ScheduleDispatch(GMainContext *context) {
+  // One source drains everything queued until it runs, the portal calls are
+  // D-Bus round trips and belong on the thread that owns the GLib context.
+  // Attached rather than invoked, so it never runs on the posting thread
+  // before the loop owns the context.
+  GSource *source = g_idle_source_new();
+  g_source_set_priority(source, G_PRIORITY_HIGH);
+  g_source_set_callback(source, DispatchInput, this, nullptr);
+  g_source_attach(source, context);
+  g_source_unref(source);
+}
 
-  while (true) {
-    std::unique_lock<std::mutex> lock(m_Mutex);
-    m_CV.wait(lock, [&] { return !m_Running; });
+gboolean R2::DispatchInput(gpointer userData) {
+  auto *self = static_cast<R2 *>(userData);
+  std::queue<std::function<void()>> batch;
+
+  {
+    std::lock_guard<std::mutex> lock(self->m_Mutex);
+    std::swap(batch, self->m_Queue);
+    self->m_DispatchPending = false;
+  }
+
+  while (!batch.empty()) {
+    batch.front()();
+    batch.pop();
   }
 
+  return G_SOURCE_REMOVE;
+}
+
+void R2::Start() {
+  // Returns once Stop quits the GLib loop
+  Initialize();
   Deinitialize();
 }
 
@@ -178,14 +261,32 @@ void R2::Initialize() {
   if (!m_UserData.g.loop)
     throw std::runtime_error("Failed to create glib loop");
 
-  m_UserData.g.context = g_main_loop_get_context(m_UserData.g.loop);
-  if (!m_UserData.g.context)
+  GMainContext *context = g_main_loop_get_context(m_UserData.g.loop);
+  if (!context)
     throw std::runtime_error("Failed to get glib loop context");
 
+  // Input posted before now runs as soon as the loop does
+  bool schedule = false;
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_UserData.g.context = context;
+    schedule = !m_Queue.empty();
+    m_DispatchPending = schedule;
+  }
+
+  if (schedule)
+    ScheduleDispatch(context);
+
   g_main_loop_run(m_UserData.g.loop);
 }
 
 void R2::Deinitialize() {
+  // Input posted from here on is never run
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_UserData.g.context = nullptr;
+  }
+
   if (m_UserData.g.loop && g_main_loop_is_running(m_UserData.g.loop))
     g_main_loop_quit(m_UserData.g.loop);
 
@@ -224,7 +325,6 @@ void R2::Deinitialize() {
   m_UserData.pw.context = nullptr;
   m_UserData.pw.loop = nullptr;
   m_UserData.g.loop = nullptr;
-  m_UserData.g.context = nullptr;
   m_UserData.g.sessionClosedHandle = 0;
   m_UserData.xdp.session = nullptr;
   m_UserData.xdp.portal = nullptr;
@@ -351,7 +451,10 @@ void R2::OnSessionStart(GObject *source_object, GAsyncResult *res,
     struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
     const struct spa_pod *params[1];
 
+    // Opus encodes 48 kHz natively, asking for it lets PipeWire do any
+    // conversion and saves us a resample
     struct spa_audio_info_raw info = {.format = SPA_AUDIO_FORMAT_F32,
+                                      .rate = 48000,
                                       .channels = 2};
 
     params[0] = spa_format_audio_raw_build(&b, SPA_PARAM_EnumFormat, &info);
@@ -479,12 +582,31 @@ void R2::OnVideoStreamProcess(void *userData) {
   int width = data->videoFormat.info.raw.size.width;
   int height = data->videoFormat.info.raw.size.height;
 
-  writeTobuffer(&data->framebuffer, frame, width, height,
-                data->videoFormat.info.raw.format);
+  // Audio and video are stamped with the same clock so the client can sync
+  // them, and relate them to its own clock through ping/pong. Like audio the
+  // frame is stamped when it arrived, before the conversion
+  uint64_t start = monotonicNs();
+
+  {
+    TRACE_SCOPE(CAPTURE);
+    writeTobuffer(&data->framebuffer, frame, width, height,
+                  data->videoFormat.info.raw.format);
+  }
+
+  // Only the PipeWire thread gets here
+  static uint64_t lastCapture = 0;
+  if (lastCapture)
+    captureInterval.Record(start - lastCapture);
+  lastCapture = start;
 
-  uint64_t time = pw_stream_get_nsec(data->pw.videoStream.stream);
+  captureConvertTime.Record(monotonicNs() - start);
+  capturedFrames.Add();
 
-  data->onStreamVideo(data->framebuffer, time);
+  if (data->onRawVideo)
+    data->onRawVideo(frame, width, height, data->videoFormat.info.raw.format,
+                     start);
+
+  data->onStreamVideo(data->framebuffer, start);
 
   pw_stream_queue_buffer(data->pw.videoStream.stream, b);
 }
@@ -512,6 +634,11 @@ void R2::OnAudioStreamProcess(void *userData) {
   std::vector<float> raw(sampleCount);
   std::memcpy(raw.data(), samples, sampleCount * sizeof(float));
 
+  // Capture time of the first frame in the chunk
+  uint64_t time =
+      monotonicNs() - (static_cast<uint64_t>(frames) * 1'000'000'000ULL) /
+                          data->audioFormat.info.raw.rate;
+
   if (data->onStreamAudio)
     data->onStreamAudio(
         Chunk{
@@ -521,7 +648,7 @@ void R2::OnAudioStreamProcess(void *userData) {
             .channels = channels,
             .bits = spa_audio_format_depth(data->audioFormat.info.raw.format),
         },
-        b->time);
+        time);
 
   pw_stream_queue_buffer(data->pw.audioStream.stream, b);
 }
@@ -1,5 +1,4 @@
 #include <atomic>
-#include <condition_variable>
 #include <functional>
 #include <mutex>
 #include <queue>
@@ -14,13 +13,7 @@
 #include <spa/param/audio/format-utils.h>
 #include <spa/param/video/format-utils.h>
 
-struct Chunk {
-  std::vector<float> &buffer;
-  uint32_t frames;
-  uint32_t sampleRate;
-  uint32_t channels;
-  uint32_t bits;
-};
+#include "MediaSource.h"
 
 struct Stream {
   pw_stream *stream = nullptr;
@@ -49,12 +42,6 @@ struct XDP {
   XdpPortal *portal = nullptr;
 };
 
-using VideoStreamCallback =
-    std::function<void(std::vector<uint8_t> buffer, uint64_t time)>;
-using AudioStreamCallback =
-    std::function<void(const Chunk &chunk, uint64_t time)>;
-using ResizeCallback = std::function<void(int width, int height)>;
-
 struct UserData {
   PW pw = {};
   Glib g = {};
@@ -71,6 +58,7 @@ struct UserData {
   ResizeCallback onResize = nullptr;
 
   VideoStreamCallback onStreamVideo = nullptr;
+  RawVideoCallback onRawVideo = nullptr;
   AudioStreamCallback onStreamAudio = nullptr;
 
   std::function<void()> onSessionConnected = nullptr;
@@ -84,13 +72,15 @@ struct PipewireGSource {
   UserData *userData;
 };
 
-class R2 {
+class R2 : public MediaSource {
 private:
   std::atomic<bool> m_Running;
   std::thread m_Thread;
   std::mutex m_Mutex;
-  std::condition_variable m_CV;
+  // Input waiting to be injected on the GLib thread, guarded by m_Mutex like
+  // m_UserData.g.context. Held back until the context exists.
   std::queue<std::function<void()>> m_Queue;
+  bool m_DispatchPending = false;
 
   UserData m_UserData;
   std::set<uint32_t> m_PressedKeyboardKeys;
@@ -102,32 +92,44 @@ public:
   ~R2();
 
   void Stop();
-  void EndSession();
-  void BeginSession();
+  void EndSession() override;
+  void BeginSession() override;
+
+  void OnStreamVideo(const VideoStreamCallback &callback) override;
 
-  void OnStreamVideo(const VideoStreamCallback &callback);
+  void OnStreamAudio(const AudioStreamCallback &callback) override;
 
-  void OnStreamAudio(const AudioStreamCallback &callback);
+  void OnRawVideo(const RawVideoCallback &callback) override;
 
-  void OnResize(const ResizeCallback &callback);
+  void OnResize(const ResizeCallback &callback) override;
 
-  void OnSessionConnected(const std::function<void()> &callback);
+  void OnSessionConnected(const std::function<void()> &callback) override;
 
-  void OnSessionDisconnected(const std::function<void()> &callback);
+  void OnSessionDisconnected(const std::function<void()> &callback) override;
 
-  bool IsRemoteDesktopActive();
-  bool IsSessionActive();
+  bool IsRemoteDesktopActive() override;
+  bool IsSessionActive() override;
 
-  void Keyboard(int key, int action, int mods);
+  void Keyboard(int key, int action, int mods) override;
 
-  void Mouse(double x, double y);
+  void Mouse(double x, double y) override;
 
-  void MouseButton(int button, int action, int mods);
+  void MouseMotion(int dx, int dy) override;
 
-  void MouseScroll(int x, int y);
+  void MouseButton(int button, int action, int mods) override;
+
+  void MouseScroll(int x, int y) override;
+
+  // Runs on the input thread
+  void AfterInput(std::function<void()> callback) override;
 
 private:
   void Start();
+
+  // Runs `task` on the GLib context thread, in the order posted
+  void Post(std::function<void()> task);
+  void ScheduleDispatch(GMainContext *context);
+  static gboolean DispatchInput(gpointer userData);
   void Initialize();
   void Deinitialize();
 
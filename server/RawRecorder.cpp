@@ -0,0 +1,63 @@
+#include "RawRecorder.h"
+
+#include <iostream>
+#include <stdexcept>
+
+RawRecorder::RawRecorder(const std::string &path, uint32_t width,
+                         uint32_t height, uint32_t format,
+                         uint32_t bytesPerPixel, uint32_t frames,
+                         size_t capacity)
+    : m_Corpus(std::make_unique<FrameCorpusWriter>(path, width, height, format,
+                                                   bytesPerPixel)),
+      m_Queue(capacity), m_Remaining(frames),
+      m_FrameBytes(static_cast<size_t>(width) * height * bytesPerPixel) {
+  m_Writer = std::thread(&RawRecorder::Write, this);
+}
+
+RawRecorder::~RawRecorder() {
+  // Waits for what is still queued, at most `capacity` frames
+  m_Queue.Close();
+
+  if (m_Writer.joinable())
+    m_Writer.join();
+
+  std::cout << "Recorded " << m_Corpus->Frames() << " raw frames";
+  if (m_Dropped.load())
+    std::cout << ", dropped " << m_Dropped.load()
+              << " because the disk fell behind";
+  std::cout << std::endl;
+}
+
+bool RawRecorder::Push(const uint8_t *frame, uint64_t time) {
+  if (!m_Remaining)
+    return false;
+
+  Frame copy;
+  copy.data.assign(frame, frame + m_FrameBytes);
+  copy.time = time;
+
+  if (m_Queue.TryPush(std::move(copy)))
+    m_Remaining--;
+  else
+    m_Dropped++;
+
+  return m_Remaining;
+}
+
+void RawRecorder::Write() {
+  Frame frame;
+  bool failed = false;
+
+  while (m_Queue.Pop(frame)) {
+    if (failed)
+      continue;
+
+    try {
+      m_Corpus->Write(frame.data.data(), frame.time);
+    } catch (const std::exception &e) {
+      // Capture goes on, only the recording stops
+      std::cerr << "Raw recording stopped: " << e.what() << std::endl;
+      failed = true;
+    }
+  }
+}
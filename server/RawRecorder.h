@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "BoundedQueue.h"
+#include "FrameCorpus.h"
+
+// --record-raw. The capture thread only copies frames into a bounded queue,
+// a background thread writes them to the corpus, so a slow disk drops
+// recorded frames rather than stalling capture. One corpus has one size and
+// format.
+class RawRecorder {
+private:
+  struct Frame {
+    std::vector<uint8_t> data;
+    // Capture time in ns
+    uint64_t time = 0;
+  };
+
+  std::unique_ptr<FrameCorpusWriter> m_Corpus;
+
+  BoundedQueue<Frame> m_Queue;
+  std::thread m_Writer;
+
+  // Capture thread only
+  uint32_t m_Remaining = 0;
+  size_t m_FrameBytes = 0;
+  std::atomic<uint64_t> m_Dropped = 0;
+
+public:
+  // Keeps `frames` frames, `capacity` is in frames since each one is large
+  RawRecorder(const std::string &path, uint32_t width, uint32_t height,
+              uint32_t format, uint32_t bytesPerPixel, uint32_t frames,
+              size_t capacity = 8);
+  ~RawRecorder();
+
+  RawRecorder(const RawRecorder &) = delete;
+  RawRecorder &operator=(const RawRecorder &) = delete;
+
+  bool Matches(uint32_t width, uint32_t height, uint32_t format) const {
+    return width == m_Corpus->Width() && height == m_Corpus->Height() &&
+           format == m_Corpus->Format();
+  }
+
+  // Called from the capture thread, never blocks. Returns false once the
+  // last frame wanted was queued
+  bool Push(const uint8_t *frame, uint64_t time);
+
+private:
+  void Write();
+};
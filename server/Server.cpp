@@ -1,5 +1,11 @@
 #include "Server.h"
+#include "CLI11.h"
+#include "Constant.h"
+#include "Metrics.h"
+#include "MetricsExporter.h"
 #include "Payload.h"
+#include "ProbeMarker.h"
+#include "Trace.h"
 #include "Utility.h"
 #include <filesystem>
 
@@ -7,79 +13,226 @@ namespace fs = std::filesystem;
 
 static const std::string HOME_DIR = getHomeDirectory();
 
+static Metrics::Histogram &audioEncodeTime = Metrics::Get().GetHistogram(
+    "ssrd_audio_encode_seconds", "Resampling, encoding and sending a capture chunk");
+static Metrics::Counter &audioPackets = Metrics::Get().GetCounter(
+    "ssrd_audio_packets_total", "Opus packets sent");
+
+Server::Server(std::unique_ptr<MediaSource> source)
+    : m_Source(std::move(source)),
+      m_AuthorizedKeys(HOME_DIR + "/.ssrd/authorized_keys"),
+      m_HostKey(HOME_DIR + "/.ssrd/host_key") {}
+
 Server::~Server() {
   m_Running.store(false);
 
   if (m_InputThread.joinable())
     m_InputThread.join();
+
+  // Its callbacks use everything below
+  m_Source.reset();
+
+  Trace::Shutdown();
 }
 
-void Server::Initialize() {
-  while (m_Running.load()) {
-    // Start listening
-    m_Socket.listen(1998);
+int Server::Initialize(int argc, char *argv[]) {
 
-    // Try authenticating
-    bool authenticated = Authenticate();
-    if (!authenticated) {
-      m_Socket.close(Socket::Close::CLIENT);
-      continue;
-    }
+  // CLI
+  {
+    CLI::App app{"Secure Shell Remote Desktop server"};
 
-    // Inform the client about the connection
-    if (m_Socket.send(&authenticated, sizeof(authenticated)) <= 0) {
-      m_Socket.close(Socket::Close::CLIENT);
-      continue;
-    }
+    app.add_option("--audio-frame", m_AudioFrameMs,
+                   "Opus frame duration in ms: 2.5, 5, 10, 20 (default), 40 "
+                   "or 60. Shorter frames lower latency")
+        ->check(CLI::IsMember({2.5, 5.0, 10.0, 20.0, 40.0, 60.0}));
+
+    std::string metricsPath;
+    app.add_option("--metrics", metricsPath,
+                   "Serve pipeline metrics in the Prometheus text format on "
+                   "this Unix socket");
+
+    app.add_option("--record-raw", m_RawPath,
+                   "Record captured frames as they come from PipeWire to "
+                   "this file, for ssrd-bench video");
+
+    app.add_option("--record-frames", m_RawFrames,
+                   "Frames --record-raw keeps. Defaults to 600")
+        ->check(CLI::PositiveNumber);
+
+    std::string recordPath;
+    app.add_option("--record", recordPath,
+                   "Record every session, as streamed, to this .mkv or .mp4 "
+                   "file. Later sessions and resizes continue in <name>-1, "
+                   "<name>-2 and so on");
+
+    std::string tracePath;
+    app.add_option("--trace", tracePath,
+                   "Record a Chrome trace of the pipeline to this file from "
+                   "the start. SIGUSR1 toggles recording either way");
+
+    CLI11_PARSE(app, argc, argv);
 
+    Trace::Initialize("server", tracePath, !tracePath.empty());
+
+    if (!metricsPath.empty())
+      m_MetricsExporter = std::make_unique<MetricsExporter>(metricsPath);
+
+    if (!recordPath.empty())
+      m_Recorder = std::make_unique<SessionRecorder>(recordPath);
+  }
+
+  while (m_Running.load())
+    Serve(DEFAULT_PORT);
+
+  return EXIT_SUCCESS;
+}
+
+void Server::Serve(uint16_t port) {
+  LoadHostKey();
+
+  // Start listening
+  m_Socket.listen(port);
+
+  // Try authenticating
+  bool authenticated = Authenticate();
+
+  // Inform the client about the connection
+  if (authenticated &&
+      m_Socket.send(&authenticated, sizeof(authenticated)) > 0)
     // Begin the remote connection
     Remote();
+
+  m_Socket.close(Socket::Close::CLIENT);
+}
+
+void Server::AuthorizeKeys(const std::string &directory) {
+  m_AuthorizedKeys = directory;
+}
+
+void Server::HostKey(const std::string &path) {
+  m_HostKey = path;
+  m_HostKeyLoaded = false;
+}
+
+void Server::LoadHostKey() {
+  if (m_HostKeyLoaded)
+    return;
+
+  fs::path path = m_HostKey;
+  if (!fs::exists(path)) {
+    if (path.has_parent_path())
+      fs::create_directories(path.parent_path());
+    OpenSSL::createPrivateKey(path.c_str());
   }
+
+  m_Openssl.loadPrivateKey(path.c_str());
+  m_HostKeyLoaded = true;
+
+  // What clients pin on their first connection
+  std::cout << "Host key fingerprint "
+            << OpenSSL::fingerprint(m_Openssl.publicKey()) << std::endl;
 }
 
 bool Server::Authenticate() {
   std::vector<uint8_t> bytes = randomBytes(256);
 
+  // An ephemeral key exchange rides along with the challenge. The host key
+  // signs the challenge and our public key so the client knows who it talks
+  // to, the client signs the challenge and both public keys, which ties the
+  // session keys to its identity.
+  EVP_PKEY *exchangeKey = m_Openssl.generateExchangeKey();
+  std::vector<uint8_t> serverPublicKey = m_Openssl.rawPublicKey(exchangeKey);
+  std::vector<uint8_t> hostKey = m_Openssl.publicKey();
+  std::vector<uint8_t> hostTranscript =
+      OpenSSL::hostTranscript(bytes, serverPublicKey);
+  std::vector<uint8_t> hostSignature =
+      m_Openssl.sign(hostTranscript.data(), hostTranscript.size());
+
+  Payload challenge;
+  challenge.set(bytes.data(), bytes.size());
+  challenge.set(serverPublicKey.data(), serverPublicKey.size());
+  challenge.set(hostKey.data(), hostKey.size());
+  challenge.set(hostSignature.data(), hostSignature.size());
+
+  bool authenticated = false;
+
   while (true) {
-    if (m_Socket.send(bytes.data(), bytes.size()) <= 0)
+    if (m_Socket.send(challenge.buffer.data(), challenge.buffer.size()) <= 0)
       break;
 
     LOG("Sending random bytes");
 
-    std::vector<uint8_t> signature = {};
+    std::vector<uint8_t> response = {};
 
-    if (m_Socket.read(signature) == -1)
+    if (m_Socket.read(response) == -1)
       break;
 
-    if (signature.size()) {
+    if (response.size()) {
       LOG("Verifing signature");
 
-      fs::path authorizedKeysDir = HOME_DIR + "/.ssrd/authorized_keys";
+      std::vector<uint8_t> signature = Payload::get(0, response);
+      std::vector<uint8_t> clientPublicKey = Payload::get(1, response);
+
+      std::vector<uint8_t> transcript = OpenSSL::handshakeTranscript(
+          bytes, serverPublicKey, clientPublicKey);
+
+      fs::path authorizedKeysDir = m_AuthorizedKeys;
 
       if (fs::is_directory(authorizedKeysDir)) {
         for (const auto &entry : fs::directory_iterator(authorizedKeysDir)) {
           if (entry.is_regular_file()) {
             EVP_PKEY *publicKey = m_Openssl.loadPublicKey(entry.path().c_str());
 
-            if (m_Openssl.verify(publicKey, bytes.data(), bytes.size(),
-                                 static_cast<const uint8_t *>(signature.data()),
-                                 signature.size()))
-              return true;
+            authenticated = m_Openssl.verify(
+                publicKey, transcript.data(), transcript.size(),
+                signature.data(), signature.size());
+            EVP_PKEY_free(publicKey);
+
+            if (authenticated)
+              break;
           }
         }
+      }
 
-        return false;
+      if (authenticated) {
+        try {
+          m_Socket.encrypt(
+              m_Openssl.deriveKeys(exchangeKey, clientPublicKey, transcript,
+                                   Socket::KEY_MATERIAL_SIZE),
+              true);
+        } catch (const std::exception &e) {
+          LOG("Key exchange failed:", e.what());
+          authenticated = false;
+        }
       }
+
+      break;
     }
   }
 
-  return false;
+  EVP_PKEY_free(exchangeKey);
+
+  return authenticated;
 }
 
 void Server::Remote() {
   LOG("Secure connection established");
 
-  m_R2.OnResize([this](int width, int height) {
+  // A new client has to be told the audio format again, the PipeWire thread
+  // does that with its next chunk
+  m_AudioReset.store(true);
+
+  {
+    std::lock_guard<std::mutex> lock(m_ProbeMutex);
+    m_ArmedProbe.reset();
+    m_PendingProbe.reset();
+  }
+  m_ProbeReset.store(true);
+
+  if (m_Recorder)
+    m_Recorder->NewSession();
+
+  m_Source->OnResize([this](int width, int height) {
     m_Encoder.initialize(width, height);
 
     Payload payload;
@@ -90,43 +243,165 @@ void Server::Remote() {
     m_Socket.send(payload.buffer.data(), payload.buffer.size());
   });
 
-  m_R2.OnStreamVideo([this](std::vector<uint8_t> raw, uint64_t time) {
+  if (!m_RawPath.empty())
+    m_Source->OnRawVideo([this](const uint8_t *frame, int width, int height,
+                           spa_video_format format, uint64_t time) {
+      if (!m_RawRecorder && m_RawFrames) {
+        m_RawRecorder = std::make_unique<RawRecorder>(
+            m_RawPath, width, height, format,
+            pixelFormatInfo(format).bytesPerPixel, m_RawFrames);
+        std::cout << "Recording " << m_RawFrames << " raw frames to "
+                  << m_RawPath << std::endl;
+      }
+
+      if (!m_RawRecorder)
+        return;
+
+      // A resize ends the recording, a corpus has one size and format
+      bool changed = !m_RawRecorder->Matches(static_cast<uint32_t>(width),
+                                             static_cast<uint32_t>(height),
+                                             static_cast<uint32_t>(format));
+
+      if (changed || !m_RawRecorder->Push(frame, time)) {
+        m_RawRecorder.reset();
+        m_RawFrames = 0;
+      }
+    });
+
+  m_Source->OnStreamVideo([this](std::vector<uint8_t> raw, uint64_t time) {
+    TRACE_SCOPE(FRAME, time);
+
+    if (m_ProbeReset.exchange(false)) {
+      m_ProbeMarker = 0;
+      m_ProbeDetector.Reset();
+      m_DetectingProbe.reset();
+      m_ProbeDetect = false;
+    }
+
+    std::optional<Probe> probe;
+    {
+      std::lock_guard<std::mutex> lock(m_ProbeMutex);
+
+      if (m_ArmedProbe) {
+        m_ProbeDetector.Arm(m_ArmedProbe->id, m_ArmedProbe->x,
+                            m_ArmedProbe->y);
+        m_ArmedProbe.reset();
+        m_ProbeDetect = true;
+      }
+
+      if (m_PendingProbe && m_PendingProbe->detect) {
+        m_ProbeDetector.Injected(m_PendingProbe->id, m_PendingProbe->injected);
+        m_DetectingProbe = std::exchange(m_PendingProbe, std::nullopt);
+      } else {
+        probe = std::exchange(m_PendingProbe, std::nullopt);
+      }
+    }
+
+    // Detect mode keeps the last frame, so only once a client asked for it
+    if (m_ProbeDetect) {
+      uint32_t id = m_ProbeDetector.Check(raw.data(), m_Encoder.width(),
+                                          m_Encoder.height(), time);
+      if (m_DetectingProbe && id == m_DetectingProbe->id)
+        probe = std::exchange(m_DetectingProbe, std::nullopt);
+    }
+
+    // The first frame captured after the probe was injected, or with
+    // --probe-detect the first one showing its pointer move, carries its id.
+    // Later ones keep it so the client only sees the marker change once
+    if (probe)
+      m_ProbeMarker = probe->id;
+
+    if (m_ProbeMarker)
+      ProbeMarker::Paint(raw.data(), m_Encoder.width(), m_Encoder.height(),
+                         m_ProbeMarker);
+
     std::vector<uint8_t> buffer = m_Encoder.encode(raw);
 
     if (buffer.size() == 0)
       return;
 
-    Payload payload;
-    payload.set("stream-video");
-    payload.set(time);
-    payload.set(buffer.data(), buffer.size());
+    {
+      TRACE_SCOPE(SEND, time);
 
-    if (m_Socket.send(payload.buffer.data(), payload.buffer.size()) == -1)
-      m_R2.EndSession();
-  });
+      Payload payload;
+      payload.set("stream-video");
+      payload.set(time);
+      payload.set(buffer.data(), buffer.size());
 
-  m_R2.OnStreamAudio([this](const Chunk &chunk, uint64_t time) {
-    auto resampled =
-        m_AudioEncoder.LinearResample(chunk.buffer, chunk.sampleRate, 24000);
+      if (m_Socket.send(payload.buffer.data(), payload.buffer.size()) == -1)
+        m_Source->EndSession();
+    }
 
-    std::vector<uint8_t> buffer =
-        m_AudioEncoder.Encode(resampled.data(), resampled.size(), 960);
+    if (m_Recorder)
+      m_Recorder->Video(buffer, time, m_Encoder.width(), m_Encoder.height());
 
-    if (buffer.size() == 0)
+    if (!probe)
       return;
 
-    Payload payload;
-    payload.set("stream-audio");
-    payload.set(time);
-    payload.set(buffer.data(), buffer.size());
+    // Server side stage times, the client lines them up with its own
+    Payload report;
+    report.set("probe-report");
+    report.set(probe->id);
+    report.set(probe->received);
+    report.set(probe->injected);
+    report.set(time);
+    report.set(m_Encoder.timings().converted);
+    report.set(m_Encoder.timings().encoded);
+    report.set(monotonicNs());
+    m_Socket.send(report.buffer.data(), report.buffer.size());
+  });
+
+  m_Source->OnStreamAudio([this](const Chunk &chunk, uint64_t time) {
+    // Only the PipeWire thread gets here
+    Metrics::Timer timer(audioEncodeTime);
+    TRACE_SCOPE(AUDIO_ENCODE, time);
+
+    bool reset = m_AudioReset.exchange(false);
+    if (reset)
+      m_AudioSequence = 0;
 
-    if (m_Socket.send(payload.buffer.data(), payload.buffer.size()) == -1)
-      m_R2.EndSession();
+    if (reset || chunk.sampleRate != m_CaptureRate ||
+        chunk.channels != m_CaptureChannels)
+      ConfigureAudio(chunk.sampleRate, chunk.channels);
+
+    const float *samples = chunk.buffer.data();
+    size_t count = chunk.buffer.size();
+
+    if (m_Resampler) {
+      m_Resampler->Process(samples, count, m_Resampled);
+      samples = m_Resampled.data();
+      count = m_Resampled.size();
+    }
+
+    // Packets can complete with samples from an earlier chunk
+    uint64_t packetTime = time - m_AudioEncoder->PendingNs();
+
+    m_AudioEncoder->Encode(
+        samples, count, [this, &packetTime](const unsigned char *data, int size) {
+          Payload payload;
+          payload.set("stream-audio");
+          payload.set(packetTime);
+          payload.set(m_AudioSequence++);
+          payload.set(data, size);
+
+          if (m_Socket.send(payload.buffer.data(), payload.buffer.size()) == -1)
+            m_Source->EndSession();
+
+          audioPackets.Add();
+
+          if (m_Recorder)
+            m_Recorder->Audio(data, size, packetTime,
+                              m_AudioEncoder->FrameNs(),
+                              m_AudioEncoder->SampleRate(),
+                              m_AudioEncoder->Channels(),
+                              m_AudioEncoder->Lookahead());
+          packetTime += m_AudioEncoder->FrameNs();
+        });
   });
 
   LOG("Remote desktop begin");
 
-  m_R2.OnSessionDisconnected([this]() {
+  m_Source->OnSessionDisconnected([this]() {
     Payload payload;
     payload.set("end-session");
     m_Socket.send(payload.buffer.data(), payload.buffer.size());
@@ -134,11 +409,11 @@ void Server::Remote() {
     LOG("Remote desktop end");
   });
 
-  m_R2.BeginSession();
+  m_Source->BeginSession();
 
-  while (m_R2.IsRemoteDesktopActive()) {
+  while (m_Source->IsRemoteDesktopActive()) {
 
-    if (!m_R2.IsSessionActive()) {
+    if (!m_Source->IsSessionActive()) {
       std::this_thread::sleep_for(std::chrono::seconds(1));
       continue;
     }
@@ -148,34 +423,175 @@ void Server::Remote() {
     if (m_Socket.read(buffer) <= 0)
       break;
 
+    uint64_t received = monotonicNs();
+
     std::vector<uint8_t> bytes = Payload::get(0, buffer);
     auto type =
         std::string(reinterpret_cast<const char *>(bytes.data()), bytes.size());
 
-    if (type == "key") {
-      auto key = Payload::toInt(Payload::get(1, buffer));
-      auto action = Payload::toInt(Payload::get(2, buffer));
-      auto mods = Payload::toInt(Payload::get(3, buffer));
-      m_R2.Keyboard(key, action, mods);
+    // Lets the client estimate the clock offset and round trip (NTP style)
+    if (type == "ping") {
+      Payload payload;
+      payload.set("pong");
+      payload.set(Payload::toUInt64(Payload::get(1, buffer)));
+      payload.set(received);
+      payload.set(monotonicNs());
+      m_Socket.send(payload.buffer.data(), payload.buffer.size());
     }
 
-    if (type == "mouse-move") {
-      auto x = Payload::toDouble(Payload::get(1, buffer));
-      auto y = Payload::toDouble(Payload::get(2, buffer));
-      m_R2.Mouse(x, y);
+    // Every input event the client saw in one pass of its event loop, in
+    // order
+    if (type == "input") {
+      TRACE_SCOPE(INPUT);
+
+      // One pass over the events, the whole batch is dropped if the count
+      // doesn't match what is actually there
+      size_t offset = 0;
+      std::vector<uint8_t> field;
+      Payload::next(buffer, offset, field);
+
+      if (Payload::next(buffer, offset, field) &&
+          field.size() == sizeof(uint32_t)) {
+        uint32_t count = Payload::toUInt32(field);
+        std::vector<std::vector<uint8_t>> events;
+
+        while (events.size() <= count && Payload::next(buffer, offset, field))
+          events.push_back(field);
+
+        if (events.size() == count && offset == buffer.size())
+          for (const std::vector<uint8_t> &event : events)
+            Input(event);
+        else
+          LOG("Dropping input message with", count, "events, found",
+              events.size());
+      }
     }
 
-    if (type == "mouse-button") {
-      auto button = Payload::toInt(Payload::get(1, buffer));
-      auto action = Payload::toInt(Payload::get(2, buffer));
-      auto mods = Payload::toInt(Payload::get(3, buffer));
-      m_R2.MouseButton(button, action, mods);
+    if (type == "keyframe")
+      m_Encoder.requestKeyframe();
+
+    if (type == "mic-format") {
+      int sampleRate = Payload::toUInt32(Payload::get(1, buffer));
+      int channels = Payload::toUInt32(Payload::get(2, buffer));
+
+      try {
+        m_MicrophoneDecoder =
+            std::make_unique<AudioDecoder>(sampleRate, channels);
+        m_Microphone = std::make_unique<VirtualMicrophone>(sampleRate, channels);
+        LOG("Client microphone", sampleRate, "Hz,", channels, "channels");
+      } catch (const std::exception &e) {
+        LOG("Client microphone unavailable:", e.what());
+        m_MicrophoneDecoder.reset();
+        m_Microphone.reset();
+      }
+    }
+
+    if (type == "mic-audio" && m_Microphone) {
+      m_MicrophoneSamples.clear();
+      m_MicrophoneDecoder->Decode(Payload::get(1, buffer), m_MicrophoneSamples);
+      m_Microphone->Write(m_MicrophoneSamples.data(),
+                          m_MicrophoneSamples.size());
     }
+  }
+
+  // Removes the virtual source node along with the client
+  m_Microphone.reset();
+  m_MicrophoneDecoder.reset();
+}
+
+void Server::Input(const std::vector<uint8_t> &event) {
+  std::vector<uint8_t> bytes = Payload::get(0, event);
+  auto type =
+      std::string(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+
+  if (type == "key") {
+    auto key = Payload::toInt(Payload::get(1, event));
+    auto action = Payload::toInt(Payload::get(2, event));
+    auto mods = Payload::toInt(Payload::get(3, event));
+    m_Source->Keyboard(key, action, mods);
+  }
+
+  if (type == "mouse-move") {
+    auto x = Payload::toDouble(Payload::get(1, event));
+    auto y = Payload::toDouble(Payload::get(2, event));
+    m_Source->Mouse(x, y);
+  }
+
+  if (type == "mouse-motion") {
+    auto dx = Payload::toInt(Payload::get(1, event));
+    auto dy = Payload::toInt(Payload::get(2, event));
+    m_Source->MouseMotion(dx, dy);
+  }
 
-    if (type == "mouse-scroll") {
-      auto x = Payload::toInt(Payload::get(1, buffer));
-      auto y = Payload::toInt(Payload::get(2, buffer));
-      m_R2.MouseScroll(x, y);
+  if (type == "mouse-button") {
+    auto button = Payload::toInt(Payload::get(1, event));
+    auto action = Payload::toInt(Payload::get(2, event));
+    auto mods = Payload::toInt(Payload::get(3, event));
+    m_Source->MouseButton(button, action, mods);
+  }
+
+  if (type == "mouse-scroll") {
+    auto x = Payload::toInt(Payload::get(1, event));
+    auto y = Payload::toInt(Payload::get(2, event));
+    m_Source->MouseScroll(x, y);
+  }
+
+  // Latency probe, stamped once the input queued before it went out
+  if (type == "probe") {
+    Probe probe;
+    probe.id = Payload::toUInt32(Payload::get(1, event));
+    probe.received = monotonicNs();
+
+    // --probe-detect, the probe is a pointer move the capture has to show
+    if (Payload::get(2, event).size() == sizeof(double)) {
+      probe.detect = true;
+      probe.x = Payload::toDouble(Payload::get(2, event));
+      probe.y = Payload::toDouble(Payload::get(3, event));
+
+      {
+        std::lock_guard<std::mutex> lock(m_ProbeMutex);
+        m_ArmedProbe = probe;
+      }
+
+      m_Source->Mouse(probe.x, probe.y);
     }
+
+    m_Source->AfterInput([this, probe]() mutable {
+      probe.injected = monotonicNs();
+
+      std::lock_guard<std::mutex> lock(m_ProbeMutex);
+      m_PendingProbe = probe;
+    });
   }
-}
\ No newline at end of file
+}
+
+// Opus only takes 8, 12, 16, 24 and 48 kHz
+static bool isOpusRate(uint32_t sampleRate) {
+  return sampleRate == 8000 || sampleRate == 12000 || sampleRate == 16000 ||
+         sampleRate == 24000 || sampleRate == 48000;
+}
+
+void Server::ConfigureAudio(uint32_t sampleRate, uint32_t channels) {
+  // PipeWire normally hands us the 48 kHz we ask for, anything else is
+  // resampled to it
+  uint32_t encodeRate = isOpusRate(sampleRate) ? sampleRate : 48000;
+
+  m_AudioEncoder = std::make_unique<AudioEncoder>(encodeRate, 64, channels,
+                                                  m_AudioFrameMs);
+  m_Resampler = encodeRate == sampleRate
+                    ? nullptr
+                    : std::make_unique<Resampler>(sampleRate, encodeRate,
+                                                  channels);
+  m_CaptureRate = sampleRate;
+  m_CaptureChannels = channels;
+
+  LOG("Audio capture", sampleRate, "Hz, encoding", encodeRate, "Hz,", channels,
+      "channels");
+
+  Payload payload;
+  payload.set("audio-format");
+  payload.set(encodeRate);
+  payload.set(channels);
+
+  m_Socket.send(payload.buffer.data(), payload.buffer.size());
+}
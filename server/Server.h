@@ -2,35 +2,120 @@
 
 #include "OpenSSL.h"
 // #include "Remote.h"
-#include "R2.h"
 #include "Encoder.h"
+#include "MediaSource.h"
+#include "MetricsExporter.h"
 #include "Socket.h"
+#include "AudioDecoder.h"
 #include "AudioEncoder.h"
+#include "ProbeDetector.h"
+#include "RawRecorder.h"
+#include "Resampler.h"
+#include "SessionRecorder.h"
+#include "VirtualMicrophone.h"
 
 #include <atomic>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
 #include <thread>
+#include <vector>
 
 class Server {
+private:
+  // A client latency probe, stamped as it moves through the pipeline
+  struct Probe {
+    uint32_t id = 0;
+    uint64_t received = 0;
+    uint64_t injected = 0;
+    // --probe-detect, the probe moved the pointer here and waits for a frame
+    // showing it
+    bool detect = false;
+    double x = 0.0;
+    double y = 0.0;
+  };
+
 private:
   // Remote *m_Remote = nullptr;
-  R2 m_R2;
+  std::unique_ptr<MediaSource> m_Source;
   Socket m_Socket;
   OpenSSL m_Openssl;
   Encoder m_Encoder;
-  AudioEncoder m_AudioEncoder{24000};
+  // Created from the first audio chunk and again if the capture format
+  // changes, the resampler only exists when Opus can't take the capture rate
+  std::unique_ptr<AudioEncoder> m_AudioEncoder;
+  std::unique_ptr<Resampler> m_Resampler;
+  std::vector<float> m_Resampled;
+  // Audio state above and below belongs to the PipeWire thread, a new
+  // client asks it to start over through m_AudioReset
+  uint32_t m_CaptureRate = 0;
+  uint32_t m_CaptureChannels = 0;
+  double m_AudioFrameMs = 20.0;
+  // Lets the client tell lost audio packets apart from silence
+  uint32_t m_AudioSequence = 0;
+  std::atomic<bool> m_AudioReset = false;
+
+  // Client microphone, only exists while a client streams one
+  std::unique_ptr<AudioDecoder> m_MicrophoneDecoder;
+  std::unique_ptr<VirtualMicrophone> m_Microphone;
+  std::vector<float> m_MicrophoneSamples;
+
+  // Received, and injected and waiting for the next captured frame, guarded
+  // by m_ProbeMutex
+  std::optional<Probe> m_ArmedProbe;
+  std::optional<Probe> m_PendingProbe;
+  std::mutex m_ProbeMutex;
+  // Id painted into every frame once a client started probing, and detect
+  // mode state. Only touched on the PipeWire thread, a new client asks it to
+  // start over through m_ProbeReset
+  uint32_t m_ProbeMarker = 0;
+  ProbeDetector m_ProbeDetector;
+  std::optional<Probe> m_DetectingProbe;
+  bool m_ProbeDetect = false;
+  std::atomic<bool> m_ProbeReset = false;
+
+  std::unique_ptr<MetricsExporter> m_MetricsExporter;
+
+  // Public keys allowed in, ~/.ssrd/authorized_keys unless set
+  std::string m_AuthorizedKeys;
+  // Proves the server's identity to clients, ~/.ssrd/host_key unless set.
+  // Created on first use, loaded into m_Openssl once
+  std::string m_HostKey;
+  bool m_HostKeyLoaded = false;
+
+  // --record-raw, captured frames for ssrd-bench. Only touched on the
+  // PipeWire thread once the session runs, the recorder writes them on its
+  // own thread
+  std::string m_RawPath;
+  uint32_t m_RawFrames = 600;
+  std::unique_ptr<RawRecorder> m_RawRecorder;
+
+  // --record, the encoded stream muxed to disk
+  std::unique_ptr<SessionRecorder> m_Recorder;
 
   std::atomic<bool> m_Running = true;
 
   std::thread m_InputThread;
 
 public:
-  Server() = default;
+  explicit Server(std::unique_ptr<MediaSource> source);
   ~Server();
 
-  void Initialize();
+  int Initialize(int argc, char *argv[]);
+
+  // Accepts one client on `port` and streams to it until it leaves
+  void Serve(uint16_t port);
+
+  void AuthorizeKeys(const std::string &directory);
+  void HostKey(const std::string &path);
 
   bool Authenticate();
 
   void Remote();
+
+private:
+  void LoadHostKey();
+  void ConfigureAudio(uint32_t sampleRate, uint32_t channels);
+  void Input(const std::vector<uint8_t> &event);
 };
\ No newline at end of file
@@ -0,0 +1,368 @@
+#include "SessionRecorder.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <stdexcept>
+
+#include "H264.h"
+#include "Utility.h"
+
+// Audio normally starts with the session, a file is opened without it if it
+// hasn't by then
+static constexpr uint64_t AUDIO_WAIT_NS = 500'000'000;
+
+static constexpr AVRational NS = {1, 1'000'000'000};
+
+// SPS and PPS of a keyframe, still in Annex B, the muxers convert them to
+// avcC themselves
+static std::vector<uint8_t> parameterSets(const std::vector<uint8_t> &frame) {
+  std::vector<uint8_t> sets;
+
+  H264::ForEachNal(frame.data(), frame.size(),
+                   [&](uint8_t header, const uint8_t *nal, size_t size) {
+                     uint8_t type = header & 0x1F;
+                     if (type != H264::NAL_SPS && type != H264::NAL_PPS)
+                       return;
+
+                     sets.insert(sets.end(), {0, 0, 0, 1});
+                     sets.insert(sets.end(), nal, nal + size);
+                   });
+
+  return sets;
+}
+
+// Identification header from RFC 7845, mapping family 0 (mono or stereo)
+static std::vector<uint8_t> opusHead(int channels, int preSkip,
+                                     int sampleRate) {
+  std::vector<uint8_t> head = {'O', 'p', 'u', 's', 'H', 'e', 'a', 'd', 1};
+  head.push_back(static_cast<uint8_t>(channels));
+  head.push_back(preSkip & 0xFF);
+  head.push_back((preSkip >> 8) & 0xFF);
+  for (int i = 0; i < 4; i++)
+    head.push_back((sampleRate >> (8 * i)) & 0xFF);
+  head.insert(head.end(), {0, 0, 0});
+  return head;
+}
+
+static void setExtradata(AVCodecParameters *parameters,
+                         const std::vector<uint8_t> &data) {
+  parameters->extradata = static_cast<uint8_t *>(
+      av_mallocz(data.size() + AV_INPUT_BUFFER_PADDING_SIZE));
+  if (!parameters->extradata)
+    throw std::runtime_error("Failed to allocate extradata");
+
+  std::copy(data.begin(), data.end(), parameters->extradata);
+  parameters->extradata_size = static_cast<int>(data.size());
+}
+
+static std::string error(int code) {
+  char message[128] = {};
+  av_strerror(code, message, sizeof(message));
+  return message;
+}
+
+SessionRecorder::SessionRecorder(const std::string &path, size_t capacity)
+    : m_Path(path), m_Queue(capacity) {
+  m_Writer = std::thread(&SessionRecorder::Write, this);
+}
+
+SessionRecorder::~SessionRecorder() {
+  m_Queue.Close();
+
+  if (m_Writer.joinable())
+    m_Writer.join();
+
+  if (m_Dropped.load())
+    std::cout << "Recording dropped " << m_Dropped.load()
+              << " packets, the disk fell behind" << std::endl;
+}
+
+void SessionRecorder::NewSession() { m_Session++; }
+
+void SessionRecorder::Video(const std::vector<uint8_t> &data, uint64_t time,
+                            int width, int height) {
+  bool keyframe = H264::IsKeyframe(data.data(), data.size());
+
+  // Later frames reference the one that was dropped
+  if (m_WaitForKeyframe && !keyframe) {
+    m_Dropped++;
+    return;
+  }
+
+  Packet packet;
+  packet.data = data;
+  packet.time = time;
+  packet.session = m_Session.load();
+  packet.video = true;
+  packet.width = width;
+  packet.height = height;
+
+  m_WaitForKeyframe = !m_Queue.TryPush(std::move(packet));
+  if (m_WaitForKeyframe)
+    m_Dropped++;
+}
+
+void SessionRecorder::Audio(const uint8_t *data, size_t size, uint64_t time,
+                            uint64_t duration, int sampleRate, int channels,
+                            int preSkip) {
+  Packet packet;
+  packet.data.assign(data, data + size);
+  packet.time = time;
+  packet.session = m_Session.load();
+  packet.duration = duration;
+  packet.sampleRate = sampleRate;
+  packet.channels = channels;
+  packet.preSkip = preSkip;
+
+  if (!m_Queue.TryPush(std::move(packet)))
+    m_Dropped++;
+}
+
+void SessionRecorder::Write() {
+  Packet packet;
+
+  while (m_Queue.Pop(packet)) {
+    if (m_Failed)
+      continue;
+
+    try {
+      Handle(packet);
+    } catch (const std::exception &e) {
+      // The stream goes on, only the recording stops
+      std::cerr << "Recording stopped: " << e.what() << std::endl;
+      m_Failed = true;
+      m_Pending.clear();
+
+      if (m_Format) {
+        avio_closep(&m_Format->pb);
+        avformat_free_context(m_Format);
+        m_Format = nullptr;
+      }
+    }
+  }
+
+  if (m_Failed)
+    return;
+
+  try {
+    if (!m_Pending.empty())
+      Open();
+    Close();
+  } catch (const std::exception &e) {
+    std::cerr << "Recording stopped: " << e.what() << std::endl;
+  }
+}
+
+void SessionRecorder::Handle(Packet &packet) {
+  bool changed = packet.session != m_SegmentSession ||
+                 (packet.video &&
+                  (packet.width != m_Width || packet.height != m_Height));
+
+  // Whatever the last file was still waiting on won't come anymore
+  if (changed && !m_Pending.empty())
+    Open();
+
+  if (m_Format && changed)
+    Close();
+
+  if (!packet.video) {
+    m_AudioFormat.session = packet.session;
+    m_AudioFormat.sampleRate = packet.sampleRate;
+    m_AudioFormat.channels = packet.channels;
+    m_AudioFormat.preSkip = packet.preSkip;
+  }
+
+  if (m_Format) {
+    Mux(packet);
+    return;
+  }
+
+  // A file starts on a keyframe, nothing before it can be decoded
+  if (m_Pending.empty()) {
+    if (!packet.video || !H264::IsKeyframe(packet.data.data(),
+                                           packet.data.size()))
+      return;
+
+    m_SegmentSession = packet.session;
+    m_Width = packet.width;
+    m_Height = packet.height;
+  }
+
+  if (!m_Pending.empty() && packet.time < m_Pending.front().time)
+    return;
+
+  m_Pending.push_back(std::move(packet));
+
+  bool audioKnown = m_AudioFormat.sampleRate &&
+                    m_AudioFormat.session == m_SegmentSession;
+
+  if (audioKnown ||
+      m_Pending.back().time - m_Pending.front().time > AUDIO_WAIT_NS)
+    Open();
+}
+
+void SessionRecorder::Open() {
+  std::filesystem::path path = m_Path;
+  if (m_Segments)
+    path.replace_filename(path.stem().string() + "-" +
+                          std::to_string(m_Segments) +
+                          path.extension().string());
+  m_SegmentPath = path.string();
+  m_Segments++;
+
+  if (avformat_alloc_output_context2(&m_Format, nullptr, nullptr,
+                                     m_SegmentPath.c_str()) < 0 ||
+      !m_Format)
+    throw std::runtime_error("No container for " + m_SegmentPath +
+                             ", use .mkv or .mp4");
+
+  const Packet &keyframe = m_Pending.front();
+
+  m_VideoStream = avformat_new_stream(m_Format, nullptr);
+  if (!m_VideoStream)
+    throw std::runtime_error("Failed to add the video stream");
+
+  AVCodecParameters *video = m_VideoStream->codecpar;
+  video->codec_type = AVMEDIA_TYPE_VIDEO;
+  video->codec_id = AV_CODEC_ID_H264;
+  video->width = keyframe.width;
+  video->height = keyframe.height;
+  setExtradata(video, parameterSets(keyframe.data));
+  m_VideoStream->time_base = AVRational{1, 90000};
+
+  m_AudioStream = nullptr;
+  m_AudioSampleRate = m_AudioFormat.sampleRate;
+  m_AudioChannels = m_AudioFormat.channels;
+
+  if (m_AudioFormat.sampleRate && m_AudioFormat.session == m_SegmentSession) {
+    m_AudioStream = avformat_new_stream(m_Format, nullptr);
+    if (!m_AudioStream)
+      throw std::runtime_error("Failed to add the audio stream");
+
+    // Opus is always timed at 48 kHz in a container, whatever it was
+    // encoded at
+    int preSkip = m_AudioFormat.preSkip * 48000 / m_AudioFormat.sampleRate;
+
+    AVCodecParameters *audio = m_AudioStream->codecpar;
+    audio->codec_type = AVMEDIA_TYPE_AUDIO;
+    audio->codec_id = AV_CODEC_ID_OPUS;
+    audio->sample_rate = 48000;
+    av_channel_layout_default(&audio->ch_layout, m_AudioFormat.channels);
+    audio->initial_padding = preSkip;
+    setExtradata(audio, opusHead(m_AudioFormat.channels, preSkip,
+                                 m_AudioFormat.sampleRate));
+    m_AudioStream->time_base = AVRational{1, 48000};
+  }
+
+  if (!(m_Format->oformat->flags & AVFMT_NOFILE)) {
+    int result = avio_open(&m_Format->pb, m_SegmentPath.c_str(),
+                           AVIO_FLAG_WRITE);
+    if (result < 0)
+      throw std::runtime_error("Failed to open " + m_SegmentPath + ": " +
+                               error(result));
+  }
+
+  // Fragments at keyframes keep everything up to the last one playable if
+  // the server dies, Matroska is like that already
+  AVDictionary *options = nullptr;
+  av_dict_set(&options, "movflags", "frag_keyframe+empty_moov+default_base_moof",
+              0);
+
+  int result = avformat_write_header(m_Format, &options);
+  av_dict_free(&options);
+
+  if (result < 0)
+    throw std::runtime_error("Failed to write the header of " +
+                             m_SegmentPath + ": " + error(result));
+
+  m_Start = keyframe.time;
+  m_LastVideoPts = -1;
+  m_NextAudioPts = -1;
+  m_Frames = 0;
+
+  std::cout << "Recording to " << m_SegmentPath
+            << (m_AudioStream ? "" : ", no audio") << std::endl;
+
+  for (const Packet &pending : m_Pending)
+    Mux(pending);
+  m_Pending.clear();
+}
+
+void SessionRecorder::Close() {
+  m_Pending.clear();
+
+  if (!m_Format)
+    return;
+
+  int result = av_write_trailer(m_Format);
+
+  if (!(m_Format->oformat->flags & AVFMT_NOFILE))
+    avio_closep(&m_Format->pb);
+
+  avformat_free_context(m_Format);
+  m_Format = nullptr;
+  m_VideoStream = nullptr;
+  m_AudioStream = nullptr;
+
+  if (result < 0)
+    throw std::runtime_error("Failed to finish " + m_SegmentPath + ": " +
+                             error(result));
+
+  std::cout << "Recorded " << m_Frames << " frames to " << m_SegmentPath
+            << std::endl;
+}
+
+void SessionRecorder::Mux(const Packet &packet) {
+  if (packet.time < m_Start)
+    return;
+
+  AVStream *stream = packet.video ? m_VideoStream : m_AudioStream;
+
+  // Started without audio or in another format, it waits for the next file
+  if (!stream ||
+      (!packet.video &&
+       (packet.sampleRate != m_AudioSampleRate ||
+        packet.channels != m_AudioChannels)))
+    return;
+
+  int64_t pts = av_rescale_q(packet.time - m_Start, NS, stream->time_base);
+  int64_t duration = av_rescale_q(packet.duration, NS, stream->time_base);
+
+  if (packet.video) {
+    // Timestamps have to increase strictly
+    pts = std::max(pts, m_LastVideoPts + 1);
+    m_LastVideoPts = pts;
+    m_Frames++;
+  } else {
+    // Opus packets follow each other without gaps, the capture stamps
+    // jitter a little around that
+    if (m_NextAudioPts >= 0 && std::abs(pts - m_NextAudioPts) < duration)
+      pts = m_NextAudioPts;
+    pts = std::max(pts, m_NextAudioPts);
+    m_NextAudioPts = pts + duration;
+  }
+
+  AVPacket *avPacket = av_packet_alloc();
+  if (!avPacket)
+    throw std::runtime_error("Failed to allocate packet");
+
+  // Not reference counted, the muxer copies what it keeps
+  avPacket->data = const_cast<uint8_t *>(packet.data.data());
+  avPacket->size = static_cast<int>(packet.data.size());
+  avPacket->stream_index = stream->index;
+  avPacket->pts = pts;
+  avPacket->dts = pts;
+  avPacket->duration = duration;
+
+  if (packet.video && H264::IsKeyframe(packet.data.data(), packet.data.size()))
+    avPacket->flags |= AV_PKT_FLAG_KEY;
+
+  int result = av_interleaved_write_frame(m_Format, avPacket);
+  av_packet_free(&avPacket);
+
+  if (result < 0)
+    throw std::runtime_error("Failed to write to " + m_SegmentPath + ": " +
+                             error(result));
+}
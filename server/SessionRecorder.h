@@ -0,0 +1,104 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "BoundedQueue.h"
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+// Muxes the encoded H.264 and Opus packets the server streams into a
+// Matroska or fragmented MP4 file (picked by extension), without decoding
+// or re-encoding anything. The streaming thread only copies packets into a
+// bounded queue, a background thread does the muxing and disk writes, so a
+// slow disk drops recorded frames rather than stalling the stream. After a
+// dropped video packet the recording resumes at the next keyframe.
+//
+// A file starts on a keyframe. A new client session or a resize finishes it
+// and starts the next one as <name>-1.<ext>, <name>-2.<ext> and so on.
+class SessionRecorder {
+private:
+  struct Packet {
+    std::vector<uint8_t> data;
+    // Server capture time in ns
+    uint64_t time = 0;
+    uint32_t session = 0;
+    bool video = false;
+
+    int width = 0;
+    int height = 0;
+
+    uint64_t duration = 0;
+    int sampleRate = 0;
+    int channels = 0;
+    // Opus encoder lookahead in samples at sampleRate
+    int preSkip = 0;
+  };
+
+  std::string m_Path;
+
+  BoundedQueue<Packet> m_Queue;
+  std::thread m_Writer;
+
+  std::atomic<uint32_t> m_Session = 0;
+  // Streaming thread only
+  bool m_WaitForKeyframe = true;
+  std::atomic<uint64_t> m_Dropped = 0;
+
+  // Writer thread only
+  AVFormatContext *m_Format = nullptr;
+  AVStream *m_VideoStream = nullptr;
+  AVStream *m_AudioStream = nullptr;
+  // What the audio stream was opened with
+  int m_AudioSampleRate = 0;
+  int m_AudioChannels = 0;
+  std::string m_SegmentPath;
+  uint32_t m_Segments = 0;
+  bool m_Failed = false;
+
+  uint32_t m_SegmentSession = 0;
+  int m_Width = 0;
+  int m_Height = 0;
+  // Latest audio packet's format, the one the next file is opened with
+  Packet m_AudioFormat;
+
+  uint64_t m_Start = 0;
+  int64_t m_LastVideoPts = -1;
+  int64_t m_NextAudioPts = -1;
+  uint64_t m_Frames = 0;
+
+  // Waiting for the audio format before the file can be opened
+  std::vector<Packet> m_Pending;
+
+public:
+  // `capacity` is in packets, a few seconds of audio and video by default
+  explicit SessionRecorder(const std::string &path, size_t capacity = 512);
+  ~SessionRecorder();
+
+  SessionRecorder(const SessionRecorder &) = delete;
+  SessionRecorder &operator=(const SessionRecorder &) = delete;
+
+  // Packets after this go into a new file
+  void NewSession();
+
+  // Called from the thread that streams, never blocks
+  void Video(const std::vector<uint8_t> &data, uint64_t time, int width,
+             int height);
+  void Audio(const uint8_t *data, size_t size, uint64_t time,
+             uint64_t duration, int sampleRate, int channels, int preSkip);
+
+  // Packets dropped because the writer fell behind
+  uint64_t Dropped() const { return m_Dropped.load(); }
+
+private:
+  void Write();
+  void Handle(Packet &packet);
+  void Open();
+  void Close();
+  void Mux(const Packet &packet);
+};
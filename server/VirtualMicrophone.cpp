@@ -0,0 +1,179 @@
+#include "VirtualMicrophone.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+#include "Utility.h"
+
+constexpr uint64_t ONE_SECOND_NS = 1'000'000'000ULL;
+// Buffered before playback starts, absorbs the client's packet jitter
+constexpr uint64_t PRIME_NS = 20'000'000; // 20 ms
+// Anything queued beyond this is dropped to keep the conversation live
+constexpr uint64_t MAX_BUFFERED_NS = 60'000'000; // 60 ms
+// Quantum we ask the graph for
+constexpr uint64_t QUANTUM_NS = 10'000'000; // 10 ms
+
+VirtualMicrophone::VirtualMicrophone(int sampleRate, int channels)
+    : m_SampleRate(sampleRate), m_Channels(channels),
+      m_Ring(static_cast<size_t>(sampleRate) * channels) {
+  pw_init(nullptr, nullptr);
+
+  // The destructor doesn't run for a constructor that throws
+  try {
+    m_Loop = pw_thread_loop_new("ssrd-microphone", nullptr);
+    if (!m_Loop)
+      throw std::runtime_error("Failed to create pipewire thread loop");
+
+    m_Context = pw_context_new(pw_thread_loop_get_loop(m_Loop), nullptr, 0);
+    if (!m_Context)
+      throw std::runtime_error("Failed to create pipewire context");
+
+    // Our own connection to the daemon, the portal's fd only exposes the
+    // screencast nodes
+    m_Core = pw_context_connect(m_Context, nullptr, 0);
+    if (!m_Core)
+      throw std::runtime_error("Failed to connect to pipewire");
+
+    std::string latency =
+        std::to_string(sampleRate * QUANTUM_NS / ONE_SECOND_NS) + "/" +
+        std::to_string(sampleRate);
+
+    // No media category: "Playback" would have session managers route the
+    // node as an output, and a source isn't capturing anything itself
+    pw_properties *properties = pw_properties_new(
+        PW_KEY_MEDIA_TYPE, "Audio", PW_KEY_MEDIA_ROLE, "Communication",
+        PW_KEY_MEDIA_CLASS, "Audio/Source", PW_KEY_NODE_NAME,
+        "ssrd-microphone", PW_KEY_NODE_DESCRIPTION, "Remote desktop microphone",
+        PW_KEY_NODE_LATENCY, latency.c_str(), NULL);
+
+    m_StreamEvents.version = PW_VERSION_STREAM_EVENTS;
+    m_StreamEvents.process = OnProcess;
+
+    m_Stream = pw_stream_new(m_Core, "ssrd-microphone", properties);
+    if (!m_Stream)
+      throw std::runtime_error("Failed to create pipewire microphone stream");
+
+    pw_stream_add_listener(m_Stream, &m_StreamListener, &m_StreamEvents, this);
+
+    uint8_t buffer[1024];
+    struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+    const struct spa_pod *params[1];
+
+    struct spa_audio_info_raw info = {
+        .format = SPA_AUDIO_FORMAT_F32,
+        .rate = static_cast<uint32_t>(sampleRate),
+        .channels = static_cast<uint32_t>(channels)};
+
+    params[0] = spa_format_audio_raw_build(&b, SPA_PARAM_EnumFormat, &info);
+
+    // Not autoconnected, it is a source applications link to
+    if (pw_stream_connect(m_Stream, PW_DIRECTION_OUTPUT, PW_ID_ANY,
+                          (pw_stream_flags)(PW_STREAM_FLAG_MAP_BUFFERS |
+                                            PW_STREAM_FLAG_RT_PROCESS),
+                          params, 1) < 0)
+      throw std::runtime_error("Failed to connect pipewire microphone stream");
+
+    if (pw_thread_loop_start(m_Loop) < 0)
+      throw std::runtime_error("Failed to start pipewire thread loop");
+  } catch (...) {
+    Destroy();
+    throw;
+  }
+}
+
+VirtualMicrophone::~VirtualMicrophone() { Destroy(); }
+
+void VirtualMicrophone::Destroy() {
+  if (m_Loop)
+    pw_thread_loop_stop(m_Loop);
+
+  if (m_Stream)
+    pw_stream_destroy(m_Stream);
+
+  if (m_Core)
+    pw_core_disconnect(m_Core);
+
+  if (m_Context)
+    pw_context_destroy(m_Context);
+
+  if (m_Loop)
+    pw_thread_loop_destroy(m_Loop);
+
+  m_Stream = nullptr;
+  m_Core = nullptr;
+  m_Context = nullptr;
+  m_Loop = nullptr;
+
+  pw_deinit();
+}
+
+void VirtualMicrophone::Write(const float *samples, size_t count) {
+  // Whole frames only so the channels stay interleaved when full
+  size_t space = m_Ring.Free();
+  space -= space % m_Channels;
+
+  m_Samples.Add(m_Ring.Write(samples, std::min(count, space)));
+}
+
+uint64_t VirtualMicrophone::Underruns() const { return m_Underruns.Value(); }
+
+void VirtualMicrophone::OnProcess(void *userData) {
+  auto *self = static_cast<VirtualMicrophone *>(userData);
+
+  pw_buffer *b = pw_stream_dequeue_buffer(self->m_Stream);
+  if (!b)
+    return;
+
+  spa_data *d = &b->buffer->datas[0];
+  float *out = static_cast<float *>(d->data);
+  if (!out) {
+    pw_stream_queue_buffer(self->m_Stream, b);
+    return;
+  }
+
+  uint32_t stride = sizeof(float) * self->m_Channels;
+  uint32_t frames = d->maxsize / stride;
+  if (b->requested)
+    frames = std::min(frames, static_cast<uint32_t>(b->requested));
+
+  size_t wanted = static_cast<size_t>(frames) * self->m_Channels;
+  if (!wanted) {
+    pw_stream_queue_buffer(self->m_Stream, b);
+    return;
+  }
+
+  size_t samplesPerSecond =
+      static_cast<size_t>(self->m_SampleRate) * self->m_Channels;
+  size_t prime = samplesPerSecond * PRIME_NS / ONE_SECOND_NS;
+  size_t limit = samplesPerSecond * MAX_BUFFERED_NS / ONE_SECOND_NS;
+
+  size_t buffered = self->m_Ring.Size();
+
+  if (!self->m_Primed && buffered >= prime)
+    self->m_Primed = true;
+
+  // Fell behind, skip ahead to the prime level using the output as scratch
+  while (buffered > limit) {
+    size_t excess = buffered - prime;
+    excess -= excess % self->m_Channels;
+    buffered -= self->m_Ring.Read(out, std::min(excess, wanted));
+  }
+
+  size_t read = self->m_Primed ? self->m_Ring.Read(out, wanted) : 0;
+
+  if (read < wanted) {
+    std::fill(out + read, out + wanted, 0.0f);
+
+    if (self->m_Primed) {
+      self->m_Underruns.Add();
+      self->m_Primed = false;
+    }
+  }
+
+  d->chunk->offset = 0;
+  d->chunk->stride = stride;
+  d->chunk->size = frames * stride;
+
+  pw_stream_queue_buffer(self->m_Stream, b);
+}
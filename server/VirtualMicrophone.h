@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <pipewire/pipewire.h>
+#include <spa/param/audio/format-utils.h>
+
+#include "Metrics.h"
+#include "SpscRing.h"
+
+// PipeWire Audio/Source node that plays back the client's microphone so
+// applications on this machine can pick it as an input. Runs on its own
+// thread loop and core, independent of the portal session.
+class VirtualMicrophone {
+private:
+  pw_thread_loop *m_Loop = nullptr;
+  pw_context *m_Context = nullptr;
+  pw_core *m_Core = nullptr;
+  pw_stream *m_Stream = nullptr;
+  spa_hook m_StreamListener{};
+  pw_stream_events m_StreamEvents{};
+
+  int m_SampleRate;
+  int m_Channels;
+
+  // Written by the socket thread, read by the PipeWire process callback
+  SpscRing<float> m_Ring;
+  // Only touched by the process callback, set once enough audio is buffered
+  // to ride out network jitter
+  bool m_Primed = false;
+
+  Metrics::Counter &m_Underruns = Metrics::Get().GetCounter(
+      "ssrd_microphone_underruns_total",
+      "Virtual microphone quanta that ran dry");
+  Metrics::Counter &m_Samples = Metrics::Get().GetCounter(
+      "ssrd_microphone_samples_total",
+      "Client microphone samples queued for the virtual source");
+
+  static void OnProcess(void *userData);
+
+  // Tears down whatever exists, for the destructor and a failed constructor
+  void Destroy();
+
+public:
+  VirtualMicrophone(int sampleRate, int channels);
+  ~VirtualMicrophone();
+
+  // Interleaved float samples from the decoder
+  void Write(const float *samples, size_t count);
+
+  uint64_t Underruns() const;
+};
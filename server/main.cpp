@@ -1,11 +1,12 @@
 #include <signal.h>
 
+#include "R2.h"
 #include "Server.h"
 
 int main(int argc, char *argv[]) {
   LOG("ssrd-server");
   signal(SIGPIPE, SIG_IGN);
 
-  Server server;
-  server.Initialize();
+  Server server(std::make_unique<R2>());
+  return server.Initialize(argc, argv);
 }
\ No newline at end of file